@@ -7,6 +7,7 @@
 
 #include <errno.h>
 #include <lzma.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,7 +25,8 @@
 #define DL_SYMBOL_TABLE(M)     \
 	M(lzma_stream_decoder) \
 	M(lzma_code)           \
-	M(lzma_end)
+	M(lzma_end)            \
+	M(lzma_memusage)
 
 DL_SYMBOL_TABLE(DECLARE_SYM)
 
@@ -42,105 +44,227 @@ static int dlopen_lzma(void)
 #endif
 }
 
+/*
+ * The multi-threaded decoder is only in liblzma >= 5.4, so it's resolved apart
+ * from the symbols that are always needed: if liblzma doesn't have it, modules
+ * are decompressed in a single thread.
+ */
+#if LZMA_VERSION >= UINT32_C(50040002)
+#define XZ_DECODER_MT 1
+
+#define DL_SYMBOL_TABLE_MT(M) M(lzma_stream_decoder_mt)
+
+DL_SYMBOL_TABLE_MT(DECLARE_SYM)
+#else
+#define XZ_DECODER_MT 0
+#endif
+
+static bool dlopen_lzma_mt(void)
+{
+#if !XZ_DECODER_MT
+	return false;
+#elif !DLSYM_LOCALLY_ENABLED
+	return true;
+#else
+	static void *dl;
+	static bool missing;
+
+	if (__atomic_load_n(&missing, __ATOMIC_RELAXED))
+		return false;
+
+	if (dlsym_many(&dl, "liblzma.so.5", DL_SYMBOL_TABLE_MT(DLSYM_ARG) NULL) < 0) {
+		__atomic_store_n(&missing, true, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+#endif
+}
+
 static void xz_uncompress_belch(struct kmod_file *file, lzma_ret ret)
 {
 	switch (ret) {
 	case LZMA_MEM_ERROR:
-		ERR(file->ctx, "xz: %s\n", strerror(ENOMEM));
+		FILE_ERR(file, "xz: %s\n", strerror(ENOMEM));
 		break;
 	case LZMA_FORMAT_ERROR:
-		ERR(file->ctx, "xz: File format not recognized\n");
+		FILE_ERR(file, "xz: File format not recognized\n");
 		break;
 	case LZMA_OPTIONS_ERROR:
-		ERR(file->ctx, "xz: Unsupported compression options\n");
+		FILE_ERR(file, "xz: Unsupported compression options\n");
 		break;
 	case LZMA_DATA_ERROR:
-		ERR(file->ctx, "xz: File is corrupt\n");
+		FILE_ERR(file, "xz: File is corrupt\n");
 		break;
 	case LZMA_BUF_ERROR:
-		ERR(file->ctx, "xz: Unexpected end of input\n");
+		FILE_ERR(file, "xz: Unexpected end of input\n");
 		break;
 	default:
-		ERR(file->ctx, "xz: Internal error (bug)\n");
+		FILE_ERR(file, "xz: Internal error (bug)\n");
 		break;
 	}
 }
 
-static int xz_uncompress(lzma_stream *strm, struct kmod_file *file)
+/* kept in the pool of the context, with the input buffer */
+struct xz_decoder {
+	lzma_stream strm;
+	uint8_t in_buf[64 * 1024];
+};
+
+static void xz_decoder_free(void *decoder)
+{
+	struct xz_decoder *xz = decoder;
+
+	sym_lzma_end(&xz->strm);
+	free(xz);
+}
+
+static int xz_uncompress(struct xz_decoder *xz, struct kmod_file *file)
 {
-	uint8_t in_buf[BUFSIZ], out_buf[BUFSIZ];
+	lzma_stream *strm = &xz->strm;
 	lzma_action action = LZMA_RUN;
-	lzma_ret ret;
-	void *p = NULL;
 	size_t total = 0;
+	off_t offset = 0;
+	lzma_ret lzret;
+	int ret;
 
 	strm->avail_in = 0;
-	strm->next_out = out_buf;
-	strm->avail_out = sizeof(out_buf);
 
-	while (true) {
-		if (strm->avail_in == 0) {
-			ssize_t rdret = read(file->fd, in_buf, sizeof(in_buf));
+	/* decompress right into the buffer, growing it as needed */
+	ret = kmod_file_buf_reserve(file, 4 * sizeof(xz->in_buf));
+	if (ret < 0)
+		goto out;
+
+	for (;;) {
+		if (strm->avail_in == 0 && action == LZMA_RUN) {
+			ssize_t rdret = pread(file->fd, xz->in_buf, sizeof(xz->in_buf), offset);
 			if (rdret < 0) {
 				ret = -errno;
 				goto out;
 			}
-			strm->next_in = in_buf;
+			strm->next_in = xz->in_buf;
 			strm->avail_in = rdret;
+			offset += rdret;
 			if (rdret == 0)
 				action = LZMA_FINISH;
 		}
-		ret = sym_lzma_code(strm, action);
-		if (strm->avail_out == 0 || ret != LZMA_OK) {
-			size_t write_size = BUFSIZ - strm->avail_out;
-			char *tmp = realloc(p, total + write_size);
-			if (tmp == NULL) {
-				ret = -ENOMEM;
-				goto out;
-			}
-			memcpy(tmp + total, out_buf, write_size);
-			total += write_size;
-			p = tmp;
-			strm->next_out = out_buf;
-			strm->avail_out = BUFSIZ;
-		}
-		if (ret == LZMA_STREAM_END)
+
+		strm->next_out = (uint8_t *)file->memory + total;
+		strm->avail_out = file->capacity - total;
+
+		lzret = sym_lzma_code(strm, action);
+		total = file->capacity - strm->avail_out;
+
+		if (lzret == LZMA_STREAM_END)
 			break;
-		if (ret != LZMA_OK) {
-			xz_uncompress_belch(file, ret);
+		if (lzret != LZMA_OK) {
+			xz_uncompress_belch(file, lzret);
 			ret = -EINVAL;
 			goto out;
 		}
+
+		if (strm->avail_out == 0) {
+			ret = kmod_file_buf_reserve(file, file->capacity + 1);
+			if (ret < 0)
+				goto out;
+		}
 	}
-	file->memory = p;
+
 	file->size = total;
-	return 0;
+	ret = 0;
+
 out:
-	free(p);
+	if (ret < 0)
+		kmod_file_buf_release(file);
+
 	return ret;
 }
 
+/*
+ * Set up the multi-threaded decoder, if more than 1 thread may be used. It only
+ * decodes blocks in parallel if their sizes are in the block headers, which xz
+ * stores when it compresses with several threads; otherwise it decodes in the
+ * calling thread, like the single-threaded one.
+ */
+static lzma_ret xz_decoder_mt(struct xz_decoder *xz, struct kmod_file *file)
+{
+#if XZ_DECODER_MT
+	unsigned int threads = kmod_get_decompress_threads(file->ctx);
+	lzma_mt mt = {
+		.flags = LZMA_CONCATENATED,
+		/* fall back to a single thread rather than use more memory */
+		.memlimit_threading = 256 * 1024 * 1024,
+		.memlimit_stop = UINT64_MAX,
+	};
+	lzma_ret lzret;
+
+	if (threads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = n > 0 ? (unsigned int)n : 1;
+	}
+
+	if (threads < 2 || !dlopen_lzma_mt())
+		return LZMA_OPTIONS_ERROR;
+
+	mt.threads = threads;
+	lzret = sym_lzma_stream_decoder_mt(&xz->strm, &mt);
+	if (lzret == LZMA_OK)
+		FILE_DBG(file, "xz: decompressing with up to %u threads\n", threads);
+
+	return lzret;
+#else
+	return LZMA_OPTIONS_ERROR;
+#endif
+}
+
 int kmod_file_load_xz(struct kmod_file *file)
 {
-	lzma_stream strm = LZMA_STREAM_INIT;
+	struct xz_decoder *xz;
 	lzma_ret lzret;
+	bool mt;
 	int ret;
 
 	ret = dlopen_lzma();
 	if (ret < 0) {
-		ERR(file->ctx, "xz: can't load and resolve symbols (%s)", strerror(-ret));
+		FILE_ERR(file, "xz: can't load and resolve symbols (%s)", strerror(-ret));
 		return -EINVAL;
 	}
 
-	lzret = sym_lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+	/* setting up a decoder again reuses what the stream allocated */
+	xz = kmod_file_decoder_get(file);
+	if (xz == NULL) {
+		xz = malloc(sizeof(*xz));
+		if (xz == NULL)
+			return -ENOMEM;
+		xz->strm = (lzma_stream)LZMA_STREAM_INIT;
+	}
+
+	lzret = xz_decoder_mt(xz, file);
+	mt = lzret == LZMA_OK;
+	if (!mt)
+		lzret = sym_lzma_stream_decoder(&xz->strm, UINT64_MAX, LZMA_CONCATENATED);
 	if (lzret == LZMA_MEM_ERROR) {
-		ERR(file->ctx, "xz: %s\n", strerror(ENOMEM));
+		FILE_ERR(file, "xz: %s\n", strerror(ENOMEM));
+		xz_decoder_free(xz);
 		return -ENOMEM;
 	} else if (lzret != LZMA_OK) {
-		ERR(file->ctx, "xz: Internal error (bug)\n");
+		FILE_ERR(file, "xz: Internal error (bug)\n");
+		xz_decoder_free(xz);
 		return -EINVAL;
 	}
-	ret = xz_uncompress(&strm, file);
-	sym_lzma_end(&strm);
+
+	ret = xz_uncompress(xz, file);
+
+	/*
+	 * The multi-threaded decoder keeps its threads and their buffers until
+	 * it's ended, so only the single-threaded one is pooled
+	 */
+	if (mt)
+		xz_decoder_free(xz);
+	else
+		kmod_file_decoder_put(file, xz, sizeof(*xz) + sym_lzma_memusage(&xz->strm),
+				      xz_decoder_free);
+
 	return ret;
 }
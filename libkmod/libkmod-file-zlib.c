@@ -6,6 +6,7 @@
 #define DLSYM_LOCALLY_ENABLED ENABLE_ZLIB_DLOPEN
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,13 +22,11 @@
 #include "libkmod-internal.h"
 #include "libkmod-internal-file.h"
 
-#define READ_STEP (4 * 1024 * 1024)
-
 #define DL_SYMBOL_TABLE(M) \
-	M(gzclose)         \
-	M(gzdopen)         \
-	M(gzerror)         \
-	M(gzread)
+	M(inflate)         \
+	M(inflateEnd)      \
+	M(inflateInit2_)   \
+	M(inflateReset)
 
 DL_SYMBOL_TABLE(DECLARE_SYM)
 
@@ -45,67 +44,155 @@ static int dlopen_zlib(void)
 #endif
 }
 
+/* kept in the pool of the context, with the input buffer */
+struct zlib_decoder {
+	z_stream strm;
+	uint8_t in_buf[64 * 1024];
+};
+
+static void zlib_decoder_free(void *decoder)
+{
+	struct zlib_decoder *z = decoder;
+
+	sym_inflateEnd(&z->strm);
+	free(z);
+}
+
+static struct zlib_decoder *zlib_decoder_get(struct kmod_file *file)
+{
+	struct zlib_decoder *z = kmod_file_decoder_get(file);
+	int zret;
+
+	if (z != NULL) {
+		zret = sym_inflateReset(&z->strm);
+	} else {
+		z = calloc(1, sizeof(*z));
+		if (z == NULL)
+			return NULL;
+
+		/* gzip format only, like gzdopen() for a gzip file */
+		zret = sym_inflateInit2_(&z->strm, 16 + MAX_WBITS, ZLIB_VERSION,
+					 (int)sizeof(z->strm));
+		if (zret != Z_OK) {
+			free(z);
+			return NULL;
+		}
+	}
+
+	if (zret != Z_OK) {
+		zlib_decoder_free(z);
+		return NULL;
+	}
+
+	return z;
+}
+
+/* Read more of the file after what's left in the input buffer */
+static int zlib_fill(struct zlib_decoder *z, struct kmod_file *file, off_t *offset)
+{
+	ssize_t rdret;
+
+	memmove(z->in_buf, z->strm.next_in, z->strm.avail_in);
+	z->strm.next_in = z->in_buf;
+
+	rdret = pread(file->fd, z->in_buf + z->strm.avail_in,
+		      sizeof(z->in_buf) - z->strm.avail_in, *offset);
+	if (rdret < 0)
+		return -errno;
+
+	z->strm.avail_in += rdret;
+	*offset += rdret;
+	return rdret;
+}
+
 int kmod_file_load_zlib(struct kmod_file *file)
 {
-	_cleanup_free_ unsigned char *p = NULL;
-	int ret = 0;
-	off_t did = 0, total = 0;
-	gzFile gzf;
-	int gzfd;
+	struct zlib_decoder *z;
+	z_stream *strm;
+	size_t total = 0;
+	off_t offset = 0;
+	int ret, zret;
 
 	ret = dlopen_zlib();
 	if (ret < 0) {
-		ERR(file->ctx, "zlib: can't load and resolve symbols (%s)",
-		    strerror(-ret));
+		FILE_ERR(file, "zlib: can't load and resolve symbols (%s)",
+			 strerror(-ret));
 		return -EINVAL;
 	}
 
-	gzfd = fcntl(file->fd, F_DUPFD_CLOEXEC, 3);
-	if (gzfd < 0)
-		return -errno;
-
-	gzf = sym_gzdopen(gzfd, "rb"); /* takes ownership of the fd */
-	if (gzf == NULL) {
-		close(gzfd);
-		return -errno;
+	z = zlib_decoder_get(file);
+	if (z == NULL) {
+		FILE_ERR(file, "gzip: %s\n", strerror(ENOMEM));
+		return -ENOMEM;
 	}
 
+	strm = &z->strm;
+	strm->next_in = z->in_buf;
+	strm->avail_in = 0;
+
+	/* decompress right into the buffer, growing it as needed */
+	ret = kmod_file_buf_reserve(file, 4 * sizeof(z->in_buf));
+	if (ret < 0)
+		goto out;
+
 	for (;;) {
-		int r;
+		size_t avail_out = file->capacity - total;
 
-		if (did == total) {
-			void *tmp = realloc(p, total + READ_STEP);
-			if (tmp == NULL) {
-				ret = -ENOMEM;
-				goto error;
-			}
-			total += READ_STEP;
-			p = tmp;
+		if (strm->avail_in == 0) {
+			ret = zlib_fill(z, file, &offset);
+			if (ret < 0)
+				goto out;
 		}
 
-		r = sym_gzread(gzf, p + did, total - did);
-		if (r == 0)
-			break;
-		else if (r < 0) {
-			int gzerr;
-			const char *gz_errmsg = sym_gzerror(gzf, &gzerr);
+		/* avail_out is only 32 bits */
+		strm->next_out = (uint8_t *)file->memory + total;
+		strm->avail_out = avail_out < UINT_MAX ? avail_out : UINT_MAX;
+
+		zret = sym_inflate(strm, Z_NO_FLUSH);
+		total = strm->next_out - (uint8_t *)file->memory;
+
+		if (zret == Z_STREAM_END) {
+			/* like gzread(), go on with the next gzip member, if any */
+			if (strm->avail_in < 2) {
+				ret = zlib_fill(z, file, &offset);
+				if (ret < 0)
+					goto out;
+			}
+			if (strm->avail_in < 2 || strm->next_in[0] != 0x1f ||
+			    strm->next_in[1] != 0x8b)
+				break;
+
+			zret = sym_inflateReset(strm);
+		} else if (zret == Z_BUF_ERROR && strm->avail_in == 0) {
+			FILE_ERR(file, "gzip: unexpected end of file\n");
+			ret = -EINVAL;
+			goto out;
+		}
 
-			ERR(file->ctx, "gzip: %s\n", gz_errmsg);
+		if (zret != Z_OK && zret != Z_BUF_ERROR) {
+			FILE_ERR(file, "gzip: %s\n",
+				 strm->msg != NULL ? strm->msg : "internal error");
+			ret = zret == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+			goto out;
+		}
 
-			/* gzip might not set errno here */
-			ret = gzerr == Z_ERRNO ? -errno : -EINVAL;
-			goto error;
+		if (total == file->capacity) {
+			ret = kmod_file_buf_reserve(file, file->capacity + 1);
+			if (ret < 0)
+				goto out;
 		}
-		did += r;
 	}
 
-	file->memory = TAKE_PTR(p);
-	file->size = did;
-	sym_gzclose(gzf);
+	file->size = total;
+	ret = 0;
 
-	return 0;
+out:
+	if (ret < 0)
+		kmod_file_buf_release(file);
+
+	/* inflate allocates its window and about 7 KiB of state */
+	kmod_file_decoder_put(file, z, sizeof(*z) + (1 << MAX_WBITS) + 8 * 1024,
+			      zlib_decoder_free);
 
-error:
-	sym_gzclose(gzf);
 	return ret;
 }
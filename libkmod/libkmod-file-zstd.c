@@ -23,10 +23,13 @@
 #include "libkmod-internal-file.h"
 
 #define DL_SYMBOL_TABLE(M)          \
-	M(ZSTD_decompress)          \
+	M(ZSTD_createDCtx)          \
+	M(ZSTD_decompressDCtx)      \
+	M(ZSTD_freeDCtx)            \
 	M(ZSTD_getErrorName)        \
 	M(ZSTD_getFrameContentSize) \
-	M(ZSTD_isError)
+	M(ZSTD_isError)             \
+	M(ZSTD_sizeof_DCtx)
 
 DL_SYMBOL_TABLE(DECLARE_SYM)
 
@@ -44,24 +47,30 @@ static int dlopen_zstd(void)
 #endif
 }
 
+static void zstd_decoder_free(void *decoder)
+{
+	sym_ZSTD_freeDCtx(decoder);
+}
+
 int kmod_file_load_zstd(struct kmod_file *file)
 {
-	void *src_buf = MAP_FAILED, *dst_buf = NULL;
+	void *src_buf = MAP_FAILED;
 	size_t src_size, dst_size;
 	unsigned long long frame_size;
+	ZSTD_DCtx *dctx = NULL;
 	struct stat st;
 	int ret;
 
 	ret = dlopen_zstd();
 	if (ret < 0) {
-		ERR(file->ctx, "zstd: can't load and resolve symbols (%s)",
-		    strerror(-ret));
+		FILE_ERR(file, "zstd: can't load and resolve symbols (%s)",
+			 strerror(-ret));
 		return -EINVAL;
 	}
 
 	if (fstat(file->fd, &st) < 0) {
 		ret = -errno;
-		ERR(file->ctx, "zstd: %m\n");
+		FILE_ERR(file, "zstd: %m\n");
 		goto out;
 	}
 
@@ -81,7 +90,7 @@ int kmod_file_load_zstd(struct kmod_file *file)
 	if (frame_size == 0 || frame_size == ZSTD_CONTENTSIZE_UNKNOWN ||
 	    frame_size == ZSTD_CONTENTSIZE_ERROR) {
 		ret = -EINVAL;
-		ERR(file->ctx, "zstd: Failed to determine decompression size\n");
+		FILE_ERR(file, "zstd: Failed to determine decompression size\n");
 		goto out;
 	}
 
@@ -91,27 +100,36 @@ int kmod_file_load_zstd(struct kmod_file *file)
 	}
 
 	dst_size = frame_size;
-	dst_buf = malloc(dst_size);
-	if (dst_buf == NULL) {
-		ret = -ENOMEM;
+	ret = kmod_file_buf_reserve(file, dst_size);
+	if (ret < 0)
 		goto out;
+
+	dctx = kmod_file_decoder_get(file);
+	if (dctx == NULL) {
+		dctx = sym_ZSTD_createDCtx();
+		if (dctx == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
 
-	dst_size = sym_ZSTD_decompress(dst_buf, dst_size, src_buf, src_size);
+	dst_size = sym_ZSTD_decompressDCtx(dctx, file->memory, dst_size, src_buf, src_size);
 	if (sym_ZSTD_isError(dst_size)) {
-		ERR(file->ctx, "zstd: %s\n", sym_ZSTD_getErrorName(dst_size));
+		FILE_ERR(file, "zstd: %s\n", sym_ZSTD_getErrorName(dst_size));
 		ret = -EINVAL;
 		goto out;
 	}
 
-	file->memory = dst_buf;
 	file->size = dst_size;
-
 	ret = 0;
-	dst_buf = NULL;
 
 out:
-	free(dst_buf);
+	if (ret < 0)
+		kmod_file_buf_release(file);
+
+	if (dctx != NULL)
+		kmod_file_decoder_put(file, dctx, sym_ZSTD_sizeof_DCtx(dctx),
+				      zstd_decoder_free);
 
 	if (src_buf != MAP_FAILED)
 		munmap(src_buf, src_size);
@@ -4,7 +4,9 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +22,280 @@
 #include "libkmod-internal.h"
 #include "libkmod-internal-file.h"
 
+/*
+ * Modules are decompressed into anonymous mappings, which are kept with the
+ * decoders in a pool of the context when the files are released. The next
+ * modules reuse them, instead of setting up a decoder and faulting in a new
+ * buffer for each of them. Files may be loaded from several threads, e.g. by
+ * depmod. The pool holds at most FILE_POOL_MAX_SIZE bytes, buffers for the few
+ * very large modules aren't kept at all, and the pages of the pooled buffers are
+ * given back to the kernel, which may reclaim them until they are used again.
+ * kmod_unload_resources() empties it.
+ */
+#define FILE_POOL_MAX_SIZE (16 * 1024 * 1024)
+#define FILE_POOL_BUFFERS 16
+#define FILE_POOL_BUF_MAX_SIZE (4 * 1024 * 1024)
+#define FILE_POOL_DECODERS 16
+#define FILE_BUF_MIN_SIZE (128 * 1024)
+
+struct kmod_file_pool {
+	pthread_mutex_t lock;
+	size_t size; /* of the buffers and decoders in it */
+	unsigned int n_buffers;
+	unsigned int n_decoders;
+	struct {
+		void *memory;
+		size_t capacity;
+	} buffers[FILE_POOL_BUFFERS];
+	struct {
+		enum kmod_file_compression_type compression;
+		void *decoder;
+		size_t size;
+		void (*free_decoder)(void *decoder);
+	} decoders[FILE_POOL_DECODERS];
+};
+
+struct kmod_file_pool *kmod_file_pool_new(void)
+{
+	struct kmod_file_pool *pool = calloc(1, sizeof(*pool));
+
+	if (pool == NULL)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+void kmod_file_pool_flush(struct kmod_file_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	for (unsigned int i = 0; i < pool->n_buffers; i++)
+		munmap(pool->buffers[i].memory, pool->buffers[i].capacity);
+
+	for (unsigned int i = 0; i < pool->n_decoders; i++)
+		pool->decoders[i].free_decoder(pool->decoders[i].decoder);
+
+	pool->n_buffers = 0;
+	pool->n_decoders = 0;
+	pool->size = 0;
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void kmod_file_pool_free(struct kmod_file_pool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	kmod_file_pool_flush(pool);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static size_t file_buf_capacity(size_t size)
+{
+	size_t capacity = FILE_BUF_MIN_SIZE;
+
+	while (capacity < size) {
+		if (capacity > SIZE_MAX / 2)
+			return size;
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+/* Take the smallest pooled buffer of at least @size bytes, or else the largest one */
+static void file_buf_take(struct kmod_file_pool *pool, struct kmod_file *file, size_t size)
+{
+	unsigned int best = 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->n_buffers == 0)
+		goto out;
+
+	for (unsigned int i = 1; i < pool->n_buffers; i++) {
+		size_t capacity = pool->buffers[i].capacity;
+		size_t best_capacity = pool->buffers[best].capacity;
+
+		if (best_capacity >= size ? capacity >= size && capacity < best_capacity
+					  : capacity > best_capacity)
+			best = i;
+	}
+
+	file->memory = pool->buffers[best].memory;
+	file->capacity = pool->buffers[best].capacity;
+	pool->size -= file->capacity;
+	pool->buffers[best] = pool->buffers[--pool->n_buffers];
+
+out:
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Grow the memfd and its shared mapping, which the decoders write to */
+static int file_memfd_reserve(struct kmod_file *file, size_t size)
+{
+	size_t capacity = file_buf_capacity(size);
+	void *memory;
+
+	if (ftruncate(file->memfd, capacity) < 0)
+		return -errno;
+
+	if (file->memory != NULL)
+		memory = mremap(file->memory, file->capacity, capacity, MREMAP_MAYMOVE);
+	else
+		memory = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      file->memfd, 0);
+	if (memory == MAP_FAILED)
+		return -ENOMEM;
+
+	file->memory = memory;
+	file->capacity = capacity;
+	return 0;
+}
+
+int kmod_file_buf_reserve(struct kmod_file *file, size_t size)
+{
+	size_t capacity;
+	void *memory;
+
+	if (size <= file->capacity)
+		return 0;
+
+	if (file->memfd >= 0)
+		return file_memfd_reserve(file, size);
+
+	if (file->memory == NULL) {
+		file_buf_take(kmod_get_file_pool(file->ctx), file, size);
+		if (size <= file->capacity)
+			return 0;
+	}
+
+	capacity = file_buf_capacity(size);
+	if (file->memory != NULL)
+		memory = mremap(file->memory, file->capacity, capacity, MREMAP_MAYMOVE);
+	else
+		memory = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return -ENOMEM;
+
+	file->memory = memory;
+	file->capacity = capacity;
+	return 0;
+}
+
+/* Let the kernel reclaim the pages of a pooled buffer, it's overwritten anyway */
+static void file_buf_discard(void *memory, size_t capacity)
+{
+#ifdef MADV_FREE
+	if (madvise(memory, capacity, MADV_FREE) == 0)
+		return;
+#endif
+	madvise(memory, capacity, MADV_DONTNEED);
+}
+
+void kmod_file_buf_release(struct kmod_file *file)
+{
+	struct kmod_file_pool *pool = kmod_get_file_pool(file->ctx);
+	void *memory = file->memory;
+	size_t capacity = file->capacity;
+
+	if (memory == NULL)
+		return;
+
+	file->memory = NULL;
+	file->capacity = 0;
+
+	if (file->memfd >= 0 || capacity > FILE_POOL_BUF_MAX_SIZE) {
+		munmap(memory, capacity);
+		return;
+	}
+
+	file_buf_discard(memory, capacity);
+
+	pthread_mutex_lock(&pool->lock);
+
+	/* make room by dropping smaller buffers, the larger are more expensive to set up */
+	while (pool->n_buffers == FILE_POOL_BUFFERS ||
+	       pool->size + capacity > FILE_POOL_MAX_SIZE) {
+		unsigned int smallest = 0;
+
+		for (unsigned int i = 1; i < pool->n_buffers; i++) {
+			if (pool->buffers[i].capacity < pool->buffers[smallest].capacity)
+				smallest = i;
+		}
+
+		if (pool->n_buffers == 0 || pool->buffers[smallest].capacity >= capacity)
+			break;
+
+		munmap(pool->buffers[smallest].memory, pool->buffers[smallest].capacity);
+		pool->size -= pool->buffers[smallest].capacity;
+		pool->buffers[smallest] = pool->buffers[--pool->n_buffers];
+	}
+
+	if (pool->n_buffers < FILE_POOL_BUFFERS &&
+	    pool->size + capacity <= FILE_POOL_MAX_SIZE) {
+		pool->buffers[pool->n_buffers].memory = memory;
+		pool->buffers[pool->n_buffers].capacity = capacity;
+		pool->n_buffers++;
+		pool->size += capacity;
+		memory = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (memory != NULL)
+		munmap(memory, capacity);
+}
+
+void *kmod_file_decoder_get(struct kmod_file *file)
+{
+	struct kmod_file_pool *pool = kmod_get_file_pool(file->ctx);
+	void *decoder = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (unsigned int i = pool->n_decoders; i-- > 0;) {
+		if (pool->decoders[i].compression == file->compression) {
+			decoder = pool->decoders[i].decoder;
+			pool->size -= pool->decoders[i].size;
+			pool->decoders[i] = pool->decoders[--pool->n_decoders];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return decoder;
+}
+
+void kmod_file_decoder_put(struct kmod_file *file, void *decoder, size_t size,
+			   void (*free_decoder)(void *decoder))
+{
+	struct kmod_file_pool *pool = kmod_get_file_pool(file->ctx);
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->n_decoders < FILE_POOL_DECODERS &&
+	    pool->size + size <= FILE_POOL_MAX_SIZE) {
+		pool->decoders[pool->n_decoders].compression = file->compression;
+		pool->decoders[pool->n_decoders].decoder = decoder;
+		pool->decoders[pool->n_decoders].size = size;
+		pool->decoders[pool->n_decoders].free_decoder = free_decoder;
+		pool->n_decoders++;
+		pool->size += size;
+		decoder = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (decoder != NULL)
+		free_decoder(decoder);
+}
+
 static const char magic_zstd[] = { 0x28, 0xB5, 0x2F, 0xFD };
 static const char magic_xz[] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
 static const char magic_zlib[] = { 0x1f, 0x8b };
@@ -76,6 +352,7 @@ int kmod_file_open(const struct kmod_ctx *ctx, const char *filename,
 		return -ENOMEM;
 	}
 
+	file->memfd = -1;
 	file->fd = open(filename, O_RDONLY | O_CLOEXEC);
 	if (file->fd < 0)
 		return -errno;
@@ -140,15 +417,98 @@ int kmod_file_get_fd(const struct kmod_file *file)
 	return file->fd;
 }
 
+/* Decompress @file into a new sealed memfd */
+static int file_new_memfd(struct kmod_file *file)
+{
+	int fd, ret;
+
+	/* not worth it if already in memory, nor possible for an uncompressed file */
+	if (file->memory != NULL || file->compression == KMOD_FILE_COMPRESSION_NONE)
+		return -ENOSYS;
+
+	fd = memfd_create("kmod", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		FILE_DBG(file, "could not create memfd: %m\n");
+		return -ENOSYS;
+	}
+
+	file->memfd = fd;
+	ret = file->load(file);
+	file->memfd = -1;
+	if (ret < 0)
+		goto fail;
+
+	/* a writable mapping would prevent F_SEAL_WRITE */
+	munmap(file->memory, file->capacity);
+	file->memory = NULL;
+	file->capacity = 0;
+
+	if (ftruncate(fd, file->size) < 0 ||
+	    fcntl(fd, F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		FILE_DBG(file, "could not seal memfd: %m\n");
+		ret = -ENOSYS;
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Decompress @file into a sealed memfd, for finit_module(), without keeping the
+ * contents in memory otherwise. Returns the fd, -ENOSYS if a memfd can't be used
+ * or another negative errno if the decompression failed. What
+ * kmod_file_prepare_load() did is used, if called before.
+ */
+int kmod_file_get_memfd(struct kmod_file *file)
+{
+	if (file->memfd_prepared) {
+		file->memfd_prepared = false;
+		if (file->prepared_memfd >= 0)
+			return file->prepared_memfd;
+
+		/* it failed without logging: do it again, to log why in order */
+	}
+
+	return file_new_memfd(file);
+}
+
+/*
+ * Get @file ready to be loaded, e.g. from a helper thread while another module
+ * is loaded: decompress it into a memfd if the kernel can't decompress it,
+ * otherwise read it ahead into the page cache for finit_module(). Nothing is
+ * logged, errors are left for kmod_file_get_memfd().
+ */
+void kmod_file_prepare_load(struct kmod_file *file)
+{
+	if (file->compression == KMOD_FILE_COMPRESSION_NONE ||
+	    file->compression == kmod_get_kernel_compression(file->ctx)) {
+		posix_fadvise(file->fd, 0, 0, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	file->quiet = true;
+	file->prepared_memfd = file_new_memfd(file);
+	file->memfd_prepared = true;
+	file->quiet = false;
+}
+
 void kmod_file_unref(struct kmod_file *file)
 {
 	if (file->compression == KMOD_FILE_COMPRESSION_NONE) {
 		if (file->memory)
 			munmap(file->memory, file->size);
 	} else {
-		free(file->memory);
+		kmod_file_buf_release(file);
 	}
 
+	if (file->memfd_prepared && file->prepared_memfd >= 0)
+		close(file->prepared_memfd);
+
 	close(file->fd);
 	free(file);
 }
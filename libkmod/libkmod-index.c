@@ -3,6 +3,7 @@
  * Copyright (C) 2011-2013  ProFUSION embedded systems
  */
 
+#include <sys/mman.h>
 #include <sys/param.h>
 
 #include <assert.h>
@@ -15,7 +16,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <shared/hash.h>
 #include <shared/macro.h>
+#include <shared/modalias.h>
 #include <shared/strbuf.h>
 #include <shared/util.h>
 
@@ -38,9 +41,18 @@
  * We use a version string to keep track of changes to the binary format.
  * This is stored in the form: INDEX_MAJOR (hi) INDEX_MINOR (lo) just in
  * case we ever decide to have minor changes that are not incompatible.
+ *
+ * Major version 3 added the sparse child format. Older readers would silently
+ * misinterpret such nodes, so the major version was bumped. Version 2 files
+ * are a subset of version 3 and are still accepted.
+ *
+ * Minor version 1 added the section table right after the header. Sections
+ * are optional: readers ignore the ones they don't know about and the trie
+ * alone is always enough to answer any lookup.
  */
 #define INDEX_MAGIC 0xB007F457
-#define INDEX_VERSION_MAJOR 0x0002
+#define INDEX_VERSION_MAJOR 0x0003
+#define INDEX_VERSION_MAJOR_COMPAT 0x0002
 #define INDEX_VERSION_MINOR 0x0001
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR << 16) | INDEX_VERSION_MINOR)
 
@@ -59,6 +71,12 @@
  *  uint32_t version = INDEX_VERSION;
  *  uint32_t root_offset;
  *
+ *  uint32_t section_count; // since version 3.1
+ *  struct {
+ *      uint32_t id; // enum index_section
+ *      uint32_t offset;
+ *  } sections[section_count];
+ *
  *  (node_offset & INDEX_NODE_MASK) specifies the file offset of nodes:
  *
  *       char[] prefix; // nul terminated
@@ -76,8 +94,12 @@
  *  (node_offset & INDEX_NODE_FLAGS) indicates which fields are present.
  *  Empty prefixes are omitted, leaf nodes omit the three child-related fields.
  *
- *  This could be optimised further by adding a sparse child format
- *  (indicated using a new flag).
+ *  Nodes with few children spread over a wide range of characters use the
+ *  sparse child format instead, indicated by INDEX_NODE_SPARSE:
+ *
+ *       uint8_t child_count;
+ *       char keys[child_count]; // sorted in ascending order
+ *       uint32_t children[child_count];
  *
  *
  * Implementation is based on a radix tree, or "trie".
@@ -130,6 +152,56 @@
  * However for this application it is simpler to use the ASCII character set.
  * Since the index file is read-only, it can be compressed by omitting null
  * child pointers at the start and end of arrays.
+ *
+ * == Sections ==
+ *
+ * INDEX_SECTION_HASH: only written for indexes without wildcards, such as
+ * modules.dep.bin. An open addressing hash table with linear probing, so
+ * exact lookups don't need to walk the trie:
+ *
+ *  uint32_t bucket_count; // power of 2
+ *  struct {
+ *      uint32_t hash; // hash_fnv1a() of the key
+ *      uint32_t entry_offset; // 0 for empty buckets
+ *  } buckets[bucket_count];
+ *
+ *  Entries, pointed to by entry_offset:
+ *
+ *      uint32_t value_offset; // first value of the key, inside its trie node
+ *      char[] key; // nul terminated
+ *
+ * INDEX_SECTION_WILDCARD: written for alias indexes. A second trie holding only
+ * the keys containing wildcards, keyed by their literal prefix, i.e. up to the
+ * first '*', '?' or '['. A lookup then only evaluates the patterns stored
+ * along the path of its key, and descends the main trie without branching:
+ *
+ *  uint32_t root_offset;
+ *
+ *  The values of each node are "<pattern> <value>", where <pattern> is the
+ *  rest of the key, starting at the wildcard. The same keys are still present
+ *  in the main trie.
+ *
+ * INDEX_SECTION_MODALIAS: always written together with INDEX_SECTION_WILDCARD,
+ * whose trie then doesn't contain the keys stored here. Modaliases of known
+ * buses compiled by modalias_compile() into a range per field. The section is
+ * aligned to 4 bytes, so the ranges can be read as arrays:
+ *
+ *  uint32_t bus_count;
+ *  struct {
+ *      uint32_t bus; // enum modalias_bus
+ *      uint32_t offset;
+ *  } buses[bus_count];
+ *
+ *  Each bus, at its offset:
+ *
+ *      uint32_t entry_count;
+ *      uint32_t field_count; // modalias_field_count(bus)
+ *      uint32_t lo[field_count][entry_count];
+ *      uint32_t hi[field_count][entry_count];
+ *      struct {
+ *          uint32_t priority;
+ *          uint32_t pattern_offset; // "<key>\0<value>\0"
+ *      } entries[entry_count];
  */
 
 /* Format of node offsets within index file */
@@ -138,10 +210,17 @@ enum node_offset {
 	INDEX_NODE_PREFIX = 0x80000000,
 	INDEX_NODE_VALUES = 0x40000000,
 	INDEX_NODE_CHILDS = 0x20000000,
+	INDEX_NODE_SPARSE = 0x10000000, /* Only valid with INDEX_NODE_CHILDS */
 
 	INDEX_NODE_MASK = 0x0FFFFFFF, /* Offset value */
 };
 
+enum index_section {
+	INDEX_SECTION_HASH = 1,
+	INDEX_SECTION_WILDCARD = 2,
+	INDEX_SECTION_MODALIAS = 3,
+};
+
 struct wrtbuf {
 	char bytes[4096];
 	size_t len;
@@ -276,7 +355,38 @@ static struct index_node_f *index_read(struct index_file *idx, uint32_t offset)
 	if (prefix == NULL)
 		goto err;
 
-	if (offset & INDEX_NODE_CHILDS) {
+	if ((offset & INDEX_NODE_CHILDS) && (offset & INDEX_NODE_SPARSE)) {
+		uint8_t keys[INDEX_CHILDMAX];
+		uint32_t offs[INDEX_CHILDMAX];
+		int count = read_char(fp);
+
+		if (count == EOF || count == 0 || (unsigned)count > INDEX_CHILDMAX)
+			goto err;
+
+		if (fread_unlocked(keys, 1, count, fp) != (size_t)count ||
+		    !read_u32s(fp, offs, count))
+			goto err;
+
+		if (keys[0] > keys[count - 1] || keys[count - 1] >= INDEX_CHILDMAX)
+			goto err;
+
+		/* expand to the dense in-memory representation */
+		child_count = keys[count - 1] - keys[0] + 1;
+
+		node = calloc(1, sizeof(struct index_node_f) +
+					 sizeof(uint32_t) * child_count);
+		if (node == NULL)
+			goto err;
+
+		node->first = keys[0];
+		node->last = keys[count - 1];
+
+		for (int i = 0; i < count; i++) {
+			if (keys[i] < node->first || keys[i] > node->last)
+				goto err;
+			node->children[keys[i] - node->first] = offs[i];
+		}
+	} else if (offset & INDEX_NODE_CHILDS) {
 		int first = read_char(fp);
 		int last = read_char(fp);
 
@@ -353,7 +463,8 @@ struct index_file *index_file_open(const char *filename)
 	if (!read_u32(file, &magic) || magic != INDEX_MAGIC)
 		goto err;
 
-	if (!read_u32(file, &version) || version >> 16 != INDEX_VERSION_MAJOR)
+	if (!read_u32(file, &version) || version >> 16 < INDEX_VERSION_MAJOR_COMPAT ||
+	    version >> 16 > INDEX_VERSION_MAJOR)
 		goto err;
 
 	new = malloc(sizeof(struct index_file));
@@ -635,6 +746,18 @@ struct index_mm {
 	void *mm;
 	uint32_t root_offset;
 	size_t size;
+	const void *hash_buckets; /* mmap'ed value, NULL if not present */
+	uint32_t hash_bucket_count;
+	uint32_t wildcard_root; /* 0 if not present */
+	unsigned int modalias_count;
+	struct index_mm_modalias {
+		uint32_t bus;
+		uint32_t count;
+		uint32_t field_count;
+		const uint32_t *lo; /* mmap'ed value, [field][entry] */
+		const uint32_t *hi; /* mmap'ed value, [field][entry] */
+		const void *entries; /* mmap'ed value */
+	} modalias[_MODALIAS_BUS_MAX];
 };
 
 struct index_mm_value {
@@ -648,6 +771,8 @@ struct index_mm_node {
 	const char *prefix; /* mmap'ed value */
 	unsigned char first;
 	unsigned char last;
+	unsigned char child_count; /* sparse nodes only */
+	const char *keys; /* mmap'ed value, NULL for dense nodes */
 	const void *children; /* mmap'ed value */
 	size_t value_count;
 	const void *values; /* mmap'ed value */
@@ -706,7 +831,21 @@ static struct index_mm_node *index_mm_read_node(const struct index_mm *idx,
 		node->prefix = "";
 	}
 
-	if (offset & INDEX_NODE_CHILDS) {
+	if ((offset & INDEX_NODE_CHILDS) && (offset & INDEX_NODE_SPARSE)) {
+		node->child_count = read_char_mm(&p);
+		if (node->child_count == 0 || node->child_count > INDEX_CHILDMAX)
+			return NULL;
+
+		node->keys = p;
+		node->first = node->keys[0];
+		node->last = node->keys[node->child_count - 1];
+
+		if (node->first > node->last || node->last >= INDEX_CHILDMAX)
+			return NULL;
+
+		node->children = node->keys + node->child_count;
+		p = (const char *)node->children + sizeof(uint32_t) * node->child_count;
+	} else if (offset & INDEX_NODE_CHILDS) {
 		size_t child_count;
 
 		node->first = read_char_mm(&p);
@@ -716,6 +855,8 @@ static struct index_mm_node *index_mm_read_node(const struct index_mm *idx,
 		    node->last >= INDEX_CHILDMAX)
 			return NULL;
 
+		node->child_count = 0;
+		node->keys = NULL;
 		node->children = p;
 
 		child_count = node->last - node->first + 1;
@@ -723,6 +864,8 @@ static struct index_mm_node *index_mm_read_node(const struct index_mm *idx,
 	} else {
 		node->first = INDEX_CHILDMAX;
 		node->last = 0;
+		node->child_count = 0;
+		node->keys = NULL;
 		node->children = NULL;
 	}
 
@@ -739,6 +882,175 @@ static struct index_mm_node *index_mm_read_node(const struct index_mm *idx,
 	return node;
 }
 
+static int index_mm_read_modalias(struct index_mm *idx, uint32_t offset)
+{
+	const void *p = (const char *)idx->mm + offset;
+	uint32_t i, count;
+
+	if (offset % sizeof(uint32_t) != 0)
+		return -EINVAL;
+
+	count = read_u32_mm(&p);
+	if (count > _MODALIAS_BUS_MAX ||
+	    idx->size - offset < (1 + 2 * count) * sizeof(uint32_t))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		struct index_mm_modalias *m = &idx->modalias[i];
+		uint32_t block;
+		const void *q;
+		uint64_t size;
+
+		m->bus = read_u32_mm(&p);
+		block = read_u32_mm(&p);
+		if (modalias_field_count(m->bus) == 0 || block % sizeof(uint32_t) != 0 ||
+		    block > idx->size - 2 * sizeof(uint32_t))
+			return -EINVAL;
+
+		q = (const char *)idx->mm + block;
+		m->count = read_u32_mm(&q);
+		m->field_count = read_u32_mm(&q);
+		if (m->field_count != modalias_field_count(m->bus))
+			return -EINVAL;
+
+		size = (2ULL * m->field_count + 2) * sizeof(uint32_t) * m->count;
+		if (size > idx->size - block - 2 * sizeof(uint32_t))
+			return -EINVAL;
+
+		m->lo = q;
+		m->hi = m->lo + (size_t)m->field_count * m->count;
+		m->entries = m->hi + (size_t)m->field_count * m->count;
+	}
+
+	idx->modalias_count = count;
+
+	return 0;
+}
+
+static int index_mm_read_sections(struct index_mm *idx, const void *p)
+{
+	const char *end = (const char *)idx->mm + idx->size;
+	uint32_t i, count;
+
+	if ((const char *)p + sizeof(uint32_t) > end)
+		return -EINVAL;
+
+	count = read_u32_mm(&p);
+	if ((size_t)(end - (const char *)p) / (2 * sizeof(uint32_t)) < count)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		uint32_t id = read_u32_mm(&p);
+		uint32_t offset = read_u32_mm(&p);
+		const void *q = (const char *)idx->mm + offset;
+		uint32_t n;
+
+		if (offset > idx->size - sizeof(uint32_t))
+			return -EINVAL;
+
+		switch (id) {
+		case INDEX_SECTION_HASH:
+			n = read_u32_mm(&q);
+			if (n == 0 || (n & (n - 1)) != 0 ||
+			    (size_t)(end - (const char *)q) / (2 * sizeof(uint32_t)) < n)
+				return -EINVAL;
+
+			idx->hash_buckets = q;
+			idx->hash_bucket_count = n;
+			break;
+		case INDEX_SECTION_WILDCARD:
+			idx->wildcard_root = read_u32_mm(&q);
+			break;
+		case INDEX_SECTION_MODALIAS:
+			if (index_mm_read_modalias(idx, offset) < 0)
+				return -EINVAL;
+			break;
+		default:
+			DBG(idx->ctx, "ignoring unknown index section %u\n", id);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Size limits for the access hints, see enum kmod_index_access */
+#define INDEX_MM_SMALL_MAX (1024 * 1024)
+#define INDEX_MM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Map @size bytes of @fd at an address aligned to a huge page, so the kernel
+ * is able to back it with huge pages: reserve enough address space to find
+ * such address, map the file over it and release the slack around.
+ */
+static void *index_mm_map_hugepage(int fd, size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t len = size + INDEX_MM_HUGEPAGE_SIZE;
+	size_t end = (size + page_size - 1) & ~(page_size - 1);
+	uint8_t *reserve, *p;
+
+	reserve = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserve == MAP_FAILED)
+		return MAP_FAILED;
+
+	p = (uint8_t *)(((uintptr_t)reserve + INDEX_MM_HUGEPAGE_SIZE - 1) &
+			~((uintptr_t)INDEX_MM_HUGEPAGE_SIZE - 1));
+
+	if (mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(reserve, len);
+		return MAP_FAILED;
+	}
+
+	if (p > reserve)
+		munmap(reserve, p - reserve);
+	if (reserve + len > p + end)
+		munmap(p + end, reserve + len - (p + end));
+
+	return p;
+}
+
+static void *index_mm_map(const struct kmod_ctx *ctx, int fd, size_t size)
+{
+	unsigned int access = kmod_get_index_access(ctx);
+	int flags = MAP_PRIVATE;
+	void *p;
+
+	if (size <= INDEX_MM_SMALL_MAX) {
+		access &= KMOD_INDEX_ACCESS_POPULATE;
+		if (access)
+			flags |= MAP_POPULATE;
+	} else {
+		access &= ~KMOD_INDEX_ACCESS_POPULATE;
+		if (size < INDEX_MM_HUGEPAGE_SIZE)
+			access &= ~KMOD_INDEX_ACCESS_HUGEPAGE;
+	}
+
+	DBG(ctx, "size=%zu populate=%d random=%d hugepage=%d\n", size,
+	    !!(access & KMOD_INDEX_ACCESS_POPULATE), !!(access & KMOD_INDEX_ACCESS_RANDOM),
+	    !!(access & KMOD_INDEX_ACCESS_HUGEPAGE));
+
+	if (access & KMOD_INDEX_ACCESS_HUGEPAGE) {
+		p = index_mm_map_hugepage(fd, size);
+		if (p == MAP_FAILED) {
+			DBG(ctx, "could not map index aligned to huge pages: %m\n");
+			p = mmap(NULL, size, PROT_READ, flags, fd, 0);
+		} else if (madvise(p, size, MADV_HUGEPAGE) < 0) {
+			DBG(ctx, "madvise(MADV_HUGEPAGE): %m\n");
+		}
+	} else {
+		p = mmap(NULL, size, PROT_READ, flags, fd, 0);
+	}
+
+	if (p == MAP_FAILED)
+		return p;
+
+	if ((access & KMOD_INDEX_ACCESS_RANDOM) && madvise(p, size, MADV_RANDOM) < 0)
+		DBG(ctx, "madvise(MADV_RANDOM): %m\n");
+
+	return p;
+}
+
 int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
 		  unsigned long long *stamp, struct index_mm **pidx)
 {
@@ -778,7 +1090,7 @@ int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
 		goto fail_nommap;
 	}
 
-	idx->mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	idx->mm = index_mm_map(ctx, fd, st.st_size);
 	if (idx->mm == MAP_FAILED) {
 		err = -errno;
 		ERR(ctx, "mmap(NULL, %" PRIu64 ", PROT_READ, MAP_PRIVATE, %d, 0): %m\n",
@@ -797,7 +1109,8 @@ int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
 		goto fail;
 	}
 
-	if (hdr.version >> 16 != INDEX_VERSION_MAJOR) {
+	if (hdr.version >> 16 < INDEX_VERSION_MAJOR_COMPAT ||
+	    hdr.version >> 16 > INDEX_VERSION_MAJOR) {
 		ERR(ctx, "major version check fail: %u instead of %u\n",
 		    hdr.version >> 16, INDEX_VERSION_MAJOR);
 		err = -EINVAL;
@@ -807,6 +1120,19 @@ int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
 	idx->root_offset = hdr.root_offset;
 	idx->size = st.st_size;
 	idx->ctx = ctx;
+	idx->hash_buckets = NULL;
+	idx->hash_bucket_count = 0;
+	idx->wildcard_root = 0;
+	idx->modalias_count = 0;
+
+	if (hdr.version >> 16 == INDEX_VERSION_MAJOR && (hdr.version & 0xffff) >= 1) {
+		err = index_mm_read_sections(idx, p);
+		if (err < 0) {
+			ERR(ctx, "invalid section table in %s\n", filename);
+			goto fail;
+		}
+	}
+
 	close(fd);
 
 	*stamp = stat_mstamp(&st);
@@ -838,18 +1164,28 @@ static struct index_mm_node *index_mm_readroot(const struct index_mm *idx,
 static struct index_mm_node *index_mm_readchild(const struct index_mm_node *parent,
 						uint8_t ch, struct index_mm_node *child)
 {
-	if (parent->first <= ch && ch <= parent->last) {
-		const void *p;
-		uint32_t off;
+	const void *p;
+	uint32_t off;
+
+	if (ch < parent->first || ch > parent->last)
+		return NULL;
 
+	if (parent->keys != NULL) {
+		const char *key = memchr(parent->keys, ch, parent->child_count);
+
+		if (key == NULL)
+			return NULL;
+
+		p = (const char *)parent->children +
+		    sizeof(uint32_t) * (key - parent->keys);
+	} else {
 		p = (const char *)parent->children +
 		    sizeof(uint32_t) * (ch - parent->first);
-		off = read_u32_mm(&p);
-
-		return index_mm_read_node(parent->idx, off, child);
 	}
 
-	return NULL;
+	off = read_u32_mm(&p);
+
+	return index_mm_read_node(parent->idx, off, child);
 }
 
 static void index_mm_dump_node(struct index_mm_node *node, struct strbuf *buf,
@@ -938,6 +1274,51 @@ static char *index_mm_search_node(struct index_mm_node *node, const char *key)
 	return NULL;
 }
 
+/*
+ * Look up the key in the hash section: the whole key is hashed once and
+ * compared against a handful of entries instead of reading one trie node
+ * per character.
+ */
+static char *index_mm_search_hash(const struct index_mm *idx, const char *key)
+{
+	size_t keylen = strlen(key);
+	uint32_t hash = hash_fnv1a(key, keylen);
+	uint32_t mask = idx->hash_bucket_count - 1;
+	uint32_t i, pos;
+
+	for (i = 0, pos = hash & mask; i < idx->hash_bucket_count;
+	     i++, pos = (pos + 1) & mask) {
+		const void *p = (const char *)idx->hash_buckets + pos * 2 * sizeof(uint32_t);
+		uint32_t h = read_u32_mm(&p);
+		uint32_t entry = read_u32_mm(&p);
+		uint32_t value;
+		const char *k;
+
+		if (entry == 0)
+			break;
+
+		if (h != hash)
+			continue;
+
+		if (entry >= idx->size || idx->size - entry < sizeof(uint32_t) + keylen + 1)
+			continue;
+
+		p = (const char *)idx->mm + entry;
+		value = read_u32_mm(&p);
+		k = p;
+
+		if (memcmp(k, key, keylen + 1) != 0)
+			continue;
+
+		if (value == 0 || value >= idx->size)
+			return NULL;
+
+		return strndup((const char *)idx->mm + value, idx->size - value);
+	}
+
+	return NULL;
+}
+
 /*
  * Search the index for a key
  *
@@ -949,15 +1330,23 @@ char *index_mm_search(const struct index_mm *idx, const char *key)
 	struct index_mm_node nbuf, *root;
 	char *value;
 
+	if (idx->hash_buckets != NULL)
+		return index_mm_search_hash(idx, key);
+
 	root = index_mm_readroot(idx, &nbuf);
 	value = index_mm_search_node(root, key);
 
 	return value;
 }
 
-/* Level 4: add all the values from a matching node */
+struct index_mm_visitor {
+	index_value_cb cb;
+	void *data;
+};
+
+/* Level 4: visit all the values from a matching node */
 static void index_mm_searchwild_allvalues(struct index_mm_node *node,
-					  struct index_value **out)
+					  const struct index_mm_visitor *out)
 {
 	const void *p;
 	size_t i;
@@ -966,7 +1355,7 @@ static void index_mm_searchwild_allvalues(struct index_mm_node *node,
 		struct index_mm_value v;
 
 		read_value_mm(&p, &v);
-		add_value(out, v.value, v.len, v.priority);
+		out->cb(v.value, v.len, v.priority, out->data);
 	}
 }
 
@@ -975,7 +1364,7 @@ static void index_mm_searchwild_allvalues(struct index_mm_node *node,
  * looking for matches.
  */
 static void index_mm_searchwild_all(struct index_mm_node *node, int j, struct strbuf *buf,
-				    const char *subkey, struct index_value **out)
+				    const char *subkey, const struct index_mm_visitor *out)
 {
 	size_t pushed;
 
@@ -1006,7 +1395,7 @@ static void index_mm_searchwild_all(struct index_mm_node *node, int j, struct st
 
 /* Level 2: descend the tree (until we hit a wildcard) */
 static void index_mm_searchwild_node(struct index_mm_node *node, struct strbuf *buf,
-				     const char *key, struct index_value **out)
+				     const char *key, const struct index_mm_visitor *out)
 {
 	while (node) {
 		struct index_mm_node *child, nbuf;
@@ -1061,18 +1450,371 @@ static void index_mm_searchwild_node(struct index_mm_node *node, struct strbuf *
 	}
 }
 
+/*
+ * Descend the main tree without branching into wildcards, which are looked up
+ * in the wildcard section instead: only the literal key can match here.
+ */
+static void index_mm_searchwild_literal(struct index_mm_node *node, const char *key,
+					const struct index_mm_visitor *out)
+{
+	while (node) {
+		int j;
+
+		for (j = 0; node->prefix[j]; j++) {
+			if (node->prefix[j] != key[j])
+				return;
+		}
+
+		key += j;
+
+		if (*key == '\0') {
+			index_mm_searchwild_allvalues(node, out);
+			return;
+		}
+
+		node = index_mm_readchild(node, *key, node);
+		key++;
+	}
+}
+
+#define INDEX_MODALIAS_BATCH 256
+
+/*
+ * Set match[i] for the entries in [start, start + len) whose fields are all in
+ * range for any of the records. Written as plain loops over the arrays of each
+ * field so the compiler can vectorize them.
+ */
+static void index_mm_modalias_match(const struct index_mm_modalias *m, uint32_t start,
+				    uint32_t len, const struct modalias_record *records,
+				    int n_records, uint8_t *match)
+{
+	uint8_t hit[INDEX_MODALIAS_BATCH];
+	uint32_t i, f;
+
+	memset(match, 0, len);
+
+	for (int r = 0; r < n_records; r++) {
+		memset(hit, 1, len);
+
+		for (f = 0; f < m->field_count; f++) {
+			const uint32_t *lo = m->lo + (size_t)f * m->count + start;
+			const uint32_t *hi = m->hi + (size_t)f * m->count + start;
+			uint32_t v = records[r].field[f];
+
+			for (i = 0; i < len; i++)
+				hit[i] &= (be32toh(lo[i]) <= v) & (v <= be32toh(hi[i]));
+		}
+
+		for (i = 0; i < len; i++)
+			match[i] |= hit[i];
+	}
+}
+
+static void index_mm_modalias_add(const struct index_mm *idx,
+				  const struct index_mm_modalias *m, uint32_t i,
+				  const char *key, bool verify, const struct index_mm_visitor *out)
+{
+	const void *p = (const char *)m->entries + i * 2 * sizeof(uint32_t);
+	uint32_t priority = read_u32_mm(&p);
+	uint32_t offset = read_u32_mm(&p);
+	const char *pattern, *value;
+	size_t len;
+
+	if (offset >= idx->size)
+		return;
+
+	pattern = (const char *)idx->mm + offset;
+	len = strnlen(pattern, idx->size - offset);
+	if (offset + len + 1 >= idx->size)
+		return;
+
+	value = pattern + len + 1;
+	len = strnlen(value, idx->size - (value - (const char *)idx->mm));
+	if (value + len == (const char *)idx->mm + idx->size)
+		return;
+
+	if (verify && fnmatch(pattern, key, 0) != 0)
+		return;
+
+	out->cb(value, len, priority, out->data);
+}
+
+/*
+ * Match the key against the modalias section: the key is parsed once for each
+ * bus and compared against the ranges of all the aliases of that bus. If it
+ * can't be parsed, fall back to calling fnmatch() on each of them.
+ */
+static void index_mm_searchwild_modalias(const struct index_mm *idx, const char *key,
+					 const struct index_mm_visitor *out)
+{
+	for (unsigned int b = 0; b < idx->modalias_count; b++) {
+		const struct index_mm_modalias *m = &idx->modalias[b];
+		struct modalias_record records[MODALIAS_RECORDS_MAX];
+		bool verify = modalias_is_hashed(m->bus);
+		int n;
+
+		n = modalias_parse(m->bus, key, records, ARRAY_SIZE(records));
+		if (n == 0)
+			continue;
+		if (n < 0)
+			verify = true;
+
+		for (uint32_t start = 0; start < m->count; start += INDEX_MODALIAS_BATCH) {
+			uint8_t match[INDEX_MODALIAS_BATCH];
+			uint32_t len = MIN(m->count - start, INDEX_MODALIAS_BATCH);
+
+			if (n < 0)
+				memset(match, 1, len);
+			else
+				index_mm_modalias_match(m, start, len, records, n, match);
+
+			for (uint32_t i = 0; i < len; i++) {
+				if (match[i])
+					index_mm_modalias_add(idx, m, start + i, key, verify,
+							      out);
+			}
+		}
+	}
+}
+
+/*
+ * Descend the tree of the wildcard section, keyed by the literal prefix of each
+ * pattern. Only the patterns stored along the path of the key can match.
+ */
+static void index_mm_searchwild_patterns_values(const struct index_mm_node *node,
+						struct strbuf *buf, const char *key,
+						const struct index_mm_visitor *out)
+{
+	const void *p;
+	size_t i;
+
+	for (i = 0, p = node->values; i < node->value_count; i++) {
+		struct index_mm_value v;
+		const char *modname;
+		size_t len;
+
+		/* value is "<pattern> <modname>" */
+		read_value_mm(&p, &v);
+		modname = memrchr(v.value, ' ', v.len);
+		if (modname == NULL)
+			continue;
+
+		len = modname - v.value;
+		modname++;
+
+		strbuf_clear(buf);
+		if (strbuf_pushmem(buf, v.value, len) != len)
+			continue;
+
+		if (fnmatch(strbuf_str(buf), key, 0) == 0)
+			out->cb(modname, v.len - len - 1, v.priority, out->data);
+	}
+}
+
+static void index_mm_searchwild_patterns(struct index_mm_node *node, struct strbuf *buf,
+					 const char *key, const struct index_mm_visitor *out)
+{
+	while (node) {
+		int j;
+
+		for (j = 0; node->prefix[j]; j++) {
+			if (node->prefix[j] != key[j])
+				return;
+		}
+
+		key += j;
+
+		index_mm_searchwild_patterns_values(node, buf, key, out);
+
+		if (*key == '\0')
+			return;
+
+		node = index_mm_readchild(node, *key, node);
+		key++;
+	}
+}
+
 /*
  * Search the index for a key.  The index may contain wildcards.
  *
- * Returns a list of all the values of matching keys.
+ * Calls @cb for the value of each matching key, without copying it. The order
+ * of the calls is unspecified.
  */
-struct index_value *index_mm_searchwild(const struct index_mm *idx, const char *key)
+void index_mm_searchwild_foreach(const struct index_mm *idx, const char *key,
+				 index_value_cb cb, void *data)
 {
 	DECLARE_STRBUF_WITH_STACK(buf, 128);
+	const struct index_mm_visitor out = { .cb = cb, .data = data };
 	struct index_mm_node nbuf, *root;
-	struct index_value *out = NULL;
 
 	root = index_mm_readroot(idx, &nbuf);
+
+	if (idx->wildcard_root != 0) {
+		index_mm_searchwild_literal(root, key, &out);
+		index_mm_searchwild_modalias(idx, key, &out);
+		root = index_mm_read_node(idx, idx->wildcard_root, &nbuf);
+		index_mm_searchwild_patterns(root, &buf, key, &out);
+		return;
+	}
+
 	index_mm_searchwild_node(root, &buf, key, &out);
-	return out;
+}
+
+#define INDEX_MM_PATH_MAX 64
+
+/*
+ * Nodes along the path of the last key looked up in a trie, so the next key
+ * can resume from the deepest node within their common prefix instead of
+ * starting again at the root.
+ */
+struct index_mm_path {
+	unsigned int depth;
+	struct {
+		struct index_mm_node node;
+		size_t pos; /* where the prefix of node starts in the key */
+	} levels[INDEX_MM_PATH_MAX];
+};
+
+static void index_mm_path_init(struct index_mm_path *path, struct index_mm_node *root)
+{
+	path->depth = 0;
+	if (root == NULL)
+		return;
+
+	path->levels[0].node = *root;
+	path->levels[0].pos = 0;
+	path->depth = 1;
+}
+
+/*
+ * Walk the path of @key, which shares its first @lcp chars with the previous
+ * key. If @patterns is true, the trie is the one of the wildcard section and
+ * the patterns of every node along the path are tried, otherwise only the
+ * values of the node matching the whole key are visited.
+ */
+static void index_mm_path_walk(struct index_mm_path *path, size_t lcp, const char *key,
+			       bool patterns, struct strbuf *buf,
+			       const struct index_mm_visitor *out)
+{
+	struct index_mm_node nbuf, *node;
+	size_t pos;
+
+	while (path->depth > 0 && path->levels[path->depth - 1].pos > lcp)
+		path->depth--;
+
+	if (path->depth == 0)
+		return;
+
+	/*
+	 * The nodes kept above the one to resume from are within the common
+	 * prefix, but their patterns still have to be tried on the rest of
+	 * this key.
+	 */
+	if (patterns) {
+		for (unsigned int i = 0; i < path->depth - 1; i++) {
+			node = &path->levels[i].node;
+			pos = path->levels[i].pos + strlen(node->prefix);
+			index_mm_searchwild_patterns_values(node, buf, key + pos, out);
+		}
+	}
+
+	node = &path->levels[path->depth - 1].node;
+	pos = path->levels[path->depth - 1].pos;
+
+	for (;;) {
+		int j;
+
+		for (j = 0; node->prefix[j]; j++) {
+			if (node->prefix[j] != key[pos + j])
+				return;
+		}
+
+		pos += j;
+
+		if (patterns)
+			index_mm_searchwild_patterns_values(node, buf, key + pos, out);
+
+		if (key[pos] == '\0') {
+			if (!patterns)
+				index_mm_searchwild_allvalues(node, out);
+			return;
+		}
+
+		/* too deep: go on without keeping the nodes, the next key resumes higher */
+		if (path->depth == INDEX_MM_PATH_MAX) {
+			node = index_mm_readchild(node, key[pos], &nbuf);
+			if (node == NULL)
+				return;
+			pos++;
+			continue;
+		}
+
+		node = index_mm_readchild(node, key[pos], &path->levels[path->depth].node);
+		if (node == NULL)
+			return;
+		pos++;
+
+		path->levels[path->depth].pos = pos;
+		path->depth++;
+	}
+}
+
+struct index_mm_batch {
+	index_batch_cb cb;
+	void *data;
+	size_t i;
+};
+
+static void index_mm_batch_visit(const char *value, size_t len, uint32_t priority,
+				 void *data)
+{
+	struct index_mm_batch *batch = data;
+
+	batch->cb(batch->i, value, len, priority, batch->data);
+}
+
+/*
+ * Search the index for several keys at once: consecutive keys sharing a
+ * prefix also share the walk of the trie along that prefix, so @keys should
+ * be sorted. Duplicate keys are looked up each time.
+ *
+ * Calls @cb for the value of each matching key, with the index of the key
+ * in @keys. All the calls for a key are done before moving to the next one.
+ */
+void index_mm_searchwild_batch(const struct index_mm *idx, const char *const *keys,
+			       size_t n_keys, index_batch_cb cb, void *data)
+{
+	DECLARE_STRBUF_WITH_STACK(buf, 128);
+	struct index_mm_batch batch = { .cb = cb, .data = data };
+	const struct index_mm_visitor out = { .cb = index_mm_batch_visit, .data = &batch };
+	struct index_mm_path literal, wildcard;
+	struct index_mm_node nbuf;
+	size_t i;
+
+	if (idx->wildcard_root == 0) {
+		/* the wildcards are spread over the main trie, nothing to share */
+		for (i = 0; i < n_keys; i++) {
+			batch.i = i;
+			index_mm_searchwild_foreach(idx, keys[i], index_mm_batch_visit,
+						    &batch);
+		}
+		return;
+	}
+
+	index_mm_path_init(&literal, index_mm_readroot(idx, &nbuf));
+	index_mm_path_init(&wildcard, index_mm_read_node(idx, idx->wildcard_root, &nbuf));
+
+	for (i = 0; i < n_keys; i++) {
+		size_t lcp = 0;
+
+		if (i > 0) {
+			while (keys[i][lcp] != '\0' && keys[i][lcp] == keys[i - 1][lcp])
+				lcp++;
+		}
+
+		batch.i = i;
+		index_mm_path_walk(&literal, lcp, keys[i], false, &buf, &out);
+		index_mm_searchwild_modalias(idx, keys[i], &out);
+		index_mm_path_walk(&wildcard, lcp, keys[i], true, &buf, &out);
+	}
 }
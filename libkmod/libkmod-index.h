@@ -24,11 +24,24 @@ struct index_value *index_searchwild(struct index_file *idx, const char *key);
 
 void index_values_free(struct index_value *values);
 
+/*
+ * Called by index_mm_searchwild_foreach() for each match. @value is nul
+ * terminated and points into the index, so it's only valid while it's open.
+ */
+typedef void (*index_value_cb)(const char *value, size_t len, uint32_t priority,
+			       void *data);
+/* Same, for index_mm_searchwild_batch(): @i is the index of the key */
+typedef void (*index_batch_cb)(size_t i, const char *value, size_t len,
+			       uint32_t priority, void *data);
+
 /* Implementation using mmap */
 struct index_mm;
 int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
 		  unsigned long long *stamp, struct index_mm **pidx);
 void index_mm_close(struct index_mm *index);
 char *index_mm_search(const struct index_mm *idx, const char *key);
-struct index_value *index_mm_searchwild(const struct index_mm *idx, const char *key);
+void index_mm_searchwild_foreach(const struct index_mm *idx, const char *key,
+				 index_value_cb cb, void *data);
+void index_mm_searchwild_batch(const struct index_mm *idx, const char *const *keys,
+			       size_t n_keys, index_batch_cb cb, void *data);
 void index_mm_dump(const struct index_mm *idx, int fd, bool alias_prefix);
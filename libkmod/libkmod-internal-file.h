@@ -14,8 +14,43 @@ struct kmod_file {
 	void *memory;
 	int (*load)(struct kmod_file *file);
 	const struct kmod_ctx *ctx;
+	size_t capacity; /* of memory, for compressed files */
+	int memfd; /* decompressing into it instead, if >= 0 */
+	bool memfd_prepared;
+	int prepared_memfd; /* or negative errno */
+	bool quiet; /* while prepared by a helper thread */
 };
 
+/*
+ * Log about @file, except from kmod_file_prepare_load(): the log function of the
+ * context is only called by the threads of the application.
+ */
+#define file_log_cond(file, prio, arg...)                        \
+	do {                                                     \
+		if (!(file)->quiet)                              \
+			kmod_log_cond((file)->ctx, prio, ##arg); \
+	} while (0)
+
+#define FILE_DBG(file, arg...) file_log_cond(file, LOG_DEBUG, ##arg)
+#define FILE_ERR(file, arg...) file_log_cond(file, LOG_ERR, ##arg)
+
+/*
+ * Buffer for the decompressed contents, in memory: make it hold at least @size
+ * bytes, keeping what's in it. It's given back to the pool of the context by
+ * kmod_file_buf_release(), which kmod_file_unref() calls.
+ */
+_must_check_ int kmod_file_buf_reserve(struct kmod_file *file, size_t size);
+void kmod_file_buf_release(struct kmod_file *file);
+
+/*
+ * Decoders for the compression of @file, which can be used again. Returns NULL
+ * if there's none in the pool of the context. A decoder given back with about
+ * @size bytes allocated is freed instead if the pool is full.
+ */
+void *kmod_file_decoder_get(struct kmod_file *file);
+void kmod_file_decoder_put(struct kmod_file *file, void *decoder, size_t size,
+			   void (*free_decoder)(void *decoder));
+
 #if ENABLE_XZ
 int kmod_file_load_xz(struct kmod_file *file);
 #else
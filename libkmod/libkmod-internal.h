@@ -71,6 +71,7 @@ _must_check_ struct kmod_list *kmod_list_append_list(struct kmod_list *list1, st
 _nonnull_all_ int kmod_lookup_alias_from_config(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
 _nonnull_all_ int kmod_lookup_alias_from_symbols_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
 _nonnull_all_ int kmod_lookup_alias_from_aliases_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
+_nonnull_all_ int kmod_lookup_alias_from_aliases_file_batch(struct kmod_ctx *ctx, const char *const *names, size_t n_names, struct kmod_list **lists);
 _nonnull_all_ int kmod_lookup_alias_from_moddep_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
 _nonnull_all_ int kmod_lookup_alias_from_kernel_builtin_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
 _nonnull_all_ int kmod_lookup_alias_from_builtin_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list);
@@ -87,6 +88,7 @@ _nonnull_all_ void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module
 
 _nonnull_all_ const struct kmod_config *kmod_get_config(const struct kmod_ctx *ctx);
 _nonnull_all_ enum kmod_file_compression_type kmod_get_kernel_compression(const struct kmod_ctx *ctx);
+_nonnull_all_ struct kmod_file_pool *kmod_get_file_pool(const struct kmod_ctx *ctx);
 
 /* libkmod-config.c */
 struct kmod_config_path {
@@ -136,10 +138,16 @@ _nonnull_all_ bool kmod_module_is_builtin(struct kmod_module *mod);
 
 /* libkmod-file.c */
 struct kmod_file;
+struct kmod_file_pool;
+_must_check_ struct kmod_file_pool *kmod_file_pool_new(void);
+void kmod_file_pool_flush(struct kmod_file_pool *pool);
+void kmod_file_pool_free(struct kmod_file_pool *pool);
 _must_check_ _nonnull_all_ int kmod_file_open(const struct kmod_ctx *ctx, const char *filename, struct kmod_file **file);
 _must_check_ _nonnull_all_ int kmod_file_get_contents(const struct kmod_file *file, const void **contents, off_t *size);
 _must_check_ _nonnull_all_ enum kmod_file_compression_type kmod_file_get_compression(const struct kmod_file *file);
 _must_check_ _nonnull_all_ int kmod_file_get_fd(const struct kmod_file *file);
+_must_check_ _nonnull_all_ int kmod_file_get_memfd(struct kmod_file *file);
+_nonnull_all_ void kmod_file_prepare_load(struct kmod_file *file);
 _nonnull_all_ void kmod_file_unref(struct kmod_file *file);
 
 /* libkmod-elf.c */
@@ -10,6 +10,7 @@
 #include <fnmatch.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -472,6 +473,172 @@ KMOD_EXPORT int kmod_module_new_from_lookup(struct kmod_ctx *ctx, const char *gi
 	return err;
 }
 
+struct lookup_batch_key {
+	const char *alias; /* normalized */
+	size_t offset; /* of alias in the buffer, while it may move */
+	size_t i; /* in the given aliases */
+};
+
+static int lookup_batch_key_cmp(const void *pa, const void *pb)
+{
+	const struct lookup_batch_key *a = pa, *b = pb;
+	int r = strcmp(a->alias, b->alias);
+
+	if (r != 0)
+		return r;
+
+	return a->i < b->i ? -1 : a->i > b->i;
+}
+
+static int lookup_list_copy(struct kmod_list *from, struct kmod_list **to)
+{
+	struct kmod_list *l;
+
+	kmod_list_foreach(l, from) {
+		struct kmod_list *node = kmod_list_append(*to, kmod_module_ref(l->data));
+
+		if (node == NULL) {
+			kmod_module_unref(l->data);
+			return -ENOMEM;
+		}
+		*to = node;
+	}
+
+	return 0;
+}
+
+KMOD_EXPORT int kmod_module_new_from_lookup_batch(struct kmod_ctx *ctx,
+						  const char *const *aliases,
+						  size_t n_aliases,
+						  struct kmod_list **results)
+{
+	/* same order as kmod_module_new_from_lookup(), around the aliases index */
+	static const lookup_func lookup_before[] = {
+		kmod_lookup_alias_from_config,
+		kmod_lookup_alias_from_moddep_file,
+		kmod_lookup_alias_from_symbols_file,
+		kmod_lookup_alias_from_commands,
+	};
+	static const lookup_func lookup_after[] = {
+		kmod_lookup_alias_from_builtin_file,
+		kmod_lookup_alias_from_kernel_builtin_file,
+	};
+	DECLARE_STRBUF(buf);
+	_cleanup_free_ struct lookup_batch_key *keys = NULL;
+	_cleanup_free_ const char **names = NULL;
+	_cleanup_free_ struct kmod_list **lists = NULL;
+	_cleanup_free_ size_t *pending = NULL;
+	size_t i, j, n_keys = 0, n_pending = 0;
+	int err;
+
+	if (ctx == NULL || aliases == NULL)
+		return -ENOENT;
+
+	if (results == NULL)
+		return -ENOSYS;
+
+	for (i = 0; i < n_aliases; i++) {
+		if (results[i] != NULL) {
+			ERR(ctx, "Empty lists are needed to create lookup\n");
+			return -ENOSYS;
+		}
+	}
+
+	keys = malloc(n_aliases * sizeof(*keys));
+	names = malloc(n_aliases * sizeof(*names));
+	lists = calloc(n_aliases, sizeof(*lists));
+	pending = malloc(n_aliases * sizeof(*pending));
+	if (n_aliases > 0 && (keys == NULL || names == NULL || lists == NULL ||
+			      pending == NULL))
+		return -ENOMEM;
+
+	for (i = 0; i < n_aliases; i++) {
+		char alias[PATH_MAX];
+		size_t len;
+
+		if (aliases[i] == NULL)
+			continue;
+
+		if (alias_normalize(aliases[i], alias, &len) < 0) {
+			DBG(ctx, "invalid alias: %s\n", aliases[i]);
+			continue;
+		}
+
+		keys[n_keys].offset = strbuf_used(&buf);
+		keys[n_keys].i = i;
+		if (strbuf_pushmem(&buf, alias, len + 1) != len + 1)
+			return -ENOMEM;
+		n_keys++;
+	}
+
+	for (i = 0; i < n_keys; i++)
+		keys[i].alias = buf.bytes + keys[i].offset;
+
+	/* identical aliases end up next to each other, and similar ones too */
+	qsort(keys, n_keys, sizeof(*keys), lookup_batch_key_cmp);
+
+	for (i = 0; i < n_keys; i++) {
+		struct kmod_list **list = &results[keys[i].i];
+
+		if (i > 0 && streq(keys[i].alias, keys[i - 1].alias))
+			continue;
+
+		err = __kmod_module_new_from_lookup(ctx, lookup_before,
+						    ARRAY_SIZE(lookup_before),
+						    keys[i].alias, list);
+		if (err < 0)
+			goto fail;
+
+		if (*list == NULL) {
+			names[n_pending] = keys[i].alias;
+			pending[n_pending++] = keys[i].i;
+		}
+	}
+
+	/* the aliases index is walked once for all the remaining aliases */
+	err = kmod_lookup_alias_from_aliases_file_batch(ctx, names, n_pending, lists);
+	for (j = 0; j < n_pending; j++)
+		results[pending[j]] = lists[j];
+	if (err < 0)
+		goto fail;
+
+	for (j = 0; j < n_pending; j++) {
+		struct kmod_list **list = &results[pending[j]];
+
+		if (*list != NULL)
+			continue;
+
+		err = __kmod_module_new_from_lookup(ctx, lookup_after,
+						    ARRAY_SIZE(lookup_after), names[j],
+						    list);
+		if (err < 0)
+			goto fail;
+	}
+
+	for (i = 1; i < n_keys; i++) {
+		if (!streq(keys[i].alias, keys[i - 1].alias))
+			continue;
+
+		/* keys[i - 1] already has its own copy if it was a duplicate too */
+		err = lookup_list_copy(results[keys[i - 1].i], &results[keys[i].i]);
+		if (err < 0)
+			goto fail;
+	}
+
+	DBG(ctx, "looked up %zu aliases, %zu of them in the aliases index\n", n_aliases,
+	    n_pending);
+
+	return 0;
+
+fail:
+	for (i = 0; i < n_aliases; i++) {
+		kmod_module_unref_list(results[i]);
+		results[i] = NULL;
+	}
+
+	return err;
+}
+
 KMOD_EXPORT int kmod_module_new_from_name_lookup(struct kmod_ctx *ctx,
 						 const char *modname,
 						 struct kmod_module **mod)
@@ -620,6 +787,43 @@ KMOD_EXPORT int kmod_module_remove_module(struct kmod_module *mod, unsigned int
 
 extern long init_module(const void *mem, unsigned long len, const char *args);
 
+/*
+ * For a module that the kernel can't decompress, stream the decompressed module
+ * into a memfd for finit_module(). That way it's never in memory twice in
+ * userspace, like a heap buffer for init_module() would be next to what the
+ * decoder holds. Return ENOSYS for the init_module() fallback if a memfd can't be
+ * used, or if the kernel refuses to load a module from one, e.g. due to an LSM
+ * that only trusts files from certain filesystems.
+ */
+static int do_finit_module_memfd(struct kmod_module *mod, unsigned int flags,
+				 const char *args)
+{
+	unsigned int kernel_flags = 0;
+	int fd, err;
+
+	fd = kmod_file_get_memfd(mod->file);
+	if (fd < 0)
+		return fd;
+
+	if (flags & KMOD_INSERT_FORCE_VERMAGIC)
+		kernel_flags |= MODULE_INIT_IGNORE_VERMAGIC;
+	if (flags & KMOD_INSERT_FORCE_MODVERSION)
+		kernel_flags |= MODULE_INIT_IGNORE_MODVERSIONS;
+
+	err = finit_module(fd, args, kernel_flags);
+	if (err < 0) {
+		err = -errno;
+		if (err == -EPERM || err == -EACCES) {
+			DBG(mod->ctx, "could not load '%s' from a memfd: %s\n", mod->name,
+			    strerror(-err));
+			err = -ENOSYS;
+		}
+	}
+
+	close(fd);
+	return err;
+}
+
 static int do_finit_module(struct kmod_module *mod, unsigned int flags, const char *args)
 {
 	enum kmod_file_compression_type compression, kernel_compression;
@@ -636,7 +840,7 @@ static int do_finit_module(struct kmod_module *mod, unsigned int flags, const ch
 	kernel_compression = kmod_get_kernel_compression(mod->ctx);
 	if (!(compression == KMOD_FILE_COMPRESSION_NONE ||
 	      compression == kernel_compression))
-		return -ENOSYS;
+		return do_finit_module_memfd(mod, flags, args);
 
 	if (compression != KMOD_FILE_COMPRESSION_NONE)
 		kernel_flags |= MODULE_INIT_COMPRESSED_FILE;
@@ -1001,6 +1205,187 @@ static int kmod_module_get_probe_list(struct kmod_module *mod, bool ignorecmd,
 	return err;
 }
 
+/*
+ * Pipeline for kmod_module_probe_insert_module(): helper threads open the next
+ * modules of the probe list and get them ready to load, while the kernel
+ * initializes the current one. The helpers only deal with a struct kmod_file
+ * and the path looked up beforehand; the modules are only touched by the calling
+ * thread, which hands the files over to them.
+ */
+struct probe_ahead_job {
+	const char *path; /* NULL if nothing to get ready */
+	struct kmod_file *file;
+	bool done;
+};
+
+struct probe_ahead {
+	const struct kmod_ctx *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int ahead;
+	unsigned int next; /* next job for a helper */
+	unsigned int limit; /* helpers don't start jobs from there */
+	bool stop;
+	unsigned int n_threads;
+	pthread_t *threads;
+	unsigned int n_jobs;
+	struct probe_ahead_job jobs[];
+};
+
+static void *probe_ahead_thread(void *data)
+{
+	struct probe_ahead *pa = data;
+
+	pthread_mutex_lock(&pa->lock);
+
+	for (;;) {
+		struct probe_ahead_job *job;
+		struct kmod_file *file = NULL;
+
+		while (!pa->stop && pa->next >= pa->limit)
+			pthread_cond_wait(&pa->cond, &pa->lock);
+		if (pa->stop)
+			break;
+
+		job = &pa->jobs[pa->next++];
+		pthread_mutex_unlock(&pa->lock);
+
+		/* errors are left for the insertion to report */
+		if (job->path != NULL && kmod_file_open(pa->ctx, job->path, &file) == 0)
+			kmod_file_prepare_load(file);
+
+		pthread_mutex_lock(&pa->lock);
+		job->file = file;
+		job->done = true;
+		pthread_cond_broadcast(&pa->cond);
+	}
+
+	pthread_mutex_unlock(&pa->lock);
+
+	return NULL;
+}
+
+static void probe_ahead_free(struct probe_ahead *pa)
+{
+	if (pa == NULL)
+		return;
+
+	pthread_mutex_lock(&pa->lock);
+	pa->stop = true;
+	pthread_cond_broadcast(&pa->cond);
+	pthread_mutex_unlock(&pa->lock);
+
+	for (unsigned int i = 0; i < pa->n_threads; i++)
+		pthread_join(pa->threads[i], NULL);
+
+	for (unsigned int i = 0; i < pa->n_jobs; i++) {
+		if (pa->jobs[i].file != NULL)
+			kmod_file_unref(pa->jobs[i].file);
+	}
+
+	pthread_cond_destroy(&pa->cond);
+	pthread_mutex_destroy(&pa->lock);
+	free(pa->threads);
+	free(pa);
+}
+
+/*
+ * Start getting ready the modules of @list that may be inserted, i.e. not ones
+ * with install commands, already loaded or opened. Returns NULL if there aren't
+ * at least 2 of them, since there would be nothing to overlap.
+ */
+static struct probe_ahead *probe_ahead_new(struct kmod_ctx *ctx, unsigned int flags,
+					   struct kmod_list *list)
+{
+	unsigned int ahead = kmod_get_probe_ahead(ctx);
+	unsigned int n_jobs = 0, n_paths = 0, n_threads, i = 0;
+	struct probe_ahead *pa;
+	struct kmod_list *l;
+
+	if (ahead == 0 || (flags & KMOD_PROBE_DRY_RUN))
+		return NULL;
+
+	kmod_list_foreach(l, list)
+		n_jobs++;
+
+	pa = calloc(1, sizeof(*pa) + n_jobs * sizeof(pa->jobs[0]));
+	if (pa == NULL)
+		return NULL;
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *m = l->data;
+		struct probe_ahead_job *job = &pa->jobs[i++];
+
+		if (m->file != NULL ||
+		    (kmod_module_get_install_commands(m) != NULL && !m->ignorecmd) ||
+		    (!(flags & KMOD_PROBE_IGNORE_LOADED) && module_is_inkernel(m)))
+			continue;
+
+		job->path = kmod_module_get_path(m);
+		if (job->path != NULL)
+			n_paths++;
+	}
+
+	if (n_paths < 2) {
+		free(pa);
+		return NULL;
+	}
+
+	pa->ctx = ctx;
+	pa->ahead = ahead;
+	pa->n_jobs = n_jobs;
+	pa->limit = ahead < n_jobs ? ahead + 1 : n_jobs;
+	pthread_mutex_init(&pa->lock, NULL);
+	pthread_cond_init(&pa->cond, NULL);
+
+	n_threads = ahead < n_paths ? ahead : n_paths;
+	pa->threads = calloc(n_threads, sizeof(pa->threads[0]));
+	if (pa->threads == NULL) {
+		probe_ahead_free(pa);
+		return NULL;
+	}
+
+	/* with fewer threads, the calling thread takes what they can't get to */
+	for (unsigned int t = 0; t < n_threads; t++) {
+		if (pthread_create(&pa->threads[t], NULL, probe_ahead_thread, pa) != 0)
+			break;
+		pa->n_threads++;
+	}
+
+	DBG(ctx, "getting ready up to %u modules ahead with %u threads\n", ahead,
+	    pa->n_threads);
+
+	return pa;
+}
+
+/*
+ * Take the file of the @i-th module, once ready, and let the helpers go on with
+ * the next ones. Returns NULL if no helper started with it yet, in which case
+ * the calling thread just does it itself.
+ */
+static struct kmod_file *probe_ahead_take(struct probe_ahead *pa, unsigned int i)
+{
+	struct kmod_file *file = NULL;
+
+	pthread_mutex_lock(&pa->lock);
+
+	pa->limit = pa->ahead < pa->n_jobs - i ? i + 1 + pa->ahead : pa->n_jobs;
+	pthread_cond_broadcast(&pa->cond);
+
+	if (pa->next <= i) {
+		pa->next = i + 1;
+	} else {
+		while (!pa->jobs[i].done)
+			pthread_cond_wait(&pa->cond, &pa->lock);
+		file = pa->jobs[i].file;
+		pa->jobs[i].file = NULL;
+	}
+
+	pthread_mutex_unlock(&pa->lock);
+
+	return file;
+}
+
 KMOD_EXPORT int kmod_module_probe_insert_module(
 	struct kmod_module *mod, unsigned int flags, const char *extra_options,
 	int (*run_install)(struct kmod_module *m, const char *cmd, void *data),
@@ -1009,6 +1394,8 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 {
 	struct kmod_list *list = NULL, *l;
 	struct probe_insert_cb cb;
+	struct probe_ahead *pa;
+	unsigned int i = 0;
 	int err;
 
 	if (mod == NULL)
@@ -1055,12 +1442,18 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 	cb.run_install = run_install;
 	cb.data = (void *)data;
 
+	pa = probe_ahead_new(mod->ctx, flags, list);
+
 	kmod_list_foreach(l, list) {
 		struct kmod_module *m = l->data;
 		const char *moptions = kmod_module_get_options(m);
 		const char *cmd = kmod_module_get_install_commands(m);
+		struct kmod_file *file = NULL;
 		char *options;
 
+		if (pa != NULL)
+			file = probe_ahead_take(pa, i++);
+
 		if (!(flags & KMOD_PROBE_IGNORE_LOADED) && module_is_inkernel(m)) {
 			DBG(mod->ctx, "Ignoring module '%s': already loaded\n", m->name);
 			err = -EEXIST;
@@ -1080,13 +1473,21 @@ KMOD_EXPORT int kmod_module_probe_insert_module(
 			if (print_action != NULL)
 				print_action(m, false, options ?: "");
 
-			if (!(flags & KMOD_PROBE_DRY_RUN))
+			if (!(flags & KMOD_PROBE_DRY_RUN)) {
+				if (file != NULL && m->file == NULL) {
+					m->file = file;
+					file = NULL;
+				}
 				err = kmod_module_insert_module(m, flags, options);
+			}
 		}
 
 		free(options);
 
 finish_module:
+		if (file != NULL)
+			kmod_file_unref(file);
+
 		/*
 		 * Treat "already loaded" error. If we were told to stop on
 		 * already loaded and the module being loaded is not a softdep
@@ -1110,6 +1511,7 @@ finish_module:
 			break;
 	}
 
+	probe_ahead_free(pa);
 	kmod_module_unref_list(list);
 	return err;
 }
@@ -65,6 +65,10 @@ struct kmod_ctx {
 	struct hash *modules_by_name;
 	struct index_mm *indexes[_KMOD_INDEX_MODULES_SIZE];
 	unsigned long long indexes_stamp[_KMOD_INDEX_MODULES_SIZE];
+	unsigned int index_access;
+	unsigned int decompress_threads;
+	unsigned int probe_ahead;
+	struct kmod_file_pool *file_pool;
 };
 
 void kmod_log(const struct kmod_ctx *ctx, int priority, const char *file, int line,
@@ -165,6 +169,56 @@ static int log_priority(const char *priority)
 	return 0;
 }
 
+static unsigned int index_access(struct kmod_ctx *ctx, const char *access)
+{
+	static const struct {
+		const char *name;
+		unsigned int flag;
+	} hints[] = {
+		{ "populate", KMOD_INDEX_ACCESS_POPULATE },
+		{ "random", KMOD_INDEX_ACCESS_RANDOM },
+		{ "hugepage", KMOD_INDEX_ACCESS_HUGEPAGE },
+	};
+	unsigned int flags = 0;
+
+	while (*access != '\0') {
+		size_t len = strcspn(access, ",");
+		size_t i;
+
+		for (i = 0; i < ARRAY_SIZE(hints); i++) {
+			if (strlen(hints[i].name) == len &&
+			    strncmp(access, hints[i].name, len) == 0) {
+				flags |= hints[i].flag;
+				break;
+			}
+		}
+
+		if (i == ARRAY_SIZE(hints) && len > 0)
+			ERR(ctx, "unknown index access hint '%.*s'\n", (int)len, access);
+
+		access += len;
+		if (*access == ',')
+			access++;
+	}
+
+	return flags;
+}
+
+static bool parse_uint(const char *str, unsigned int *out)
+{
+	char *endptr;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(str, &endptr, 10);
+	if (errno == ERANGE || n > UINT_MAX || endptr == str || endptr[0] != '\0' ||
+	    str[0] == '-')
+		return false;
+
+	*out = n;
+	return true;
+}
+
 static const char *dirname_default_prefix = MODULE_DIRECTORY;
 
 static char *get_kernel_release(const char *dirname)
@@ -221,6 +275,7 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname, const char *const *co
 {
 	const char *env;
 	struct kmod_ctx *ctx;
+	unsigned int n;
 	int err;
 
 	ctx = calloc(1, sizeof(struct kmod_ctx));
@@ -231,6 +286,7 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname, const char *const *co
 	ctx->log_fn = log_filep;
 	ctx->log_data = stderr;
 	ctx->log_priority = LOG_ERR;
+	ctx->decompress_threads = 1;
 
 	ctx->dirname = get_kernel_release(dirname);
 	if (ctx->dirname == NULL) {
@@ -243,6 +299,26 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname, const char *const *co
 	if (env != NULL)
 		kmod_set_log_priority(ctx, log_priority(env));
 
+	env = secure_getenv("KMOD_INDEX_ACCESS");
+	if (env != NULL)
+		kmod_set_index_access(ctx, index_access(ctx, env));
+
+	env = secure_getenv("KMOD_DECOMPRESS_THREADS");
+	if (env != NULL) {
+		if (parse_uint(env, &n))
+			kmod_set_decompress_threads(ctx, n);
+		else
+			ERR(ctx, "invalid number of decompression threads '%s'\n", env);
+	}
+
+	env = secure_getenv("KMOD_PROBE_AHEAD");
+	if (env != NULL) {
+		if (parse_uint(env, &n))
+			kmod_set_probe_ahead(ctx, n);
+		else
+			ERR(ctx, "invalid number of modules to probe ahead '%s'\n", env);
+	}
+
 	ctx->kernel_compression = get_kernel_compression(ctx);
 
 	if (config_paths == NULL)
@@ -259,6 +335,12 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname, const char *const *co
 		goto fail;
 	}
 
+	ctx->file_pool = kmod_file_pool_new();
+	if (ctx->file_pool == NULL) {
+		ERR(ctx, "could not create file pool\n");
+		goto fail;
+	}
+
 	INFO(ctx, "ctx %p created\n", ctx);
 	DBG(ctx, "log_priority=%d\n", ctx->log_priority);
 
@@ -294,6 +376,7 @@ KMOD_EXPORT struct kmod_ctx *kmod_unref(struct kmod_ctx *ctx)
 	free(ctx->dirname);
 	if (ctx->config)
 		kmod_config_free(ctx->config);
+	kmod_file_pool_free(ctx->file_pool);
 
 	free(ctx);
 	return NULL;
@@ -326,6 +409,48 @@ KMOD_EXPORT void kmod_set_log_priority(struct kmod_ctx *ctx, int priority)
 	ctx->log_priority = priority;
 }
 
+KMOD_EXPORT void kmod_set_index_access(struct kmod_ctx *ctx, unsigned int flags)
+{
+	if (ctx == NULL)
+		return;
+	ctx->index_access = flags;
+}
+
+KMOD_EXPORT unsigned int kmod_get_index_access(const struct kmod_ctx *ctx)
+{
+	if (ctx == NULL)
+		return 0;
+	return ctx->index_access;
+}
+
+KMOD_EXPORT void kmod_set_decompress_threads(struct kmod_ctx *ctx, unsigned int threads)
+{
+	if (ctx == NULL)
+		return;
+	ctx->decompress_threads = threads;
+}
+
+KMOD_EXPORT unsigned int kmod_get_decompress_threads(const struct kmod_ctx *ctx)
+{
+	if (ctx == NULL)
+		return 1;
+	return ctx->decompress_threads;
+}
+
+KMOD_EXPORT void kmod_set_probe_ahead(struct kmod_ctx *ctx, unsigned int modules)
+{
+	if (ctx == NULL)
+		return;
+	ctx->probe_ahead = modules;
+}
+
+KMOD_EXPORT unsigned int kmod_get_probe_ahead(const struct kmod_ctx *ctx)
+{
+	if (ctx == NULL)
+		return 0;
+	return ctx->probe_ahead;
+}
+
 struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx, const char *key)
 {
 	struct kmod_module *mod;
@@ -351,6 +476,122 @@ void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod, const c
 	hash_del(ctx->modules_by_name, key);
 }
 
+static int kmod_lookup_alias_append(struct kmod_ctx *ctx, const char *name,
+				    const char *realname, struct kmod_list **list)
+{
+	struct kmod_module *mod;
+	struct kmod_list *node;
+	int err;
+
+	err = kmod_module_new_from_alias(ctx, name, realname, &mod);
+	if (err < 0) {
+		ERR(ctx, "Could not create module for alias=%s realname=%s: %s\n", name,
+		    realname, strerror(-err));
+		return err;
+	}
+
+	node = kmod_list_append(*list, mod);
+	if (node == NULL) {
+		ERR(ctx, "out of memory\n");
+		kmod_module_unref(mod);
+		return -ENOMEM;
+	}
+	*list = node;
+
+	return 0;
+}
+
+struct alias_match {
+	const char *value; /* points into the mmap'ed index */
+	uint32_t priority;
+};
+
+/* Matches of index_mm_searchwild_foreach(), sorted by priority */
+struct alias_matches {
+	struct alias_match *array;
+	size_t count;
+	size_t size;
+	int err;
+	struct alias_match stack[16];
+};
+
+static void alias_matches_add(const char *value, _maybe_unused_ size_t len,
+			      uint32_t priority, void *data)
+{
+	struct alias_matches *m = data;
+	size_t i;
+
+	if (m->err < 0)
+		return;
+
+	if (m->count == m->size) {
+		struct alias_match *array;
+		size_t size = m->size * 2;
+
+		if (m->array == m->stack) {
+			array = malloc(size * sizeof(*array));
+			if (array != NULL)
+				memcpy(array, m->stack, sizeof(m->stack));
+		} else {
+			array = realloc(m->array, size * sizeof(*array));
+		}
+
+		if (array == NULL) {
+			m->err = -ENOMEM;
+			return;
+		}
+
+		m->array = array;
+		m->size = size;
+	}
+
+	/* same order as the list of index_searchwild() */
+	for (i = 0; i < m->count && m->array[i].priority < priority; i++)
+		;
+
+	memmove(&m->array[i + 1], &m->array[i], (m->count - i) * sizeof(*m->array));
+	m->array[i].value = value;
+	m->array[i].priority = priority;
+	m->count++;
+}
+
+static int kmod_lookup_alias_from_alias_mm(struct kmod_ctx *ctx,
+					   enum kmod_index index_number,
+					   const char *name, struct kmod_list **list)
+{
+	struct alias_matches m = {
+		.size = ARRAY_SIZE(m.stack),
+	};
+	int err;
+	size_t i;
+
+	m.array = m.stack;
+
+	index_mm_searchwild_foreach(ctx->indexes[index_number], name, alias_matches_add,
+				    &m);
+	if (m.err < 0) {
+		ERR(ctx, "out of memory\n");
+		err = m.err;
+		goto fail;
+	}
+
+	for (i = 0; i < m.count; i++) {
+		err = kmod_lookup_alias_append(ctx, name, m.array[i].value, list);
+		if (err < 0)
+			goto fail;
+	}
+
+	if (m.array != m.stack)
+		free(m.array);
+	return m.count;
+
+fail:
+	kmod_list_release(*list, kmod_module_unref);
+	if (m.array != m.stack)
+		free(m.array);
+	return err;
+}
+
 static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
 					    enum kmod_index index_number,
 					    const char *name, struct kmod_list **list)
@@ -358,48 +599,31 @@ static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
 	int err, nmatch = 0;
 	struct index_file *idx;
 	struct index_value *realnames, *realname;
+	char fn[PATH_MAX];
 
 	assert(*list == NULL);
 
 	if (ctx->indexes[index_number] != NULL) {
 		DBG(ctx, "use mmapped index '%s' for name=%s\n",
 		    index_files[index_number].fn, name);
-		realnames = index_mm_searchwild(ctx->indexes[index_number], name);
-	} else {
-		char fn[PATH_MAX];
+		return kmod_lookup_alias_from_alias_mm(ctx, index_number, name, list);
+	}
 
-		snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
-			 index_files[index_number].fn);
+	snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname, index_files[index_number].fn);
 
-		DBG(ctx, "file=%s name=%s\n", fn, name);
+	DBG(ctx, "file=%s name=%s\n", fn, name);
 
-		idx = index_file_open(fn);
-		if (idx == NULL)
-			return -ENOSYS;
+	idx = index_file_open(fn);
+	if (idx == NULL)
+		return -ENOSYS;
 
-		realnames = index_searchwild(idx, name);
-		index_file_close(idx);
-	}
+	realnames = index_searchwild(idx, name);
+	index_file_close(idx);
 
 	for (realname = realnames; realname; realname = realname->next) {
-		struct kmod_module *mod;
-		struct kmod_list *node;
-
-		err = kmod_module_new_from_alias(ctx, name, realname->value, &mod);
-		if (err < 0) {
-			ERR(ctx, "Could not create module for alias=%s realname=%s: %s\n",
-			    name, realname->value, strerror(-err));
+		err = kmod_lookup_alias_append(ctx, name, realname->value, list);
+		if (err < 0)
 			goto fail;
-		}
-
-		node = kmod_list_append(*list, mod);
-		if (node == NULL) {
-			ERR(ctx, "out of memory\n");
-			kmod_module_unref(mod);
-			err = -ENOMEM;
-			goto fail;
-		}
-		*list = node;
 		nmatch++;
 	}
 
@@ -428,6 +652,83 @@ int kmod_lookup_alias_from_aliases_file(struct kmod_ctx *ctx, const char *name,
 	return kmod_lookup_alias_from_alias_bin(ctx, KMOD_INDEX_MODULES_ALIAS, name, list);
 }
 
+struct alias_batch {
+	struct kmod_ctx *ctx;
+	const char *const *names;
+	struct kmod_list **lists;
+	size_t current;
+	struct alias_matches m;
+};
+
+/* Create the modules for the matches of the current name */
+static void alias_batch_flush(struct alias_batch *b)
+{
+	for (size_t i = 0; i < b->m.count && b->m.err == 0; i++) {
+		b->m.err = kmod_lookup_alias_append(b->ctx, b->names[b->current],
+						    b->m.array[i].value,
+						    &b->lists[b->current]);
+	}
+
+	b->m.count = 0;
+}
+
+static void alias_batch_add(size_t i, const char *value, size_t len, uint32_t priority,
+			    void *data)
+{
+	struct alias_batch *b = data;
+
+	if (i != b->current) {
+		alias_batch_flush(b);
+		b->current = i;
+	}
+
+	alias_matches_add(value, len, priority, &b->m);
+}
+
+/*
+ * Look up all the @names in the aliases index, saving the modules matching
+ * names[i] in lists[i]. The lists aren't released on error.
+ */
+int kmod_lookup_alias_from_aliases_file_batch(struct kmod_ctx *ctx,
+					      const char *const *names, size_t n_names,
+					      struct kmod_list **lists)
+{
+	struct alias_batch b = {
+		.ctx = ctx,
+		.names = names,
+		.lists = lists,
+		.m.size = ARRAY_SIZE(b.m.stack),
+	};
+	size_t i;
+	int err;
+
+	if (ctx->indexes[KMOD_INDEX_MODULES_ALIAS] == NULL) {
+		for (i = 0; i < n_names; i++) {
+			err = kmod_lookup_alias_from_aliases_file(ctx, names[i], &lists[i]);
+			if (err < 0 && err != -ENOSYS)
+				return err;
+		}
+
+		return 0;
+	}
+
+	DBG(ctx, "use mmapped index '%s' for %zu names\n",
+	    index_files[KMOD_INDEX_MODULES_ALIAS].fn, n_names);
+
+	b.m.array = b.m.stack;
+	index_mm_searchwild_batch(ctx->indexes[KMOD_INDEX_MODULES_ALIAS], names, n_names,
+				  alias_batch_add, &b);
+	alias_batch_flush(&b);
+
+	if (b.m.array != b.m.stack)
+		free(b.m.array);
+
+	if (b.m.err < 0)
+		ERR(ctx, "batch lookup of aliases failed: %s\n", strerror(-b.m.err));
+
+	return b.m.err;
+}
+
 static char *lookup_file(struct kmod_ctx *ctx, enum kmod_index index_number,
 			 const char *name)
 {
@@ -809,6 +1110,8 @@ KMOD_EXPORT void kmod_unload_resources(struct kmod_ctx *ctx)
 			ctx->indexes_stamp[i] = 0;
 		}
 	}
+
+	kmod_file_pool_flush(ctx->file_pool);
 }
 
 KMOD_EXPORT int kmod_dump_index(struct kmod_ctx *ctx, enum kmod_index type, int fd)
@@ -857,3 +1160,8 @@ enum kmod_file_compression_type kmod_get_kernel_compression(const struct kmod_ct
 {
 	return ctx->kernel_compression;
 }
+
+struct kmod_file_pool *kmod_get_file_pool(const struct kmod_ctx *ctx)
+{
+	return ctx->file_pool;
+}
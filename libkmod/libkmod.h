@@ -106,7 +106,8 @@ int kmod_load_resources(struct kmod_ctx *ctx);
  * @ctx: kmod library context
  *
  * Unload all the indexes. This will free the resources to maintain the index
- * open and all subsequent searches will need to open and close the index.
+ * open and all subsequent searches will need to open and close the index. The
+ * buffers and decoders kept for decompressing modules are freed as well.
  *
  * User is free to call kmod_load_resources() and kmod_unload_resources() as
  * many times as wanted during the lifecycle of @ctx. For example, if a daemon
@@ -186,6 +187,111 @@ enum kmod_index {
  */
 int kmod_dump_index(struct kmod_ctx *ctx, enum kmod_index type, int fd);
 
+/**
+ * kmod_index_access:
+ * @KMOD_INDEX_ACCESS_POPULATE: prefault small indexes when they are loaded
+ * @KMOD_INDEX_ACCESS_RANDOM: disable readahead for big indexes, since lookups
+ * touch only a few scattered pages of them
+ * @KMOD_INDEX_ACCESS_HUGEPAGE: map big indexes aligned to huge pages and ask the
+ * kernel to back them with huge pages, if it supports that for files
+ *
+ * Hints on how the indexes loaded by kmod_load_resources() are accessed, used by
+ * kmod_set_index_access(). Indexes up to 1 MiB are considered small, the others
+ * big. Huge pages are only used for indexes of at least 2 MiB.
+ *
+ * These mostly help long-running processes doing many lookups, by avoiding the
+ * page faults of the first ones.
+ */
+enum kmod_index_access {
+	KMOD_INDEX_ACCESS_POPULATE = 0x1,
+	KMOD_INDEX_ACCESS_RANDOM = 0x2,
+	KMOD_INDEX_ACCESS_HUGEPAGE = 0x4,
+};
+
+/**
+ * kmod_set_index_access:
+ * @ctx: kmod library context
+ * @flags: the new access hints, a bitwise OR of #kmod_index_access
+ *
+ * Set the hints used to map the indexes on the next call to
+ * kmod_load_resources(); indexes already loaded are not affected. By default
+ * no hint is used, unless set with the KMOD_INDEX_ACCESS environment variable
+ * as a comma-separated list of "populate", "random" and "hugepage".
+ *
+ * Since: 35
+ */
+void kmod_set_index_access(struct kmod_ctx *ctx, unsigned int flags);
+
+/**
+ * kmod_get_index_access:
+ * @ctx: kmod library context
+ *
+ * Get the hints used to map the indexes.
+ *
+ * Returns: the current access hints, a bitwise OR of #kmod_index_access
+ *
+ * Since: 35
+ */
+unsigned int kmod_get_index_access(const struct kmod_ctx *ctx);
+
+/**
+ * kmod_set_decompress_threads:
+ * @ctx: kmod library context
+ * @threads: the new number of threads, or 0 for one per online CPU
+ *
+ * Set how many threads may be used to decompress a module that the kernel
+ * can't decompress by itself. Only xz is decompressed with several threads,
+ * if liblzma supports it, and only files made of several blocks benefit
+ * from it, e.g. compressed with xz --threads or --block-size. By default 1
+ * thread is used, unless set with the KMOD_DECOMPRESS_THREADS environment
+ * variable.
+ *
+ * Since: 35
+ */
+void kmod_set_decompress_threads(struct kmod_ctx *ctx, unsigned int threads);
+
+/**
+ * kmod_get_decompress_threads:
+ * @ctx: kmod library context
+ *
+ * Get how many threads may be used to decompress a module.
+ *
+ * Returns: the current number of threads, or 0 for one per online CPU
+ *
+ * Since: 35
+ */
+unsigned int kmod_get_decompress_threads(const struct kmod_ctx *ctx);
+
+/**
+ * kmod_set_probe_ahead:
+ * @ctx: kmod library context
+ * @modules: the new number of modules, or 0 to disable it
+ *
+ * Set how many of the next modules kmod_module_probe_insert_module() gets
+ * ready in helper threads while the kernel initializes the current one: they
+ * are decompressed if the kernel can't decompress them, otherwise read ahead.
+ * This uses up to @modules threads, and memory for as many decompressed
+ * modules. By default it's disabled, unless set with the KMOD_PROBE_AHEAD
+ * environment variable. The helper threads don't log: errors are logged by the
+ * calling thread when it inserts the module they are about.
+ *
+ * Since: 35
+ */
+void kmod_set_probe_ahead(struct kmod_ctx *ctx, unsigned int modules);
+
+/**
+ * kmod_get_probe_ahead:
+ * @ctx: kmod library context
+ *
+ * Get how many of the next modules kmod_module_probe_insert_module() gets
+ * ready while the current one is inserted.
+ *
+ * Returns: the current number of modules, or 0 if disabled
+ *
+ * Since: 35
+ */
+unsigned int kmod_get_probe_ahead(const struct kmod_ctx *ctx);
+
 /**
  * kmod_set_log_priority:
  * @ctx: kmod library context
@@ -578,6 +684,30 @@ struct kmod_module;
 int kmod_module_new_from_lookup(struct kmod_ctx *ctx, const char *given_alias,
 				struct kmod_list **list);
 
+/**
+ * kmod_module_new_from_lookup_batch:
+ * @ctx: kmod library context
+ * @aliases: aliases to look for
+ * @n_aliases: number of aliases
+ * @results: array of @n_aliases empty lists, where to save the list of modules
+ * matching each alias
+ *
+ * Same as calling kmod_module_new_from_lookup() for each one of @aliases,
+ * saving the modules matching aliases[i] in results[i], but faster for many
+ * aliases: identical aliases are only looked up once and the aliases index is
+ * walked only once for all of them, sharing the common prefixes.
+ *
+ * Aliases that are NULL or invalid are skipped, leaving their list empty.
+ *
+ * Returns: 0 on success or < 0 otherwise. On failure all the lists in
+ * @results are released and left empty. If an alias is not found, its list
+ * is left empty.
+ *
+ * Since: 35
+ */
+int kmod_module_new_from_lookup_batch(struct kmod_ctx *ctx, const char *const *aliases,
+				      size_t n_aliases, struct kmod_list **results);
+
 /**
  * kmod_module_new_from_name_lookup:
  * @ctx: kmod library context
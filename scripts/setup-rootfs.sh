@@ -72,6 +72,35 @@ map=(
     ["test-depmod/search-order-override$MODULE_DIRECTORY/4.4.4/override/"]="mod-simple.ko"
     ["test-depmod/check-weakdep$MODULE_DIRECTORY/4.4.4/kernel/mod-weakdep.ko"]="mod-weakdep.ko"
     ["test-depmod/check-weakdep$MODULE_DIRECTORY/4.4.4/kernel/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/update-add$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-depmod/update-add$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-b.ko"]="mod-foo-b.ko"
+    ["test-depmod/update-add$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-c.ko"]="mod-foo-c.ko"
+    ["test-depmod/update-add/staging/mod-foo.ko"]="mod-foo.ko"
+    ["test-depmod/update-add/staging/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/update-replace$MODULE_DIRECTORY/4.4.4/kernel/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/update-replace$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-depmod/update-replace/staging/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/update-remove$MODULE_DIRECTORY/4.4.4/kernel/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/update-remove$MODULE_DIRECTORY/4.4.4/updates/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/update-remove/staging/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-depmod/maybe-all$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-depmod/maybe-all$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-b.ko"]="mod-foo-b.ko"
+    ["test-depmod/maybe-all$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-c.ko"]="mod-foo-c.ko"
+    ["test-depmod/maybe-all$MODULE_DIRECTORY/4.4.4/kernel/mod-foo.ko"]="mod-foo.ko"
+    ["test-depmod/maybe-all/staging/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/maybe-all-config$MODULE_DIRECTORY/4.4.4/kernel/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/maybe-all-corrupt$MODULE_DIRECTORY/4.4.4/kernel/mod-simple.ko"]="mod-simple.ko"
+    ["test-depmod/unchanged-outputs$MODULE_DIRECTORY/4.4.4/kernel/mod-fake-hpsa.ko"]="mod-fake-hpsa.ko"
+    ["test-depmod/unchanged-outputs$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-depmod/unchanged-outputs$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-b.ko"]="mod-foo-b.ko"
+    ["test-depmod/unchanged-outputs$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-c.ko"]="mod-foo-c.ko"
+    ["test-depmod/unchanged-outputs$MODULE_DIRECTORY/4.4.4/kernel/mod-foo.ko"]="mod-foo.ko"
+    ["test-depmod/unchanged-outputs/staging/mod-foo.ko"]="mod-simple.ko"
+    ["test-depmod/many-modules$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-depmod/many-modules$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-b.ko"]="mod-foo-b.ko"
+    ["test-depmod/many-modules$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-c.ko"]="mod-foo-c.ko"
+    ["test-depmod/many-modules$MODULE_DIRECTORY/4.4.4/kernel/many/mod-many-0.ko"]="mod-foo.ko"
+    ["test-depmod/many-modules$MODULE_DIRECTORY/4.4.4/kernel/many/mod-many-1.ko"]="mod-foo.ko"
     ["test-dependencies$MODULE_DIRECTORY/4.0.20-kmod/kernel/fs/foo/"]="mod-foo-b.ko"
     ["test-dependencies$MODULE_DIRECTORY/4.0.20-kmod/kernel/"]="mod-foo-c.ko"
     ["test-dependencies$MODULE_DIRECTORY/4.0.20-kmod/kernel/lib/"]="mod-foo-a.ko"
@@ -99,6 +128,14 @@ map=(
     ["test-modprobe/oldkernel-force-vermagic$MODULE_DIRECTORY/3.3.3/kernel/"]="mod-simple.ko"
     ["test-modprobe/alias-to-none$MODULE_DIRECTORY/4.4.4/kernel/"]="mod-simple.ko"
     ["test-modprobe/module-param-kcmdline$MODULE_DIRECTORY/4.4.4/kernel/"]="mod-simple.ko"
+    ["test-modprobe/compressed-memfd$MODULE_DIRECTORY/4.4.4/kernel/mod-simple.ko"]="mod-simple.ko"
+    ["test-modprobe/compressed-memfd-oldkernel$MODULE_DIRECTORY/3.3.3/kernel/mod-simple.ko"]="mod-simple.ko"
+    ["test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-b.ko"]="mod-foo-b.ko"
+    ["test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-c.ko"]="mod-foo-c.ko"
+    ["test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo.ko"]="mod-foo.ko"
+    ["test-modprobe/probe-ahead-error$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"]="mod-foo-a.ko"
+    ["test-modprobe/probe-ahead-error$MODULE_DIRECTORY/4.4.4/kernel/mod-foo.ko"]="mod-foo.ko"
     ["test-modprobe/external/lib/modules/external/"]="mod-simple.ko"
     ["test-modprobe/module-from-abspath/home/foo/"]="mod-simple.ko"
     ["test-modprobe/module-from-relpath/home/foo/"]="mod-simple.ko"
@@ -110,6 +147,8 @@ map=(
     ["test-depmod/modules-outdir$MODULE_DIRECTORY/4.4.4/kernel/drivers/scsi/scsi_mod.ko"]="mod-fake-scsi-mod.ko"
     ["test-depmod/another-moddir/foobar/4.4.4/kernel/"]="mod-simple.ko"
     ["test-depmod/another-moddir/foobar2/4.4.4/kernel/"]="mod-simple.ko"
+    ["test-init-decompress/mod-simple.ko"]="mod-simple.ko"
+    ["test-init-decompress/mod-simple-blocks.ko"]="mod-simple.ko"
     # TODO: add cross-compiled modules to the test
     ["test-modinfo/mod-simple.ko"]="mod-simple.ko"
     ["test-modinfo/mod-simple-sha1.ko"]="mod-simple.ko"
@@ -133,6 +172,19 @@ gzip_array=(
 
 xz_array=(
     "test-depmod/modules-order-compressed$MODULE_DIRECTORY/4.4.4/kernel/drivers/scsi/scsi_mod.ko"
+    "test-modprobe/compressed-memfd$MODULE_DIRECTORY/4.4.4/kernel/mod-simple.ko"
+    "test-modprobe/compressed-memfd-oldkernel$MODULE_DIRECTORY/3.3.3/kernel/mod-simple.ko"
+    "test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"
+    "test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-b.ko"
+    "test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-c.ko"
+    "test-modprobe/probe-ahead$MODULE_DIRECTORY/4.4.4/kernel/mod-foo.ko"
+    "test-modprobe/probe-ahead-error$MODULE_DIRECTORY/4.4.4/kernel/mod-foo-a.ko"
+    "test-modprobe/probe-ahead-error$MODULE_DIRECTORY/4.4.4/kernel/mod-foo.ko"
+    )
+
+# several blocks with their sizes in the headers, so they can be decoded in parallel
+xz_blocks_array=(
+    "test-init-decompress/mod-simple-blocks.ko"
     )
 
 zstd_array=(
@@ -178,6 +230,9 @@ if feature_enabled XZ; then
 	for m in "${xz_array[@]}"; do
 	    xz "$ROOTFS/$m"
 	done
+	for m in "${xz_blocks_array[@]}"; do
+	    xz --threads=2 --block-size=1KiB "$ROOTFS/$m"
+	done
 fi
 
 if feature_enabled ZSTD; then
@@ -121,6 +121,19 @@ static inline unsigned int hash_superfast(const char *key, unsigned int len)
 	return hash;
 }
 
+uint32_t hash_fnv1a(const char *key, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
 /*
  * add or replace key in hash map.
  *
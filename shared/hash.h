@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct hash;
 
@@ -19,3 +21,9 @@ void *hash_find(const struct hash *hash, const char *key);
 unsigned int hash_get_count(const struct hash *hash);
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter);
 bool hash_iter_next(struct hash_iter *iter, const char **key, const void **value);
+
+/*
+ * 32-bit FNV-1a. Unlike the hash used internally by struct hash, its result
+ * doesn't depend on endianness, so it can be used for on-disk tables.
+ */
+uint32_t hash_fnv1a(const char *key, size_t len);
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 
 /*
@@ -34,6 +36,39 @@ static inline int finit_module(int fd, const char *uargs, int flags)
 }
 #endif
 
+#ifndef __NR_memfd_create
+#define __NR_memfd_create -1
+#endif
+
+#if !HAVE_MEMFD_CREATE
+#include <errno.h>
+
+static inline int memfd_create(const char *name, unsigned int flags)
+{
+	if (__NR_memfd_create == -1) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	return syscall(__NR_memfd_create, name, flags);
+}
+#endif
+
+/* UAPI values from linux/memfd.h and linux/fcntl.h, for older libc headers */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
 #if !HAVE_DECL_BASENAME
 #include <string.h>
 static inline const char *basename(const char *s)
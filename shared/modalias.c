@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "macro.h"
+#include "modalias.h"
+#include "util.h"
+
+struct modalias_field {
+	const char *tag;
+	unsigned int width; /* in hex digits */
+};
+
+/* format of the modaliases generated by the kernel, see file2alias.c */
+static const struct modalias_field pci_fields[] = {
+	{ "v", 8 }, { "d", 8 }, { "sv", 8 }, { "sd", 8 },
+	{ "bc", 2 }, { "sc", 2 }, { "i", 2 },
+};
+
+static const struct modalias_field usb_fields[] = {
+	{ "v", 4 },  { "p", 4 },   { "d", 4 },  { "dc", 2 }, { "dsc", 2 },
+	{ "dp", 2 }, { "ic", 2 },  { "isc", 2 }, { "ip", 2 }, { "in", 2 },
+};
+
+enum of_kind {
+	OF_COMPAT_LAST = 1, /* of:N*T*C<compat> */
+	OF_COMPAT_ANY = 2, /* of:N*T*C<compat>C* */
+};
+
+static const struct modalias_bus_desc {
+	const char *prefix;
+	const struct modalias_field *fields;
+	unsigned int field_count;
+	bool hashed;
+} buses[] = {
+	[MODALIAS_BUS_PCI] = { "pci:", pci_fields,
+			       sizeof(pci_fields) / sizeof(pci_fields[0]), false },
+	[MODALIAS_BUS_USB] = { "usb:", usb_fields,
+			       sizeof(usb_fields) / sizeof(usb_fields[0]), false },
+	/* acpi*:<id>:* -> hash of id */
+	[MODALIAS_BUS_ACPI] = { "acpi", NULL, 1, true },
+	/* of:N*T*C<compat>[C*] -> enum of_kind, hash of compat */
+	[MODALIAS_BUS_OF] = { "of:N", NULL, 2, true },
+};
+
+static inline int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Literal part of an id: no wildcards, escapes or separators */
+static inline bool is_literal(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (strchr("*?[\\:", s[i]) != NULL)
+			return false;
+	}
+
+	return len > 0;
+}
+
+/*
+ * Parse "[...]" of hex digits into the lowest and highest digit, as long as
+ * they are contiguous.
+ */
+static int compile_set(const char **p, unsigned int *first, unsigned int *last)
+{
+	const char *s = *p + 1;
+	unsigned int set = 0;
+	int a, b;
+
+	for (; *s != ']'; s++) {
+		a = hexval(*s);
+		if (a < 0)
+			return -EINVAL;
+
+		b = a;
+		if (s[1] == '-' && s[2] != ']') {
+			b = hexval(s[2]);
+			if (b < a)
+				return -EINVAL;
+			s += 2;
+		}
+
+		for (; a <= b; a++)
+			set |= 1U << a;
+	}
+
+	if (set == 0)
+		return -EINVAL;
+
+	*first = __builtin_ctz(set);
+	*last = 31 - __builtin_clz(set);
+
+	/* holes can't be expressed as a range */
+	if ((set >> *first) != (1U << (*last - *first + 1)) - 1)
+		return -EINVAL;
+
+	*p = s + 1;
+	return 0;
+}
+
+/*
+ * Compile one field of @width hex digits: fixed digits, optionally followed by
+ * a set for the next digit and/or a '*' covering the remaining ones.
+ *
+ * Returns 1 if the pattern ends with that '*', i.e. it matches any value of
+ * the remaining fields, 0 if there's more to parse, negative errno on error.
+ */
+static int compile_field(const char **p, unsigned int width, uint32_t *lo, uint32_t *hi)
+{
+	const char *s = *p;
+	uint32_t l = 0, h = 0;
+	unsigned int n = 0;
+	int v;
+
+	for (; n < width && (v = hexval(*s)) >= 0; n++, s++) {
+		l = l << 4 | v;
+		h = h << 4 | v;
+	}
+
+	if (n < width && *s == '[') {
+		unsigned int first, last;
+
+		if (compile_set(&s, &first, &last) < 0)
+			return -EINVAL;
+
+		l = l << 4 | first;
+		h = h << 4 | last;
+		n++;
+	}
+
+	if (*s == '*') {
+		s++;
+		for (; n < width; n++) {
+			l = l << 4;
+			h = h << 4 | 0xf;
+		}
+	}
+
+	if (n < width)
+		return -EINVAL;
+
+	*lo = l;
+	*hi = h;
+	*p = s;
+
+	return *s == '\0' && s[-1] == '*';
+}
+
+static int compile_fields(const struct modalias_bus_desc *desc, const char *p,
+			  uint32_t lo[], uint32_t hi[])
+{
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < desc->field_count; i++) {
+		const struct modalias_field *f = &desc->fields[i];
+		size_t taglen = strlen(f->tag);
+
+		if (strncmp(p, f->tag, taglen) != 0)
+			return -EINVAL;
+		p += taglen;
+
+		r = compile_field(&p, f->width, &lo[i], &hi[i]);
+		if (r < 0)
+			return r;
+		if (r > 0)
+			break;
+	}
+
+	/* a trailing '*' matches the remaining fields, if any */
+	for (i++; i < desc->field_count; i++) {
+		lo[i] = 0;
+		hi[i] = UINT32_MAX;
+	}
+
+	if (*p != '\0' && !(p[0] == '*' && p[1] == '\0'))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int compile_acpi(const char *p, uint32_t lo[], uint32_t hi[])
+{
+	size_t len;
+
+	if (strncmp(p, "*:", 2) != 0)
+		return -EINVAL;
+	p += 2;
+
+	len = strlen(p);
+	if (len < 3 || !streq(p + len - 2, ":*") || !is_literal(p, len - 2))
+		return -EINVAL;
+
+	lo[0] = hi[0] = hash_fnv1a(p, len - 2);
+
+	return 0;
+}
+
+static int compile_of(const char *p, uint32_t lo[], uint32_t hi[])
+{
+	size_t len;
+
+	if (strncmp(p, "*T*C", 4) != 0)
+		return -EINVAL;
+	p += 4;
+
+	len = strlen(p);
+	if (len > 2 && streq(p + len - 2, "C*")) {
+		len -= 2;
+		lo[0] = hi[0] = OF_COMPAT_ANY;
+	} else {
+		lo[0] = hi[0] = OF_COMPAT_LAST;
+	}
+
+	if (!is_literal(p, len))
+		return -EINVAL;
+
+	lo[1] = hi[1] = hash_fnv1a(p, len);
+
+	return 0;
+}
+
+int modalias_compile(const char *pattern, uint32_t lo[static MODALIAS_FIELDS_MAX],
+		     uint32_t hi[static MODALIAS_FIELDS_MAX])
+{
+	for (unsigned int bus = 1; bus < ARRAY_SIZE(buses); bus++) {
+		const struct modalias_bus_desc *desc = &buses[bus];
+		const char *p = pattern + strlen(desc->prefix);
+		int r;
+
+		if (!strstartswith(pattern, desc->prefix))
+			continue;
+
+		switch (bus) {
+		case MODALIAS_BUS_ACPI:
+			r = compile_acpi(p, lo, hi);
+			break;
+		case MODALIAS_BUS_OF:
+			r = compile_of(p, lo, hi);
+			break;
+		default:
+			r = compile_fields(desc, p, lo, hi);
+			break;
+		}
+
+		return r < 0 ? r : (int)bus;
+	}
+
+	return -EINVAL;
+}
+
+/* Only the canonical format generated by the kernel is accepted */
+static int parse_fields(const struct modalias_bus_desc *desc, const char *p,
+			struct modalias_record *record)
+{
+	for (unsigned int i = 0; i < desc->field_count; i++) {
+		const struct modalias_field *f = &desc->fields[i];
+		size_t taglen = strlen(f->tag);
+		uint32_t v = 0;
+
+		if (strncmp(p, f->tag, taglen) != 0)
+			return -EINVAL;
+		p += taglen;
+
+		for (unsigned int n = 0; n < f->width; n++, p++) {
+			int d = hexval(*p);
+
+			if (d < 0)
+				return -EINVAL;
+			v = v << 4 | d;
+		}
+
+		record->field[i] = v;
+	}
+
+	if (*p != '\0')
+		return -EINVAL;
+
+	return 1;
+}
+
+/* Every id between two consecutive ':' could be the one of acpi*:<id>:* */
+static int parse_acpi(const char *key, struct modalias_record *records,
+		      size_t n_records)
+{
+	const char *p = strchr(key + strlen("acpi"), ':');
+	size_t n = 0;
+
+	while (p != NULL) {
+		const char *next = strchr(p + 1, ':');
+
+		if (next == NULL)
+			break;
+
+		if (next > p + 1) {
+			if (n == n_records)
+				return -ENOSPC;
+			records[n++].field[0] = hash_fnv1a(p + 1, next - p - 1);
+		}
+
+		p = next;
+	}
+
+	return n;
+}
+
+/*
+ * of:N*T*C<compat> matches if any 'C' after the first 'T' is followed by
+ * <compat> until the end of the key; of:N*T*C<compat>C* if <compat> is between
+ * any two 'C' after the first 'T'.
+ */
+static int parse_of(const char *key, struct modalias_record *records, size_t n_records)
+{
+	const char *t = strchr(key + strlen("of:N"), 'T');
+	size_t n = 0;
+
+	if (t == NULL)
+		return 0;
+
+	for (const char *c = strchr(t + 1, 'C'); c != NULL; c = strchr(c + 1, 'C')) {
+		const char *end;
+
+		if (c[1] == '\0')
+			break;
+
+		if (n == n_records)
+			return -ENOSPC;
+		records[n].field[0] = OF_COMPAT_LAST;
+		records[n++].field[1] = hash_fnv1a(c + 1, strlen(c + 1));
+
+		for (end = strchr(c + 2, 'C'); end != NULL; end = strchr(end + 1, 'C')) {
+			if (n == n_records)
+				return -ENOSPC;
+			records[n].field[0] = OF_COMPAT_ANY;
+			records[n++].field[1] = hash_fnv1a(c + 1, end - c - 1);
+		}
+	}
+
+	return n;
+}
+
+int modalias_parse(enum modalias_bus bus, const char *key,
+		   struct modalias_record *records, size_t n_records)
+{
+	const struct modalias_bus_desc *desc;
+
+	if (modalias_field_count(bus) == 0)
+		return -EINVAL;
+
+	desc = &buses[bus];
+	if (!strstartswith(key, desc->prefix))
+		return 0;
+
+	if (n_records == 0)
+		return -ENOSPC;
+
+	switch (bus) {
+	case MODALIAS_BUS_ACPI:
+		return parse_acpi(key, records, n_records);
+	case MODALIAS_BUS_OF:
+		return parse_of(key, records, n_records);
+	default:
+		return parse_fields(desc, key + strlen(desc->prefix), records);
+	}
+}
+
+unsigned int modalias_field_count(uint32_t bus)
+{
+	if (bus < MODALIAS_BUS_PCI || bus > _MODALIAS_BUS_MAX)
+		return 0;
+
+	return buses[bus].field_count;
+}
+
+bool modalias_is_hashed(enum modalias_bus bus)
+{
+	return buses[bus].hashed;
+}
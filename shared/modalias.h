@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Modaliases of some buses are fixed-field records, e.g.
+ *
+ *   pci:v00008086d00001234sv*sd*bc02sc00i*
+ *
+ * Aliases of these buses are compiled by depmod into one integer range per
+ * field, so the lookup only needs to parse the incoming modalias once and
+ * compare integers instead of calling fnmatch() on each alias. For buses
+ * whose fields are free-form strings the field is a hash of the id and
+ * matches must be confirmed with fnmatch().
+ */
+enum modalias_bus {
+	MODALIAS_BUS_PCI = 1,
+	MODALIAS_BUS_USB = 2,
+	MODALIAS_BUS_ACPI = 3,
+	MODALIAS_BUS_OF = 4,
+	_MODALIAS_BUS_MAX = MODALIAS_BUS_OF,
+};
+
+#define MODALIAS_FIELDS_MAX 10
+#define MODALIAS_RECORDS_MAX 32
+
+struct modalias_record {
+	uint32_t field[MODALIAS_FIELDS_MAX];
+};
+
+/*
+ * Compile the alias @pattern into the ranges @lo and @hi of each field.
+ *
+ * Returns the bus on success, or -EINVAL if the alias doesn't belong to a known
+ * bus or can't be represented as field ranges.
+ */
+int modalias_compile(const char *pattern, uint32_t lo[static MODALIAS_FIELDS_MAX],
+		     uint32_t hi[static MODALIAS_FIELDS_MAX]);
+
+/*
+ * Parse the modalias @key into the @records that aliases of @bus are matched
+ * against: an alias matches if all its fields are in range for any record.
+ *
+ * Returns the number of records, 0 if no alias of @bus can match @key, or a
+ * negative errno if @key can't be parsed, in which case all aliases of @bus
+ * must be tried with fnmatch().
+ */
+int modalias_parse(enum modalias_bus bus, const char *key,
+		   struct modalias_record *records, size_t n_records);
+
+/* Number of fields of @bus, 0 if it's not a known bus */
+unsigned int modalias_field_count(uint32_t bus);
+
+/* Whether a match of @bus must be confirmed with fnmatch() */
+bool modalias_is_hashed(enum modalias_bus bus);
@@ -9,6 +9,7 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -611,16 +612,27 @@ static int dlsym_manyv(void *dl, va_list ap)
 
 int dlsym_many(void **dlp, const char *filename, ...)
 {
+	/* modules may be opened from several threads, e.g. by depmod */
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	va_list ap;
 	void *dl;
 	int r;
 
-	if (*dlp)
+	if (__atomic_load_n(dlp, __ATOMIC_ACQUIRE))
 		return 0;
 
+	pthread_mutex_lock(&lock);
+
+	if (*dlp) {
+		r = 0;
+		goto out;
+	}
+
 	dl = dlopen(filename, RTLD_LAZY);
-	if (!dl)
-		return -ENOENT;
+	if (!dl) {
+		r = -ENOENT;
+		goto out;
+	}
 
 	va_start(ap, filename);
 	r = dlsym_manyv(dl, ap);
@@ -628,10 +640,13 @@ int dlsym_many(void **dlp, const char *filename, ...)
 
 	if (r < 0) {
 		dlclose(dl);
-		return r;
+		goto out;
 	}
 
-	*dlp = dl;
+	__atomic_store_n(dlp, dl, __ATOMIC_RELEASE);
+	r = 1;
 
-	return 1;
+out:
+	pthread_mutex_unlock(&lock);
+	return r;
 }
@@ -190,6 +190,8 @@ static inline bool simple_umulsz_overflow(size_t a, size_t b, size_t *res)
  * @dlp: pointer to the previous results of this call: it's set when it succeeds
  * @filename: the library to dlopen() and look for symbols
  * @...: or 1 more tuples created by DLSYM_ARG() with ( &var, "symbol name" ).
+ *
+ * It's safe to call it from several threads with the same @dlp.
  */
 _sentinel_ int dlsym_many(void **dlp, const char *filename, ...);
 
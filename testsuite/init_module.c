@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 
+#include <shared/missing.h>
 #include <shared/util.h>
 
 /* kmod_elf_get_section() is not exported, we need the private header */
@@ -213,7 +214,22 @@ static uint8_t elf_identify(void *mem)
 	return p[EI_CLASS];
 }
 
-TS_EXPORT long init_module(void *mem, unsigned long len, const char *args);
+/*
+ * With TESTSUITE_INIT_MODULE_LOG set, print each call to stdout, for the tests
+ * checking how the modules are given to the kernel
+ */
+_printf_format_(1, 2) static void log_call(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (getenv("TESTSUITE_INIT_MODULE_LOG") == NULL)
+		return;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fflush(stdout);
+}
 
 /*
  * Default behavior is to try to mimic init_module behavior inside the kernel.
@@ -224,8 +240,7 @@ TS_EXPORT long init_module(void *mem, unsigned long len, const char *args);
  * This is because we want to be able to pass dummy modules (and not real
  * ones) and it still work.
  */
-/* TODO: add simple validation of the args passed and remove the _maybe_unused_ workaround */
-long init_module(void *mem, unsigned long len, _maybe_unused_ const char *args)
+static long load_module(void *mem, unsigned long len)
 {
 	const char *modname;
 	struct kmod_elf *elf;
@@ -281,6 +296,16 @@ long init_module(void *mem, unsigned long len, _maybe_unused_ const char *args)
 	return err;
 }
 
+TS_EXPORT long init_module(void *mem, unsigned long len, const char *args);
+
+/* TODO: add simple validation of the args passed and remove the _maybe_unused_ workaround */
+long init_module(void *mem, unsigned long len, _maybe_unused_ const char *args)
+{
+	log_call("init_module()\n");
+
+	return load_module(mem, len);
+}
+
 static int check_kernel_version(int major, int minor)
 {
 	struct utsname u;
@@ -302,13 +327,18 @@ static int check_kernel_version(int major, int minor)
 TS_EXPORT int finit_module(const int fd, const char *args, const int flags);
 
 /* TODO: add simple validation of the flags passed and remove the _maybe_unused_ workaround */
-int finit_module(const int fd, const char *args, _maybe_unused_ const int flags)
+int finit_module(const int fd, _maybe_unused_ const char *args,
+		 _maybe_unused_ const int flags)
 {
-	int err;
+	int err, seals;
 	void *mem;
 	unsigned long len;
 	struct stat st;
 
+	seals = fcntl(fd, F_GET_SEALS);
+	log_call("finit_module(%s)\n", seals < 0 ? "file" :
+			(seals & F_SEAL_WRITE) ? "sealed memfd" : "writable memfd");
+
 	if (!check_kernel_version(3, 8)) {
 		errno = ENOSYS;
 		return -1;
@@ -321,7 +351,7 @@ int finit_module(const int fd, const char *args, _maybe_unused_ const int flags)
 	if (mem == MAP_FAILED)
 		return -1;
 
-	err = init_module(mem, len, args);
+	err = load_module(mem, len);
 	munmap(mem, len);
 
 	return err;
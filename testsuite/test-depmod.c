@@ -3,13 +3,18 @@
  * Copyright (C) 2012-2013  ProFUSION embedded systems
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "testsuite.h"
 
@@ -241,4 +246,463 @@ DEFINE_TEST(depmod_check_weakdep,
 		},
 	});
 
+/*
+ * A full run, so --update and -A have the files of a previous run to start
+ * from, or a run with -A if @maybe_all
+ */
+static int depmod_run(bool maybe_all)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	assert_return(pid >= 0, EXIT_FAILURE);
+	if (pid == 0)
+		_exit(maybe_all ? EXEC_TOOL(depmod, "-A") : EXEC_TOOL(depmod));
+
+	assert_return(waitpid(pid, &status, 0) == pid, EXIT_FAILURE);
+	assert_return(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS,
+		      EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+
+#define UPDATE_ADD_ROOTFS TESTSUITE_ROOTFS "test-depmod/update-add"
+#define UPDATE_ADD_LIB_MODULES UPDATE_ADD_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+static int depmod_update_add(void)
+{
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+
+	/* mod-simple is installed too but not given, so it isn't searched for */
+	assert_return(rename(UPDATE_ADD_ROOTFS "/staging/mod-foo.ko",
+			     UPDATE_ADD_LIB_MODULES "/kernel/mod-foo.ko") == 0,
+		      EXIT_FAILURE);
+	assert_return(rename(UPDATE_ADD_ROOTFS "/staging/mod-simple.ko",
+			     UPDATE_ADD_LIB_MODULES "/kernel/mod-simple.ko") == 0,
+		      EXIT_FAILURE);
+
+	return EXEC_TOOL(depmod, "--update", MODULES_UNAME,
+			 MODULE_DIRECTORY "/" MODULES_UNAME "/kernel/mod-foo.ko");
+}
+DEFINE_TEST(depmod_update_add,
+	.description = "check if depmod --update adds the given module to the previous run",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = UPDATE_ADD_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ UPDATE_ADD_LIB_MODULES "/correct-modules.dep",
+			  UPDATE_ADD_LIB_MODULES "/modules.dep" },
+			{ },
+		},
+	});
+
+#define UPDATE_REPLACE_ROOTFS TESTSUITE_ROOTFS "test-depmod/update-replace"
+#define UPDATE_REPLACE_LIB_MODULES \
+	UPDATE_REPLACE_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+static int depmod_update_replace(void)
+{
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+
+	/* updates/ comes first in the default search order */
+	assert_return(mkdir(UPDATE_REPLACE_LIB_MODULES "/updates", 0755) == 0,
+		      EXIT_FAILURE);
+	assert_return(rename(UPDATE_REPLACE_ROOTFS "/staging/mod-simple.ko",
+			     UPDATE_REPLACE_LIB_MODULES "/updates/mod-simple.ko") == 0,
+		      EXIT_FAILURE);
+
+	return EXEC_TOOL(depmod, "--update", MODULES_UNAME,
+			 MODULE_DIRECTORY "/" MODULES_UNAME "/updates/mod-simple.ko");
+}
+DEFINE_TEST(depmod_update_replace,
+	.description = "check if depmod --update replaces a module with a higher priority one",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = UPDATE_REPLACE_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ UPDATE_REPLACE_LIB_MODULES "/correct-modules.dep",
+			  UPDATE_REPLACE_LIB_MODULES "/modules.dep" },
+			{ },
+		},
+	});
+
+#define UPDATE_REMOVE_ROOTFS TESTSUITE_ROOTFS "test-depmod/update-remove"
+#define UPDATE_REMOVE_LIB_MODULES UPDATE_REMOVE_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+static int depmod_update_remove(void)
+{
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+
+	/*
+	 * Removing updates/mod-simple uncovers kernel/mod-simple, so all
+	 * modules are searched again: mod-foo-a is found although not given
+	 */
+	assert_return(unlink(UPDATE_REMOVE_LIB_MODULES "/updates/mod-simple.ko") == 0,
+		      EXIT_FAILURE);
+	assert_return(rename(UPDATE_REMOVE_ROOTFS "/staging/mod-foo-a.ko",
+			     UPDATE_REMOVE_LIB_MODULES "/kernel/mod-foo-a.ko") == 0,
+		      EXIT_FAILURE);
+
+	return EXEC_TOOL(depmod, "--update", MODULES_UNAME,
+			 MODULE_DIRECTORY "/" MODULES_UNAME "/updates/mod-simple.ko");
+}
+DEFINE_TEST(depmod_update_remove,
+	.description = "check if depmod --update searches all modules again after a removal",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = UPDATE_REMOVE_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ UPDATE_REMOVE_LIB_MODULES "/correct-modules.dep",
+			  UPDATE_REMOVE_LIB_MODULES "/modules.dep" },
+			{ },
+		},
+	});
+
+#define UPDATE_OUTSIDE_ROOTFS TESTSUITE_ROOTFS "test-depmod/update-outside"
+static int depmod_update_outside(void)
+{
+	return EXEC_TOOL(depmod, "--update", MODULES_UNAME, "/bin/bash");
+}
+DEFINE_TEST(depmod_update_outside,
+	.description = "check if depmod --update rejects paths out of the module directory",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = UPDATE_OUTSIDE_ROOTFS,
+	},
+	.expected_fail = true,
+	.output = {
+		.err = UPDATE_OUTSIDE_ROOTFS "/correct.txt",
+	});
+
+#define MAYBE_ALL_ROOTFS TESTSUITE_ROOTFS "test-depmod/maybe-all"
+#define MAYBE_ALL_LIB_MODULES MAYBE_ALL_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+#define TREE_FILENAME "modules.depmod-tree.bin"
+
+static ino_t file_ino(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+/*
+ * Run depmod -A and tell whether it generated the files again: the snapshot of
+ * the module directory is then written again, even if modules.dep isn't
+ */
+static int depmod_maybe_all_run(const char *lib_modules, bool *regenerated)
+{
+	char path[PATH_MAX];
+	ino_t ino;
+
+	snprintf(path, sizeof(path), "%s/" TREE_FILENAME, lib_modules);
+	ino = file_ino(path);
+
+	assert_return(depmod_run(true) == EXIT_SUCCESS, EXIT_FAILURE);
+
+	*regenerated = file_ino(path) != ino;
+	return EXIT_SUCCESS;
+}
+
+static int depmod_maybe_all(void)
+{
+	ino_t dep_ino;
+	bool regenerated;
+
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+	dep_ino = file_ino(MAYBE_ALL_LIB_MODULES "/modules.dep");
+	assert_return(file_ino(MAYBE_ALL_LIB_MODULES "/" TREE_FILENAME) != 0, EXIT_FAILURE);
+
+	/* nothing changed since the full run */
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(!regenerated, EXIT_FAILURE);
+	assert_return(file_ino(MAYBE_ALL_LIB_MODULES "/modules.dep") == dep_ino,
+		      EXIT_FAILURE);
+
+	/* a module is added */
+	assert_return(rename(MAYBE_ALL_ROOTFS "/staging/mod-simple.ko",
+			     MAYBE_ALL_LIB_MODULES "/kernel/mod-simple.ko") == 0,
+		      EXIT_FAILURE);
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(regenerated, EXIT_FAILURE);
+
+	/* a module is removed */
+	assert_return(unlink(MAYBE_ALL_LIB_MODULES "/kernel/mod-foo.ko") == 0,
+		      EXIT_FAILURE);
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(regenerated, EXIT_FAILURE);
+
+	/* a module is touched */
+	assert_return(utimensat(AT_FDCWD, MAYBE_ALL_LIB_MODULES "/kernel/mod-foo-a.ko",
+				NULL, 0) == 0,
+		      EXIT_FAILURE);
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(regenerated, EXIT_FAILURE);
+
+	/* a directory is added, with nothing in it yet */
+	assert_return(mkdir(MAYBE_ALL_LIB_MODULES "/kernel/new", 0755) == 0, EXIT_FAILURE);
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(regenerated, EXIT_FAILURE);
+
+	/* and nothing changed since then */
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(!regenerated, EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(depmod_maybe_all,
+	.description = "check if depmod -A runs only after the modules changed",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = MAYBE_ALL_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ MAYBE_ALL_LIB_MODULES "/correct-modules.dep",
+			  MAYBE_ALL_LIB_MODULES "/modules.dep" },
+			{ },
+		},
+	});
+
+#define MAYBE_ALL_CONFIG_ROOTFS TESTSUITE_ROOTFS "test-depmod/maybe-all-config"
+#define MAYBE_ALL_CONFIG_LIB_MODULES \
+	MAYBE_ALL_CONFIG_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+static int depmod_maybe_all_config(void)
+{
+	bool regenerated;
+	FILE *fp;
+
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+
+	fp = fopen(MAYBE_ALL_CONFIG_ROOTFS "/etc/depmod.d/search.conf", "we");
+	assert_return(fp != NULL, EXIT_FAILURE);
+	fputs("search updates built-in\n", fp);
+	assert_return(fclose(fp) == 0, EXIT_FAILURE);
+
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_CONFIG_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(regenerated, EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(depmod_maybe_all_config,
+	.description = "check if depmod -A runs after the configuration changed",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = MAYBE_ALL_CONFIG_ROOTFS,
+	});
+
+#define MAYBE_ALL_CORRUPT_ROOTFS TESTSUITE_ROOTFS "test-depmod/maybe-all-corrupt"
+#define MAYBE_ALL_CORRUPT_LIB_MODULES \
+	MAYBE_ALL_CORRUPT_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+#define MAYBE_ALL_CORRUPT_TREE MAYBE_ALL_CORRUPT_LIB_MODULES "/" TREE_FILENAME
+
+/*
+ * Without a usable snapshot, depmod -A goes back to comparing the mtime of the
+ * modules with the one of modules.dep, and writes a new snapshot if it runs
+ */
+static int depmod_maybe_all_corrupt_check(void)
+{
+	bool regenerated;
+
+	assert_return(utimensat(AT_FDCWD, MAYBE_ALL_CORRUPT_LIB_MODULES "/kernel/mod-simple.ko",
+				NULL, 0) == 0,
+		      EXIT_FAILURE);
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_CORRUPT_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(regenerated, EXIT_FAILURE);
+
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_CORRUPT_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(!regenerated, EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+
+static int depmod_maybe_all_corrupt(void)
+{
+	char buf[4096];
+	bool regenerated;
+	struct stat st;
+	int fd;
+
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+
+	/* truncated in the middle of its entries, with no module newer than modules.dep */
+	assert_return(stat(MAYBE_ALL_CORRUPT_TREE, &st) == 0, EXIT_FAILURE);
+	assert_return(truncate(MAYBE_ALL_CORRUPT_TREE, st.st_size / 2) == 0, EXIT_FAILURE);
+	assert_return(depmod_maybe_all_run(MAYBE_ALL_CORRUPT_LIB_MODULES, &regenerated) ==
+			      EXIT_SUCCESS,
+		      EXIT_FAILURE);
+	assert_return(!regenerated, EXIT_FAILURE);
+	assert_return(depmod_maybe_all_corrupt_check() == EXIT_SUCCESS, EXIT_FAILURE);
+
+	/* overwritten with garbage */
+	assert_return(stat(MAYBE_ALL_CORRUPT_TREE, &st) == 0, EXIT_FAILURE);
+	assert_return((size_t)st.st_size <= sizeof(buf), EXIT_FAILURE);
+	memset(buf, 0xff, sizeof(buf));
+	fd = open(MAYBE_ALL_CORRUPT_TREE, O_WRONLY | O_CLOEXEC);
+	assert_return(fd >= 0, EXIT_FAILURE);
+	assert_return(write(fd, buf, st.st_size) == st.st_size, EXIT_FAILURE);
+	close(fd);
+	assert_return(depmod_maybe_all_corrupt_check() == EXIT_SUCCESS, EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(depmod_maybe_all_corrupt,
+	.description = "check if depmod -A falls back on a truncated or corrupted snapshot",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = MAYBE_ALL_CORRUPT_ROOTFS,
+	});
+
+#define UNCHANGED_ROOTFS TESTSUITE_ROOTFS "test-depmod/unchanged-outputs"
+#define UNCHANGED_LIB_MODULES UNCHANGED_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+static int depmod_unchanged_outputs(void)
+{
+	struct {
+		const char *name;
+		bool replaced; /* once mod-foo has no more dependencies */
+		struct stat st; /* after the first run */
+	} outputs[] = {
+		{ .name = "modules.dep", .replaced = true },
+		{ .name = "modules.dep.bin", .replaced = true },
+		{ .name = "modules.alias", .replaced = false },
+		{ .name = "modules.alias.bin", .replaced = false },
+		{ .name = "modules.softdep", .replaced = false },
+		{ .name = "modules.weakdep", .replaced = false },
+		{ .name = "modules.symbols", .replaced = false },
+		{ .name = "modules.symbols.bin", .replaced = false },
+		{ .name = "modules.builtin.bin", .replaced = false },
+		{ .name = "modules.builtin.alias.bin", .replaced = false },
+		{ .name = "modules.devname", .replaced = false },
+		{ .name = "modules.depmod-cache.bin", .replaced = true },
+		{ .name = TREE_FILENAME, .replaced = true },
+	};
+	char path[PATH_MAX];
+	struct stat st;
+
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+	for (size_t i = 0; i < ARRAY_SIZE(outputs); i++) {
+		snprintf(path, sizeof(path), UNCHANGED_LIB_MODULES "/%s", outputs[i].name);
+		assert_return(stat(path, &outputs[i].st) == 0, EXIT_FAILURE);
+	}
+
+	/* nothing changed: no output is written again */
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+	for (size_t i = 0; i < ARRAY_SIZE(outputs); i++) {
+		snprintf(path, sizeof(path), UNCHANGED_LIB_MODULES "/%s", outputs[i].name);
+		assert_return(stat(path, &st) == 0, EXIT_FAILURE);
+		if (st.st_ino != outputs[i].st.st_ino ||
+		    st.st_mtim.tv_sec != outputs[i].st.st_mtim.tv_sec ||
+		    st.st_mtim.tv_nsec != outputs[i].st.st_mtim.tv_nsec) {
+			ERR("%s was written again\n", outputs[i].name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* only the outputs about the dependencies change */
+	assert_return(rename(UNCHANGED_ROOTFS "/staging/mod-foo.ko",
+			     UNCHANGED_LIB_MODULES "/kernel/mod-foo.ko") == 0,
+		      EXIT_FAILURE);
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+	for (size_t i = 0; i < ARRAY_SIZE(outputs); i++) {
+		snprintf(path, sizeof(path), UNCHANGED_LIB_MODULES "/%s", outputs[i].name);
+		assert_return(stat(path, &st) == 0, EXIT_FAILURE);
+		if ((st.st_ino != outputs[i].st.st_ino) != outputs[i].replaced) {
+			ERR("%s was %sreplaced\n", outputs[i].name,
+			    outputs[i].replaced ? "not " : "");
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(depmod_unchanged_outputs,
+	.description = "check if depmod only replaces the outputs that changed",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = UNCHANGED_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ UNCHANGED_LIB_MODULES "/correct-modules.dep",
+			  UNCHANGED_LIB_MODULES "/modules.dep" },
+			{ },
+		},
+	});
+
+#define MANY_MODULES_ROOTFS TESTSUITE_ROOTFS "test-depmod/many-modules"
+#define MANY_MODULES_LIB_MODULES MANY_MODULES_ROOTFS MODULE_DIRECTORY "/" MODULES_UNAME
+/* more than can be indexed with 16 bits */
+#define MANY_MODULES_COUNT 70000
+static int depmod_many_modules(void)
+{
+	char src[PATH_MAX], dst[PATH_MAX], line[PATH_MAX];
+	size_t n_lines = 0;
+	FILE *fp;
+
+	/*
+	 * Copies of mod-foo, linked to the two installed ones so none of them
+	 * reaches the hard link limit
+	 */
+	for (int i = 2; i < MANY_MODULES_COUNT; i++) {
+		snprintf(src, sizeof(src), MANY_MODULES_LIB_MODULES "/kernel/many/mod-many-%d.ko",
+			 i % 2);
+		snprintf(dst, sizeof(dst), MANY_MODULES_LIB_MODULES "/kernel/many/mod-many-%d.ko",
+			 i);
+		assert_return(link(src, dst) == 0 || errno == EEXIST, EXIT_FAILURE);
+	}
+
+	assert_return(depmod_run(false) == EXIT_SUCCESS, EXIT_FAILURE);
+
+	fp = fopen(MANY_MODULES_LIB_MODULES "/modules.dep", "re");
+	assert_return(fp != NULL, EXIT_FAILURE);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		n_lines++;
+		if (strncmp(line, "kernel/many/", strlen("kernel/many/")) != 0)
+			continue;
+
+		if (strstr(line, " kernel/mod-foo-a.ko") == NULL ||
+		    strstr(line, " kernel/mod-foo-b.ko") == NULL ||
+		    strstr(line, " kernel/mod-foo-c.ko") == NULL) {
+			ERR("missing dependencies: %s", line);
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+	}
+	fclose(fp);
+
+	/* plus mod-foo-a, mod-foo-b and mod-foo-c */
+	assert_return(n_lines == MANY_MODULES_COUNT + 3, EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(depmod_many_modules,
+	.description = "check if depmod handles more than 65535 modules",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = MANY_MODULES_ROOTFS,
+	},
+	.timeout = 20);
+
 TESTSUITE_MAIN();
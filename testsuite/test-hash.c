@@ -284,4 +284,16 @@ static int test_hash_massive_add_del(void)
 DEFINE_TEST(test_hash_massive_add_del,
 	    .description = "test multiple adds followed by multiple dels");
 
+static int test_hash_fnv1a(void)
+{
+	/* reference values: the hash is used by on-disk indexes */
+	assert_return(hash_fnv1a("", 0) == 0x811c9dc5, EXIT_FAILURE);
+	assert_return(hash_fnv1a("a", 1) == 0xe40c292c, EXIT_FAILURE);
+	assert_return(hash_fnv1a("foobar", 6) == 0xbf9cf968, EXIT_FAILURE);
+	assert_return(hash_fnv1a("foobarbaz", 6) == 0xbf9cf968, EXIT_FAILURE);
+
+	return 0;
+}
+DEFINE_TEST(test_hash_fnv1a, .description = "test hash_fnv1a known values");
+
 TESTSUITE_MAIN();
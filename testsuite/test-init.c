@@ -14,7 +14,10 @@
 #include <shared/macro.h>
 
 #include <libkmod/libkmod.h>
+#include <libkmod/libkmod-internal.h>
 
+/* FIXME: hack, change name so we don't clash */
+#undef ERR
 #include "testsuite.h"
 
 static int test_load_resources(void)
@@ -58,6 +61,217 @@ DEFINE_TEST_WITH_FUNC(
 		[TC_UNAME_R] = "5.6.0",
 	});
 
+static int lookup_builtin(struct kmod_ctx *ctx)
+{
+	struct kmod_list *list = NULL;
+	struct kmod_module *mod;
+	int err;
+
+	err = kmod_module_new_from_lookup(ctx, "fake_builtin", &list);
+	if (err < 0 || list == NULL) {
+		ERR("could not look up fake_builtin\n");
+		return -ENOENT;
+	}
+
+	mod = kmod_module_get_module(list);
+	if (kmod_module_get_initstate(mod) != KMOD_MODULE_BUILTIN) {
+		ERR("fake_builtin not found as builtin\n");
+		err = -EINVAL;
+	}
+
+	kmod_module_unref(mod);
+	kmod_module_unref_list(list);
+	return err;
+}
+
+static int test_load_resources_index_access(void)
+{
+	static const unsigned int flags[] = {
+		KMOD_INDEX_ACCESS_POPULATE,
+		KMOD_INDEX_ACCESS_RANDOM,
+		KMOD_INDEX_ACCESS_HUGEPAGE,
+		KMOD_INDEX_ACCESS_POPULATE | KMOD_INDEX_ACCESS_RANDOM |
+			KMOD_INDEX_ACCESS_HUGEPAGE,
+	};
+	const char *null_config = NULL;
+
+	for (size_t i = 0; i < ARRAY_SIZE(flags); i++) {
+		struct kmod_ctx *ctx;
+		int err;
+
+		ctx = kmod_new(NULL, &null_config);
+		if (ctx == NULL)
+			return EXIT_FAILURE;
+
+		kmod_set_log_priority(ctx, 7);
+
+		if (kmod_get_index_access(ctx) != 0) {
+			ERR("index access hints set by default\n");
+			return EXIT_FAILURE;
+		}
+
+		kmod_set_index_access(ctx, flags[i]);
+		if (kmod_get_index_access(ctx) != flags[i]) {
+			ERR("index access hints not set\n");
+			return EXIT_FAILURE;
+		}
+
+		err = kmod_load_resources(ctx);
+		if (err != 0) {
+			ERR("could not load libkmod resources with hints %#x: %s\n",
+			    flags[i], strerror(-err));
+			return EXIT_FAILURE;
+		}
+
+		if (lookup_builtin(ctx) < 0)
+			return EXIT_FAILURE;
+
+		kmod_unref(ctx);
+	}
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_load_resources_index_access,
+	    .description = "test if kmod_load_resources and lookups work with index access hints",
+	    .config = {
+		    [TC_ROOTFS] = TESTSUITE_ROOTFS "test-init-load-resources/",
+		    [TC_UNAME_R] = "5.6.0",
+	    });
+
+static int test_index_access_env(void)
+{
+	struct kmod_ctx *ctx;
+	const char *null_config = NULL;
+	unsigned int flags = KMOD_INDEX_ACCESS_POPULATE | KMOD_INDEX_ACCESS_RANDOM |
+			     KMOD_INDEX_ACCESS_HUGEPAGE;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+
+	if (kmod_get_index_access(ctx) != flags) {
+		ERR("KMOD_INDEX_ACCESS parsed as %#x, expected %#x\n",
+		    kmod_get_index_access(ctx), flags);
+		return EXIT_FAILURE;
+	}
+
+	if (kmod_load_resources(ctx) != 0 || lookup_builtin(ctx) < 0)
+		return EXIT_FAILURE;
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_index_access_env,
+	    .description = "test if KMOD_INDEX_ACCESS is parsed into index access hints",
+	    .config = {
+		    [TC_ROOTFS] = TESTSUITE_ROOTFS "test-init-load-resources/",
+		    [TC_UNAME_R] = "5.6.0",
+	    },
+	    .env_vars = (const struct keyval[]) {
+		    { "KMOD_INDEX_ACCESS", "populate,random,hugepage" },
+		    { },
+	    });
+
+#if ENABLE_XZ
+static int decompress_cmp(struct kmod_ctx *ctx, const void *contents, off_t size)
+{
+	struct kmod_file *file;
+	const void *xz_contents;
+	off_t xz_size;
+	int err;
+
+	err = kmod_file_open(ctx, "/mod-simple-blocks.ko.xz", &file);
+	if (err < 0) {
+		ERR("could not open xz module: %s\n", strerror(-err));
+		return err;
+	}
+
+	err = kmod_file_get_contents(file, &xz_contents, &xz_size);
+	if (err < 0) {
+		ERR("could not decompress xz module: %s\n", strerror(-err));
+	} else if (xz_size != size || memcmp(xz_contents, contents, size) != 0) {
+		ERR("xz module decompressed with %u threads differs\n",
+		    kmod_get_decompress_threads(ctx));
+		err = -EINVAL;
+	}
+
+	kmod_file_unref(file);
+	return err;
+}
+
+static int test_decompress_threads(void)
+{
+	static const unsigned int threads[] = { 4, 4, 1, 4 };
+	struct kmod_ctx *ctx;
+	struct kmod_file *file;
+	const char *null_config = NULL;
+	const void *contents;
+	off_t size;
+	int err;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+
+	err = kmod_file_open(ctx, "/mod-simple.ko", &file);
+	if (err < 0)
+		return EXIT_FAILURE;
+
+	err = kmod_file_get_contents(file, &contents, &size);
+	if (err < 0)
+		return EXIT_FAILURE;
+
+	/* decoders and buffers are reused in between, whatever the threads */
+	for (size_t i = 0; i < ARRAY_SIZE(threads); i++) {
+		kmod_set_decompress_threads(ctx, threads[i]);
+		if (decompress_cmp(ctx, contents, size) < 0)
+			return EXIT_FAILURE;
+	}
+
+	kmod_file_unref(file);
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_decompress_threads,
+	    .description = "test if xz modules decompress the same with several threads",
+	    .config = {
+		    [TC_ROOTFS] = TESTSUITE_ROOTFS "test-init-decompress/",
+	    });
+#endif
+
+static int test_probe_ahead(void)
+{
+	struct kmod_ctx *ctx;
+	const char *null_config = NULL;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+
+	if (kmod_get_probe_ahead(ctx) != 0) {
+		ERR("probe ahead enabled by default\n");
+		return EXIT_FAILURE;
+	}
+
+	kmod_set_probe_ahead(ctx, 4);
+	if (kmod_get_probe_ahead(ctx) != 4) {
+		ERR("probe ahead not set\n");
+		return EXIT_FAILURE;
+	}
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_probe_ahead,
+	    .description = "test if the number of modules to probe ahead can be set",
+	    .config = {
+		    [TC_ROOTFS] = TESTSUITE_ROOTFS "test-init-load-resources/",
+		    [TC_UNAME_R] = "5.6.0",
+	    });
+
 static int test_initlib(void)
 {
 	struct kmod_ctx *ctx;
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <shared/macro.h>
+#include <shared/modalias.h>
+
+#include "testsuite.h"
+
+/* Match @key against the compiled @pattern the same way the index does */
+static bool compiled_match(int bus, const uint32_t lo[], const uint32_t hi[],
+			   const char *pattern, const char *key)
+{
+	struct modalias_record records[MODALIAS_RECORDS_MAX];
+	unsigned int n_fields = modalias_field_count(bus);
+	int n;
+
+	n = modalias_parse(bus, key, records, ARRAY_SIZE(records));
+	if (n < 0)
+		return fnmatch(pattern, key, 0) == 0;
+
+	for (int r = 0; r < n; r++) {
+		bool match = true;
+
+		for (unsigned int f = 0; f < n_fields; f++) {
+			if (records[r].field[f] < lo[f] || records[r].field[f] > hi[f])
+				match = false;
+		}
+
+		if (match)
+			return true;
+	}
+
+	return false;
+}
+
+static int test_modalias_compile(void)
+{
+	uint32_t lo[MODALIAS_FIELDS_MAX], hi[MODALIAS_FIELDS_MAX];
+
+	assert_return(modalias_compile("pci:v00008086d00001234sv*sd*bc02sc00i*", lo, hi) ==
+			      MODALIAS_BUS_PCI,
+		      EXIT_FAILURE);
+	assert_return(lo[0] == 0x8086 && hi[0] == 0x8086, EXIT_FAILURE);
+	assert_return(lo[1] == 0x1234 && hi[1] == 0x1234, EXIT_FAILURE);
+	assert_return(lo[2] == 0 && hi[2] == 0xffffffff, EXIT_FAILURE);
+	assert_return(lo[4] == 0x02 && hi[4] == 0x02, EXIT_FAILURE);
+	assert_return(lo[6] == 0 && hi[6] == 0xff, EXIT_FAILURE);
+
+	assert_return(modalias_compile("usb:v1234p5678d01[3-9A-C]*dc*dsc*dp*ic*isc*ip*in*",
+				       lo, hi) == MODALIAS_BUS_USB,
+		      EXIT_FAILURE);
+	assert_return(lo[2] == 0x0130 && hi[2] == 0x01cf, EXIT_FAILURE);
+
+	/* a trailing '*' covers all the remaining fields */
+	assert_return(modalias_compile("pci:v00008086d*", lo, hi) == MODALIAS_BUS_PCI,
+		      EXIT_FAILURE);
+	assert_return(lo[6] == 0 && hi[6] == UINT32_MAX, EXIT_FAILURE);
+
+	assert_return(modalias_compile("acpi*:PNP0C0A:*", lo, hi) == MODALIAS_BUS_ACPI,
+		      EXIT_FAILURE);
+	assert_return(modalias_compile("of:N*T*Cvendor,devC*", lo, hi) == MODALIAS_BUS_OF,
+		      EXIT_FAILURE);
+
+	/* left to fnmatch() */
+	assert_return(modalias_compile("pci:v00008086d0000123?sv*sd*bc*sc*i*", lo, hi) ==
+			      -EINVAL,
+		      EXIT_FAILURE);
+	assert_return(modalias_compile("pci:v00008086d0000abcdsv*sd*bc*sc*i*", lo, hi) ==
+			      -EINVAL,
+		      EXIT_FAILURE);
+	assert_return(modalias_compile("pci:v00008086", lo, hi) == -EINVAL, EXIT_FAILURE);
+	assert_return(modalias_compile("usb:v1234p5678d0[13]*dc*dsc*dp*ic*isc*ip*in*", lo,
+				       hi) == -EINVAL,
+		      EXIT_FAILURE);
+	assert_return(modalias_compile("acpi*:0106??:*", lo, hi) == -EINVAL, EXIT_FAILURE);
+	assert_return(modalias_compile("of:NfooT*", lo, hi) == -EINVAL, EXIT_FAILURE);
+	assert_return(modalias_compile("platform:foo", lo, hi) == -EINVAL, EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_modalias_compile, .description = "test modalias_compile");
+
+static int test_modalias_match(void)
+{
+	static const struct {
+		const char *pattern;
+		const char *key;
+	} tests[] = {
+		// clang-format off
+		{ "pci:v00008086d00001234sv*sd*bc02sc00i*",
+		  "pci:v00008086d00001234sv00001028sd000004B2bc02sc00i00" },
+		{ "pci:v00008086d00001234sv*sd*bc02sc00i*",
+		  "pci:v00008086d00001234sv00001028sd000004B2bc02sc80i00" },
+		{ "pci:v00008086d*",
+		  "pci:v00008086d00001234sv00001028sd000004B2bc02sc80i00" },
+		{ "pci:v00008086d*",
+		  "pci:v00001022d00001234sv00001028sd000004B2bc02sc80i00" },
+		{ "pci:v00008086d00001234sv*sd*bc02sc00i*",
+		  "pci:v00008086d00001234sv00001028sd000004b2bc02sc00i00" },
+		{ "usb:v1234p5678d01[3-9A-C]*dc*dsc*dp*ic*isc*ip*in*",
+		  "usb:v1234p5678d0145dcEFdsc02dp01ic03isc01ip01in00" },
+		{ "usb:v1234p5678d01[3-9A-C]*dc*dsc*dp*ic*isc*ip*in*",
+		  "usb:v1234p5678d01D0dcEFdsc02dp01ic03isc01ip01in00" },
+		{ "acpi*:PNP0C0A:*", "acpi:PNP0C0A:" },
+		{ "acpi*:PNP0C0A:*", "acpi:ACPI0003:PNP0C0A:" },
+		{ "acpi*:PNP0C0A:*", "acpi:PNP0C0A0:" },
+		{ "of:N*T*Cvendor,dev", "of:NfooT<NULL>Cvendor,dev" },
+		{ "of:N*T*Cvendor,dev", "of:NfooT<NULL>Cvendor,devCgeneric" },
+		{ "of:N*T*Cvendor,devC*", "of:NfooT<NULL>Cvendor,devCgeneric" },
+		{ "of:N*T*Cvendor,devC*", "of:NfooT<NULL>Cvendor,dev" },
+		{ "of:N*T*CacmeCC,dev", "of:NTTTTyCzzCacmeCC,dev" },
+		// clang-format on
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(tests); i++) {
+		uint32_t lo[MODALIAS_FIELDS_MAX], hi[MODALIAS_FIELDS_MAX];
+		bool expected = fnmatch(tests[i].pattern, tests[i].key, 0) == 0;
+		int bus;
+
+		bus = modalias_compile(tests[i].pattern, lo, hi);
+		assert_return(bus > 0, EXIT_FAILURE);
+		assert_return(compiled_match(bus, lo, hi, tests[i].pattern, tests[i].key) ==
+				      expected,
+			      EXIT_FAILURE);
+	}
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_modalias_match,
+	    .description = "test compiled modaliases match the same keys as fnmatch");
+
+TESTSUITE_MAIN();
@@ -4,13 +4,17 @@
  */
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 
+#include <libkmod/libkmod.h>
+
 #include "testsuite.h"
 
 static int modprobe_show_depends(void)
@@ -410,4 +414,129 @@ DEFINE_TEST(modprobe_module_from_relpath,
 	.modules_loaded = "mod-simple",
 	);
 
+#if ENABLE_XZ
+static int modprobe_compressed_memfd(void)
+{
+	return EXEC_TOOL(modprobe, "mod-simple");
+}
+DEFINE_TEST(modprobe_compressed_memfd,
+	.description = "check if a module the kernel can't decompress is given to it in a memfd",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/compressed-memfd",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.env_vars = (const struct keyval[]) {
+		{ "TESTSUITE_INIT_MODULE_LOG", "1" },
+		{ }
+		},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/compressed-memfd/correct.txt",
+	},
+	.modules_loaded = "mod-simple",
+	);
+
+DEFINE_TEST_WITH_FUNC(modprobe_compressed_memfd_oldkernel, modprobe_compressed_memfd,
+	.description = "check if a module in a memfd falls back to init_module() without finit_module()",
+	.config = {
+		[TC_UNAME_R] = "3.3.3",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/compressed-memfd-oldkernel",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.env_vars = (const struct keyval[]) {
+		{ "TESTSUITE_INIT_MODULE_LOG", "1" },
+		{ }
+		},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/compressed-memfd-oldkernel/correct.txt",
+	},
+	.modules_loaded = "mod-simple",
+	);
+
+static pthread_t probe_ahead_main_thread;
+
+/* in the same stream as the insertions, to check the order */
+static void probe_ahead_log(_maybe_unused_ void *data, _maybe_unused_ int priority,
+			    _maybe_unused_ const char *file, _maybe_unused_ int line,
+			    _maybe_unused_ const char *fn, const char *format,
+			    va_list args)
+{
+	if (!pthread_equal(pthread_self(), probe_ahead_main_thread))
+		printf("log from a helper thread: ");
+	else
+		printf("log: ");
+
+	vprintf(format, args);
+}
+
+static void probe_ahead_print_action(struct kmod_module *m, _maybe_unused_ bool install,
+				     _maybe_unused_ const char *options)
+{
+	printf("insert %s\n", kmod_module_get_name(m));
+}
+
+static int modprobe_probe_ahead(void)
+{
+	struct kmod_ctx *ctx;
+	struct kmod_module *mod;
+	const char *null_config = NULL;
+	int err;
+
+	probe_ahead_main_thread = pthread_self();
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+
+	kmod_set_log_fn(ctx, probe_ahead_log, NULL);
+	kmod_set_log_priority(ctx, LOG_ERR);
+
+	err = kmod_module_new_from_name(ctx, "mod-foo", &mod);
+	if (err < 0)
+		return EXIT_FAILURE;
+
+	err = kmod_module_probe_insert_module(mod, 0, NULL, NULL, NULL,
+					      probe_ahead_print_action);
+	printf("probe: %s\n", err < 0 ? strerror(-err) : "ok");
+
+	kmod_module_unref(mod);
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(modprobe_probe_ahead,
+	.description = "check if modules got ready ahead are inserted in order",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/probe-ahead",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.env_vars = (const struct keyval[]) {
+		{ "KMOD_PROBE_AHEAD", "3" },
+		{ }
+		},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/probe-ahead/correct.txt",
+	},
+	.modules_loaded = "mod-foo-a,mod-foo-b,mod-foo-c,mod-foo",
+	);
+
+DEFINE_TEST_WITH_FUNC(modprobe_probe_ahead_error, modprobe_probe_ahead,
+	.description = "check if an error getting a module ready ahead is reported for it",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/probe-ahead-error",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.env_vars = (const struct keyval[]) {
+		{ "KMOD_PROBE_AHEAD", "3" },
+		{ }
+		},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/probe-ahead-error/correct.txt",
+	},
+	.modules_loaded = "mod-foo-a",
+	);
+#endif
+
 TESTSUITE_MAIN();
@@ -10,6 +10,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <shared/util.h>
+
 #include <libkmod/libkmod.h>
 
 #include "testsuite.h"
@@ -98,4 +100,102 @@ DEFINE_TEST(from_alias,
 		.out = TESTSUITE_ROOTFS "test-new-module/from_alias/correct.txt",
 	});
 
+static bool lookup_lists_equal(struct kmod_list *a, struct kmod_list *b)
+{
+	struct kmod_list *la = a, *lb = b;
+	bool equal = true;
+
+	while (equal && la != NULL && lb != NULL) {
+		struct kmod_module *ma = kmod_module_get_module(la);
+		struct kmod_module *mb = kmod_module_get_module(lb);
+
+		equal = streq(kmod_module_get_name(ma), kmod_module_get_name(mb));
+		kmod_module_unref(ma);
+		kmod_module_unref(mb);
+
+		la = kmod_list_next(a, la);
+		lb = kmod_list_next(b, lb);
+	}
+
+	return equal && la == NULL && lb == NULL;
+}
+
+static int from_alias_batch(void)
+{
+	/* keys sharing long prefixes, so the batch walk resumes mid-path */
+	static const char *const aliases[] = {
+		// clang-format off
+		"dmi:bvnX:svnACER:",
+		"dmi:bvnX:svnLENOVO:",
+		"dmi:bvnX:svnACER:pnT",
+		"dmi:bvnY:svnLENOVO:pnT",
+		"pci:v00008086d00001234sv00000000sd00000000bc03sc00i00",
+		"pci:v00008086d00001234sv00000000sd00000000bc02sc00i00",
+		"pci:v00008086d00005678sv00000000sd00000000bc03sc00i00",
+		"platform:foo",
+		"platform:foobar",
+		"dmi:bvnX:svnLENOVO:",
+		// clang-format on
+	};
+	struct kmod_list **results;
+	struct kmod_ctx *ctx;
+	int err;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+
+	results = calloc(ARRAY_SIZE(aliases), sizeof(*results));
+	if (results == NULL)
+		return EXIT_FAILURE;
+
+	err = kmod_load_resources(ctx);
+	if (err < 0)
+		return EXIT_FAILURE;
+
+	err = kmod_module_new_from_lookup_batch(ctx, aliases, ARRAY_SIZE(aliases),
+						results);
+	if (err < 0)
+		return EXIT_FAILURE;
+
+	for (size_t i = 0; i < ARRAY_SIZE(aliases); i++) {
+		struct kmod_list *l, *list = NULL;
+
+		err = kmod_module_new_from_lookup(ctx, aliases[i], &list);
+		if (err < 0)
+			return EXIT_FAILURE;
+
+		if (!lookup_lists_equal(results[i], list)) {
+			ERR("batch and single lookups differ for '%s'\n", aliases[i]);
+			return EXIT_FAILURE;
+		}
+
+		printf("%s:", aliases[i]);
+		kmod_list_foreach(l, results[i]) {
+			struct kmod_module *m = kmod_module_get_module(l);
+
+			printf(" %s", kmod_module_get_name(m));
+			kmod_module_unref(m);
+		}
+		printf("\n");
+
+		kmod_module_unref_list(list);
+		kmod_module_unref_list(results[i]);
+	}
+
+	free(results);
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(from_alias_batch,
+	.description = "check if batch lookups match single lookups",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_alias_batch/",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/from_alias_batch/correct.txt",
+	});
+
 TESTSUITE_MAIN();
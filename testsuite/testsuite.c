@@ -609,6 +609,8 @@ static bool test_run_parent_check_outputs(const struct test *t, int fdout, int f
 
 	start_usec = now_usec();
 	end_usec = start_usec + TEST_TIMEOUT_USEC;
+	if (t->timeout > 0)
+		end_usec = start_usec + t->timeout * USEC_PER_SEC;
 
 	for (err = 0; n_fd > 0;) {
 		int fdcount, i, timeout;
@@ -850,6 +852,13 @@ static const char **read_unexpected_modules(const struct test *t, char **buf, in
 	return read_modules(t->modules_not_loaded, buf, count);
 }
 
+/* Modules are the directories in /sys/module, next to files like compression */
+static bool is_loaded_module(const struct dirent *dirent)
+{
+	return dirent->d_name[0] != '.' &&
+	       (dirent->d_type == DT_DIR || dirent->d_type == DT_UNKNOWN);
+}
+
 static char **read_loaded_modules(const struct test *t, char **buf, int *count)
 {
 	char dirname[PATH_MAX];
@@ -877,7 +886,7 @@ static char **read_loaded_modules(const struct test *t, char **buf, int *count)
 	}
 	bufsz = 0;
 	while ((dirent = readdir(dir))) {
-		if (dirent->d_name[0] == '.')
+		if (!is_loaded_module(dirent))
 			continue;
 		len++;
 		bufsz += strlen(dirent->d_name) + 1;
@@ -902,7 +911,7 @@ static char **read_loaded_modules(const struct test *t, char **buf, int *count)
 	while ((dirent = readdir(dir))) {
 		int size;
 
-		if (dirent->d_name[0] == '.')
+		if (!is_loaded_module(dirent))
 			continue;
 		size = strlen(dirent->d_name) + 1;
 		memcpy(p, dirent->d_name, size);
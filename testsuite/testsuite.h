@@ -97,6 +97,8 @@ struct test {
 	const char *path;
 	const struct keyval *env_vars;
 	bool expected_fail;
+	/* in seconds, for tests that need more than the default */
+	unsigned int timeout;
 	/* allow to skip tests that don't meet compile-time dependencies */
 	bool skip;
 };
@@ -11,11 +11,13 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
@@ -23,6 +25,7 @@
 #include <shared/array.h>
 #include <shared/hash.h>
 #include <shared/macro.h>
+#include <shared/modalias.h>
 #include <shared/strbuf.h>
 #include <shared/tmpfile-util.h>
 #include <shared/util.h>
@@ -50,7 +53,7 @@ static const char *const default_cfg_paths[] = {
 	// clang-format on
 };
 
-static const char cmdopts_s[] = "aAb:m:o:C:E:F:evnP:wVh";
+static const char cmdopts_s[] = "aAb:m:o:C:E:F:ej:vnP:wVh";
 static const struct option cmdopts[] = {
 	{ "all", no_argument, 0, 'a' },
 	{ "quick", no_argument, 0, 'A' },
@@ -61,6 +64,8 @@ static const struct option cmdopts[] = {
 	{ "symvers", required_argument, 0, 'E' },
 	{ "filesyms", required_argument, 0, 'F' },
 	{ "errsyms", no_argument, 0, 'e' },
+	{ "jobs", required_argument, 0, 'j' },
+	{ "update", no_argument, 0, 1 },
 	{ "verbose", no_argument, 0, 'v' },
 	{ "show", no_argument, 0, 'n' },
 	{ "dry-run", no_argument, 0, 'n' },
@@ -84,7 +89,11 @@ static void help(void)
 	       "\t-a, --all            Probe all modules\n"
 	       "\t-A, --quick          Only does the work if there's a new module\n"
 	       "\t-e, --errsyms        Report not supplied symbols\n"
+	       "\t-j, --jobs N         Number of threads to search and read modules\n"
+	       "\t                     (default: number of online CPUs)\n"
 	       "\t-n, --show           Write the dependency file on stdout only\n"
+	       "\t    --update         Only read the given modules, which were\n"
+	       "\t                     added, changed or removed, again\n"
 	       "\t-P, --symbol-prefix  Architecture symbol prefix\n"
 	       "\t-C, --config PATH    Read configuration from PATH\n"
 	       "\t-v, --verbose        Enable verbose mode\n"
@@ -120,7 +129,7 @@ _printf_format_(1, 2) static inline void _show(const char *fmt, ...)
 
 /* see documentation in libkmod/libkmod-index.c */
 #define INDEX_MAGIC 0xB007F457
-#define INDEX_VERSION_MAJOR 0x0002
+#define INDEX_VERSION_MAJOR 0x0003
 #define INDEX_VERSION_MINOR 0x0001
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR << 16) | INDEX_VERSION_MINOR)
 #define INDEX_CHILDMAX 128u
@@ -135,11 +144,34 @@ struct index_value {
 struct index_node {
 	char *prefix; /* path compression */
 	struct index_value *values;
-	uint8_t first; /* range of child nodes */
-	uint8_t last;
+	uint64_t child_mask[2]; /* characters with a child node */
+	struct index_node **children; /* in character order */
+	uint8_t child_count;
+	uint8_t child_alloc;
+	uint8_t ch; /* character leading to this node from its parent */
+	bool sparse; /* write children in the sparse format */
 	uint32_t size; /* size of node */
 	uint32_t total; /* size of node and its children */
-	struct index_node *children[INDEX_CHILDMAX]; /* indexed by character */
+	uint32_t offset; /* in the file, set by index_layout() */
+};
+
+/*
+ * Nodes, prefixes and values are allocated from chunks that are only released
+ * when the whole index is destroyed: they are never freed one by one, and
+ * millions of small allocations are avoided for the bigger indexes.
+ */
+#define CHUNK_SIZE (64 * 1024)
+
+struct chunk {
+	struct chunk *next;
+	size_t used;
+	size_t size;
+	uint64_t data[];
+};
+
+struct index_trie {
+	struct index_node *root;
+	struct chunk *chunks;
 };
 
 /* Format of node offsets within index file */
@@ -148,58 +180,117 @@ enum node_offset {
 	INDEX_NODE_PREFIX = 0x80000000,
 	INDEX_NODE_VALUES = 0x40000000,
 	INDEX_NODE_CHILDS = 0x20000000,
+	INDEX_NODE_SPARSE = 0x10000000,
 
 	INDEX_NODE_MASK = 0x0FFFFFFF, /* Offset value */
 };
 
+enum index_section {
+	INDEX_SECTION_HASH = 1,
+	INDEX_SECTION_WILDCARD = 2,
+	INDEX_SECTION_MODALIAS = 3,
+};
+
+/* Entry of the INDEX_SECTION_HASH table, collected while writing the trie */
+struct index_hash_entry {
+	uint32_t hash;
+	uint32_t value_offset;
+	size_t keylen;
+	char key[];
+};
+
 static noreturn void fatal_oom(void)
 {
 	ERR("out of memory\n");
 	exit(EXIT_FAILURE);
 }
 
-static struct index_node *index_create(void)
+static void *chunk_alloc(struct chunk **chunks, size_t size)
 {
-	struct index_node *node;
+	struct chunk *chunk = *chunks;
+	void *p;
 
-	node = calloc(1, sizeof(struct index_node));
-	if (node == NULL)
-		return NULL;
+	size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
 
-	node->prefix = strdup("");
-	if (node->prefix == NULL) {
-		free(node);
-		return NULL;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->used = 0;
+		chunk->size = chunk_size;
+
+		/* keep using the current chunk if what is left in it is bigger */
+		if (*chunks != NULL && size > CHUNK_SIZE / 2) {
+			chunk->next = (*chunks)->next;
+			(*chunks)->next = chunk;
+		} else {
+			chunk->next = *chunks;
+			*chunks = chunk;
+		}
 	}
 
-	node->first = INDEX_CHILDMAX;
+	p = (uint8_t *)chunk->data + chunk->used;
+	chunk->used += size;
 
-	return node;
+	return p;
 }
 
-static void index_values_free(struct index_value *values)
+static void chunks_free(struct chunk **chunks)
 {
-	while (values) {
-		struct index_value *value = values;
+	while (*chunks != NULL) {
+		struct chunk *chunk = *chunks;
 
-		values = value->next;
-		free(value);
+		*chunks = chunk->next;
+		free(chunk);
 	}
 }
 
-static void index_destroy(struct index_node *node)
+static void *index_alloc(struct index_trie *trie, size_t size)
 {
-	int c;
+	void *p = chunk_alloc(&trie->chunks, size);
+
+	if (p == NULL)
+		fatal_oom();
 
-	for (c = node->first; c <= node->last; c++) {
-		struct index_node *child = node->children[c];
+	return p;
+}
 
-		if (child)
-			index_destroy(child);
-	}
-	index_values_free(node->values);
-	free(node->prefix);
-	free(node);
+static char *index_strdup(struct index_trie *trie, const char *str)
+{
+	size_t len = strlen(str);
+
+	return memcpy(index_alloc(trie, len + 1), str, len + 1);
+}
+
+static struct index_node *index_node_new(struct index_trie *trie, const char *prefix)
+{
+	struct index_node *node = index_alloc(trie, sizeof(*node));
+
+	memset(node, 0, sizeof(*node));
+	node->prefix = index_strdup(trie, prefix);
+
+	return node;
+}
+
+static struct index_trie *index_create(void)
+{
+	struct index_trie *trie;
+
+	trie = calloc(1, sizeof(*trie));
+	if (trie == NULL)
+		return NULL;
+
+	trie->root = index_node_new(trie, "");
+
+	return trie;
+}
+
+static void index_destroy(struct index_trie *trie)
+{
+	chunks_free(&trie->chunks);
+	free(trie);
 }
 
 static void index__checkstring(const char *str)
@@ -216,8 +307,8 @@ static void index__checkstring(const char *str)
 	}
 }
 
-static int index_add_value(struct index_value **values, const char *value,
-			   unsigned int priority)
+static int index_add_value(struct index_trie *trie, struct index_value **values,
+			   const char *value, unsigned int priority)
 {
 	struct index_value *v;
 	int duplicate = 0;
@@ -234,9 +325,7 @@ static int index_add_value(struct index_value **values, const char *value,
 		values = &(*values)->next;
 
 	len = strlen(value);
-	v = calloc(1, sizeof(struct index_value) + len + 1);
-	if (v == NULL)
-		fatal_oom();
+	v = index_alloc(trie, sizeof(struct index_value) + len + 1);
 	v->next = *values;
 	v->priority = priority;
 	memcpy(v->value, value, len + 1);
@@ -245,9 +334,59 @@ static int index_add_value(struct index_value **values, const char *value,
 	return duplicate;
 }
 
-static int index_insert(struct index_node *node, const char *key, const char *value,
+/* Position of the child for @ch in node->children, if there's one */
+static unsigned int index_child_pos(const struct index_node *node, uint8_t ch)
+{
+	unsigned int pos = 0;
+	uint64_t below;
+
+	if (ch >= 64) {
+		pos = __builtin_popcountll(node->child_mask[0]);
+		below = node->child_mask[1] & ((1ULL << (ch - 64)) - 1);
+	} else {
+		below = node->child_mask[0] & ((1ULL << ch) - 1);
+	}
+
+	return pos + __builtin_popcountll(below);
+}
+
+static struct index_node *index_child(const struct index_node *node, uint8_t ch)
+{
+	if (!(node->child_mask[ch / 64] & (1ULL << (ch % 64))))
+		return NULL;
+
+	return node->children[index_child_pos(node, ch)];
+}
+
+static void index_add_child(struct index_trie *trie, struct index_node *node,
+			    struct index_node *child)
+{
+	unsigned int pos = index_child_pos(node, child->ch);
+
+	if (node->child_count == node->child_alloc) {
+		struct index_node **children;
+		unsigned int alloc = node->child_alloc ? 2 * node->child_alloc : 1;
+
+		/* the old array is left in the chunk, at most as big as the new one */
+		children = index_alloc(trie, alloc * sizeof(*children));
+		if (node->child_count)
+			memcpy(children, node->children,
+			       node->child_count * sizeof(*children));
+		node->children = children;
+		node->child_alloc = alloc;
+	}
+
+	memmove(&node->children[pos + 1], &node->children[pos],
+		(node->child_count - pos) * sizeof(*node->children));
+	node->children[pos] = child;
+	node->child_count++;
+	node->child_mask[child->ch / 64] |= 1ULL << (child->ch % 64);
+}
+
+static int index_insert(struct index_trie *trie, const char *key, const char *value,
 			unsigned int priority)
 {
+	struct index_node *node = trie->root;
 	int i = 0; /* index within str */
 	uint8_t ch;
 
@@ -263,24 +402,23 @@ static int index_insert(struct index_node *node, const char *key, const char *va
 			ch = node->prefix[j];
 
 			if (ch != key[i + j]) {
-				char *prefix = node->prefix;
 				struct index_node *n;
+				uint8_t node_ch = node->ch;
 
 				/* New child is copy of node with prefix[j+1..N] */
-				n = memdup(node, sizeof(struct index_node));
-				if (n == NULL)
-					fatal_oom();
-				n->prefix = strdup(&prefix[j + 1]);
-				if (n->prefix == NULL)
-					fatal_oom();
+				n = index_alloc(trie, sizeof(*n));
+				*n = *node;
+				n->prefix = &node->prefix[j + 1];
+				n->ch = ch;
 
 				/* Parent has prefix[0..j], child at prefix[j] */
-				memset(node, 0, sizeof(struct index_node));
-				prefix[j] = '\0';
-				node->prefix = prefix;
-				node->first = ch;
-				node->last = ch;
-				node->children[ch] = n;
+				node->prefix[j] = '\0';
+				node->values = NULL;
+				memset(node->child_mask, 0, sizeof(node->child_mask));
+				node->children = NULL;
+				node->child_count = node->child_alloc = 0;
+				node->ch = node_ch;
+				index_add_child(trie, node, n);
 
 				break;
 			}
@@ -290,38 +428,39 @@ static int index_insert(struct index_node *node, const char *key, const char *va
 
 		ch = key[i];
 		if (ch == '\0')
-			return index_add_value(&node->values, value, priority);
+			return index_add_value(trie, &node->values, value, priority);
 
-		if (!node->children[ch]) {
+		if (index_child(node, ch) == NULL) {
 			struct index_node *child;
 
-			if (ch < node->first)
-				node->first = ch;
-			if (ch > node->last)
-				node->last = ch;
-			node->children[ch] = calloc(1, sizeof(struct index_node));
-			if (node->children[ch] == NULL)
-				fatal_oom();
-
-			child = node->children[ch];
-			child->prefix = strdup(&key[i + 1]);
-			if (child->prefix == NULL)
-				fatal_oom();
-			child->first = INDEX_CHILDMAX;
-			index_add_value(&child->values, value, priority);
+			child = index_node_new(trie, &key[i + 1]);
+			child->ch = ch;
+			index_add_child(trie, node, child);
+			index_add_value(trie, &child->values, value, priority);
 
 			return 0;
 		}
 
 		/* Descend into child node and continue */
-		node = node->children[ch];
+		node = index_child(node, ch);
 		i++;
 	}
 }
 
 static int index__haschildren(const struct index_node *node)
 {
-	return node->first < INDEX_CHILDMAX;
+	return node->child_count > 0;
+}
+
+/* Range of characters with a child, only for nodes with children */
+static uint8_t index_first(const struct index_node *node)
+{
+	return node->children[0]->ch;
+}
+
+static uint8_t index_last(const struct index_node *node)
+{
+	return node->children[node->child_count - 1]->ch;
 }
 
 static uint32_t index_get_mask(const struct index_node *node)
@@ -331,6 +470,9 @@ static uint32_t index_get_mask(const struct index_node *node)
 	if (index__haschildren(node))
 		mask |= INDEX_NODE_CHILDS;
 
+	if (node->sparse)
+		mask |= INDEX_NODE_SPARSE;
+
 	if (node->prefix[0])
 		mask |= INDEX_NODE_PREFIX;
 
@@ -340,25 +482,43 @@ static uint32_t index_get_mask(const struct index_node *node)
 	return mask;
 }
 
+/* Size of the prefix and the children offsets, i.e. what precedes the values */
+static uint32_t index_head_size(const struct index_node *node)
+{
+	uint32_t size = 0;
+
+	if (node->prefix[0])
+		size += strlen(node->prefix) + 1;
+
+	/* child_count + keys, uint8_t */
+	if (node->sparse)
+		size += 1 + node->child_count * (1 + sizeof(uint32_t));
+	/* first + last, uint8_t */
+	else if (index__haschildren(node))
+		size += 2 + (index_last(node) - index_first(node) + 1) * sizeof(uint32_t);
+
+	return size;
+}
+
 static uint32_t index_calculate_size(struct index_node *node)
 {
 	node->size = node->total = 0;
+	node->sparse = false;
 
 	if (index__haschildren(node)) {
-		int i;
+		uint32_t dense_size, sparse_size;
+		unsigned int i;
 
-		node->size += 2; /* first + last, uint8_t */
-		node->size += (node->last - node->first + 1) * sizeof(uint32_t);
+		for (i = 0; i < node->child_count; i++)
+			node->total += index_calculate_size(node->children[i]);
 
-		for (i = node->first; i <= node->last; i++) {
-			struct index_node *child = node->children[i];
-			if (child != NULL)
-				node->total += index_calculate_size(child);
-		}
+		dense_size = 2 + (index_last(node) - index_first(node) + 1) *
+					 sizeof(uint32_t);
+		sparse_size = 1 + node->child_count * (1 + sizeof(uint32_t));
+		node->sparse = sparse_size < dense_size;
 	}
 
-	if (node->prefix[0])
-		node->size += strlen(node->prefix) + 1;
+	node->size = index_head_size(node);
 
 	if (node->values) {
 		const struct index_value *v;
@@ -375,205 +535,701 @@ static uint32_t index_calculate_size(struct index_node *node)
 	return node->total;
 }
 
+static void index_hash_add(struct array *entries, struct strbuf *key,
+			   uint32_t value_offset)
+{
+	struct index_hash_entry *e;
+	size_t keylen = strbuf_used(key);
+
+	e = malloc(sizeof(*e) + keylen + 1);
+	if (e == NULL || array_append(entries, e) < 0)
+		fatal_oom();
+
+	e->hash = hash_fnv1a(key->bytes, keylen);
+	e->value_offset = value_offset;
+	e->keylen = keylen;
+	memcpy(e->key, key->bytes, keylen);
+	e->key[keylen] = '\0';
+}
+
+/*
+ * The size of an index is known before writing it, so it's serialized into a
+ * single buffer, written at once, instead of a stdio call per field.
+ */
+static inline void index_put_u8(uint8_t **p, uint8_t v)
+{
+	*(*p)++ = v;
+}
+
+static inline void index_put_u32(uint8_t **p, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+static inline void index_put_mem(uint8_t **p, const void *mem, size_t len)
+{
+	memcpy(*p, mem, len);
+	*p += len;
+}
+
+/* Including the terminating nul */
+static inline void index_put_str(uint8_t **p, const char *str)
+{
+	index_put_mem(p, str, strlen(str) + 1);
+}
+
 /*
- * Recursive pre-order traversal
+ * Lay out the nodes from @offset, appending them to @order in the order they
+ * must be written, and return the offset after them.
  *
- * Returns total amount of bytes written, i.e. byte count of node and its children
+ * Nodes are packed in blocks of about a page: a block is filled breadth-first
+ * from its root with the nodes that fit, and then the subtrees hanging from it
+ * are laid out one after the other, each one the same way. A lookup touches
+ * one or two pages per block it goes through instead of one per level, and
+ * the top of the trie, used by all lookups, is kept together in the first
+ * block.
  */
-static uint32_t index_write__node(const struct index_node *node, FILE *out,
-				  uint32_t offset)
+#define INDEX_BLOCK_SIZE 4096u
+
+static uint32_t index_layout(struct index_node *root, uint32_t offset,
+			     struct array *order)
 {
-	uint32_t child_offs[INDEX_CHILDMAX] = {};
-	int child_count = 0;
+	struct array queue, subtrees;
+	uint32_t used = 0;
+	size_t i;
 
-	/* Calculate children offsets */
-	if (index__haschildren(node)) {
-		int i;
-		size_t sizes = 0;
+	array_init(&queue, 64);
+	array_init(&subtrees, 64);
+
+	if (array_append(&queue, root) < 0)
+		fatal_oom();
 
-		child_count = node->last - node->first + 1;
+	for (i = 0; i < queue.count; i++) {
+		struct index_node *node = queue.array[i];
+		unsigned int c;
 
-		for (i = 0; i < child_count; i++) {
-			struct index_node *child;
+		if (node != root && used + node->size > INDEX_BLOCK_SIZE) {
+			if (array_append(&subtrees, node) < 0)
+				fatal_oom();
+			continue;
+		}
 
-			child = node->children[node->first + i];
-			if (child == NULL) {
-				child_offs[i] = 0;
-			} else {
-				uint32_t mask = index_get_mask(child);
-				child_offs[i] =
-					htobe32((offset + node->size + sizes) | mask);
-				sizes += child->total;
-			}
+		node->offset = offset + used;
+		used += node->size;
+		if (array_append(order, node) < 0)
+			fatal_oom();
+
+		for (c = 0; c < node->child_count; c++) {
+			if (array_append(&queue, node->children[c]) < 0)
+				fatal_oom();
 		}
 	}
 
-	/* Write this node */
-	if (node->prefix[0]) {
-		fputs(node->prefix, out);
-		fputc('\0', out);
+	offset += used;
+	for (i = 0; i < subtrees.count; i++)
+		offset = index_layout(subtrees.array[i], offset, order);
+
+	array_free_array(&queue);
+	array_free_array(&subtrees);
+
+	return offset;
+}
+
+/*
+ * Recursive pre-order traversal collecting the key and first value offset of
+ * each node with values, for the hash section; @key holds the path to the node.
+ */
+static void index_hash_collect(const struct index_node *node, struct array *entries,
+			       struct strbuf *key)
+{
+	size_t pushed = strbuf_pushchars(key, node->prefix);
+
+	if (pushed != strlen(node->prefix))
+		fatal_oom();
+
+	/* skip value_count and priority of the first value */
+	if (node->values)
+		index_hash_add(entries, key,
+			       node->offset + index_head_size(node) +
+				       2 * sizeof(uint32_t));
+
+	for (unsigned int i = 0; i < node->child_count; i++) {
+		struct index_node *child = node->children[i];
+
+		if (!strbuf_pushchar(key, child->ch))
+			fatal_oom();
+		index_hash_collect(child, entries, key);
+		strbuf_popchar(key);
+	}
+
+	strbuf_popchars(key, pushed);
+}
+
+/* Write a single node, its children must have been laid out already */
+static void index_write__node(const struct index_node *node, uint8_t **p)
+{
+	if (node->prefix[0])
+		index_put_str(p, node->prefix);
+
+	if (node->sparse) {
+		index_put_u8(p, node->child_count);
+		for (unsigned int i = 0; i < node->child_count; i++)
+			index_put_u8(p, node->children[i]->ch);
+	} else if (node->child_count) {
+		index_put_u8(p, index_first(node));
+		index_put_u8(p, index_last(node));
 	}
 
-	if (child_count) {
-		fputc(node->first, out);
-		fputc(node->last, out);
-		fwrite(child_offs, sizeof(uint32_t), child_count, out);
+	/* dense nodes have zeros for the holes */
+	if (node->child_count) {
+		uint8_t *offs = *p;
+
+		if (!node->sparse) {
+			size_t n = index_last(node) - index_first(node) + 1;
+
+			memset(offs, 0, n * sizeof(uint32_t));
+			*p += n * sizeof(uint32_t);
+		} else {
+			*p += node->child_count * sizeof(uint32_t);
+		}
+
+		for (unsigned int i = 0; i < node->child_count; i++) {
+			const struct index_node *child = node->children[i];
+			uint8_t *q = offs + i * sizeof(uint32_t);
+
+			if (!node->sparse)
+				q = offs + (child->ch - index_first(node)) * sizeof(uint32_t);
+
+			index_put_u32(&q, child->offset | index_get_mask(child));
+		}
 	}
 
 	if (node->values) {
 		const struct index_value *v;
 		unsigned int value_count;
-		uint32_t u;
 
 		value_count = 0;
 		for (v = node->values; v != NULL; v = v->next)
 			value_count++;
-		u = htobe32(value_count);
-		fwrite(&u, sizeof(u), 1, out);
+		index_put_u32(p, value_count);
 
 		for (v = node->values; v != NULL; v = v->next) {
-			u = htobe32(v->priority);
-			fwrite(&u, sizeof(u), 1, out);
-			fputs(v->value, out);
-			fputc('\0', out);
+			index_put_u32(p, v->priority);
+			index_put_str(p, v->value);
 		}
 	}
+}
 
-	/* Now write children */
-	if (child_count) {
-		int i;
+/* Write the nodes in the order given by index_layout() */
+static void index_write__trie(const struct array *order, uint8_t **p)
+{
+	for (size_t i = 0; i < order->count; i++)
+		index_write__node(order->array[i], p);
+}
 
-		offset += node->size;
-		for (i = 0; i < child_count; i++) {
-			struct index_node *child = node->children[node->first + i];
-			if (child != NULL)
-				offset += index_write__node(child, out, offset);
-		}
+static uint32_t index_hash_buckets(const struct array *entries)
+{
+	/* keep the load factor at or below 1/2 so misses stay short */
+	return align_power2(2 * entries->count + 2);
+}
+
+static uint32_t index_hash_size(const struct array *entries)
+{
+	uint32_t size = sizeof(uint32_t);
+
+	size += index_hash_buckets(entries) * 2 * sizeof(uint32_t);
+	for (size_t i = 0; i < entries->count; i++) {
+		const struct index_hash_entry *e = entries->array[i];
+
+		size += sizeof(uint32_t) + e->keylen + 1;
 	}
 
-	return node->total;
+	return size;
 }
 
-static void index_write(struct index_node *node, FILE *out)
+static void index_write_hash(uint8_t **p, uint32_t offset, const struct array *entries)
 {
-	/* First 3 words are magic, index, offset of node */
-	const uint32_t first_off = 3 * sizeof(uint32_t);
-	uint32_t u;
+	uint32_t n_buckets, mask, entry_offset;
+	uint8_t *buckets;
+	size_t i;
 
-	index_calculate_size(node);
+	n_buckets = index_hash_buckets(entries);
+	mask = n_buckets - 1;
 
-	u = htobe32(INDEX_MAGIC);
-	fwrite(&u, sizeof(u), 1, out);
-	u = htobe32(INDEX_VERSION);
-	fwrite(&u, sizeof(u), 1, out);
+	index_put_u32(p, n_buckets);
 
-	/* Write offset of first node */
-	u = htobe32(first_off | index_get_mask(node));
-	fwrite(&u, sizeof(u), 1, out);
+	/* buckets are filled in place, an empty one has a zero entry offset */
+	buckets = *p;
+	memset(buckets, 0, n_buckets * 2 * sizeof(uint32_t));
+	*p += n_buckets * 2 * sizeof(uint32_t);
 
-	/* Dump trie */
-	index_write__node(node, out, first_off);
+	entry_offset = offset + sizeof(uint32_t) + n_buckets * 2 * sizeof(uint32_t);
+	for (i = 0; i < entries->count; i++) {
+		const struct index_hash_entry *e = entries->array[i];
+		uint32_t pos = e->hash & mask;
+		uint32_t used;
+		uint8_t *q;
+
+		for (;; pos = (pos + 1) & mask) {
+			memcpy(&used, buckets + (2 * pos + 1) * sizeof(uint32_t),
+			       sizeof(used));
+			if (used == 0)
+				break;
+		}
+
+		q = buckets + 2 * pos * sizeof(uint32_t);
+		index_put_u32(&q, e->hash);
+		index_put_u32(&q, entry_offset);
+		entry_offset += sizeof(uint32_t) + e->keylen + 1;
+	}
+
+	for (i = 0; i < entries->count; i++) {
+		const struct index_hash_entry *e = entries->array[i];
+
+		index_put_u32(p, e->value_offset);
+		index_put_mem(p, e->key, e->keylen + 1);
+	}
 }
 
-/* configuration parsing **********************************************/
-struct cfg_override {
-	struct cfg_override *next;
-	size_t len;
-	char path[];
+/* Aliases with wildcards, written to the wildcard and modalias sections */
+struct index_patterns {
+	struct index_trie *wildcards;
+	struct array modaliases[_MODALIAS_BUS_MAX + 1];
 };
 
-enum search_type {
-	SEARCH_PATH,
-	SEARCH_BUILTIN,
-	SEARCH_EXTERNAL,
+struct index_modalias {
+	uint32_t lo[MODALIAS_FIELDS_MAX];
+	uint32_t hi[MODALIAS_FIELDS_MAX];
+	unsigned int priority;
+	uint32_t len; /* of strings */
+	char strings[]; /* "<pattern>\0<value>\0" */
 };
 
-struct cfg_search {
-	struct cfg_search *next;
-	enum search_type type;
-	size_t len;
-	char path[];
-};
+static struct index_patterns *index_patterns_new(void)
+{
+	struct index_patterns *patterns;
 
-struct cfg_external {
-	struct cfg_external *next;
-	size_t len;
-	char path[];
-};
+	patterns = malloc(sizeof(*patterns));
+	if (patterns == NULL)
+		return NULL;
 
-struct cfg_exclude {
-	struct cfg_exclude *next;
-	char exclude_dir[];
-};
+	patterns->wildcards = index_create();
+	if (patterns->wildcards == NULL) {
+		free(patterns);
+		return NULL;
+	}
 
-struct cfg {
-	const char *kversion;
-	char dirname[PATH_MAX];
-	size_t dirnamelen;
-	char outdirname[PATH_MAX];
-	size_t outdirnamelen;
-	char sym_prefix;
-	uint8_t check_symvers;
-	uint8_t print_unknown;
-	uint8_t warn_dups;
-	struct cfg_override *overrides;
-	struct cfg_search *searches;
-	struct cfg_external *externals;
-	struct cfg_exclude *excludes;
-};
+	for (size_t i = 0; i < ARRAY_SIZE(patterns->modaliases); i++)
+		array_init(&patterns->modaliases[i], 256);
 
-static enum search_type cfg_define_search_type(const char *path)
+	return patterns;
+}
+
+static void index_patterns_free(struct index_patterns *patterns)
 {
-	if (streq(path, CFG_BUILTIN_KEY))
-		return SEARCH_BUILTIN;
-	if (streq(path, CFG_EXTERNAL_KEY))
-		return SEARCH_EXTERNAL;
-	return SEARCH_PATH;
+	for (size_t i = 0; i < ARRAY_SIZE(patterns->modaliases); i++) {
+		struct array *modaliases = &patterns->modaliases[i];
+
+		for (size_t j = 0; j < modaliases->count; j++)
+			free(modaliases->array[j]);
+		array_free_array(modaliases);
+	}
+
+	index_destroy(patterns->wildcards);
+	free(patterns);
 }
 
-static int cfg_search_add(struct cfg *cfg, const char *path)
+static bool index_modalias_insert(struct index_patterns *patterns, const char *alias,
+				  const char *value, unsigned int priority)
 {
-	struct cfg_search *s;
-	size_t len;
-	enum search_type type;
+	struct index_modalias *m;
+	size_t aliaslen, valuelen;
+	uint32_t lo[MODALIAS_FIELDS_MAX], hi[MODALIAS_FIELDS_MAX];
+	int bus;
 
-	type = cfg_define_search_type(path);
+	bus = modalias_compile(alias, lo, hi);
+	if (bus < 0)
+		return false;
 
-	if (type != SEARCH_PATH)
-		len = 0;
-	else
-		len = strlen(path) + 1;
+	aliaslen = strlen(alias) + 1;
+	valuelen = strlen(value) + 1;
 
-	s = malloc(sizeof(struct cfg_search) + len);
-	if (s == NULL) {
-		ERR("search add: out of memory\n");
-		return -ENOMEM;
-	}
-	s->type = type;
-	if (type != SEARCH_PATH)
-		s->len = 0;
-	else {
-		s->len = len - 1;
-		memcpy(s->path, path, len);
-	}
+	m = malloc(sizeof(*m) + aliaslen + valuelen);
+	if (m == NULL || array_append(&patterns->modaliases[bus], m) < 0)
+		fatal_oom();
 
-	DBG("search add: %s, search type=%hhu\n", path, (uint8_t)type);
+	memcpy(m->lo, lo, sizeof(lo));
+	memcpy(m->hi, hi, sizeof(hi));
+	m->priority = priority;
+	m->len = aliaslen + valuelen;
+	memcpy(m->strings, alias, aliaslen);
+	memcpy(m->strings + aliaslen, value, valuelen);
 
-	s->next = cfg->searches;
-	cfg->searches = s;
-	return 0;
+	return true;
 }
 
-static void cfg_search_free(struct cfg_search *s)
+/*
+ * Add @alias to the patterns if it contains wildcards. Modaliases of the buses
+ * known to modalias_compile() go to the modalias section, the others to the
+ * trie of the wildcard section. That trie is keyed by the literal prefix of
+ * the pattern, i.e. everything before the first wildcard, so a lookup only
+ * walks the prefixes of its key. Each value is the remaining pattern and the
+ * module name, separated by a space.
+ */
+static void index_patterns_insert(struct index_patterns *patterns, const char *alias,
+				  const char *modname, unsigned int priority)
 {
-	free(s);
-}
+	DECLARE_STRBUF_WITH_STACK(buf, PATH_MAX);
+	size_t prefixlen = strcspn(alias, "*?[");
+	char prefix[PATH_MAX];
 
-static int cfg_override_add(struct cfg *cfg, const char *modname, const char *subdir)
-{
-	struct cfg_override *o;
-	size_t modnamelen = strlen(modname);
-	size_t subdirlen = strlen(subdir);
+	if (alias[prefixlen] == '\0' || prefixlen >= sizeof(prefix))
+		return;
+
+	if (index_modalias_insert(patterns, alias, modname, priority))
+		return;
+
+	if (!strbuf_pushchars(&buf, alias + prefixlen) || !strbuf_pushchar(&buf, ' ') ||
+	    !strbuf_pushchars(&buf, modname))
+		fatal_oom();
+
+	memcpy(prefix, alias, prefixlen);
+	prefix[prefixlen] = '\0';
+	index_insert(patterns->wildcards, prefix, strbuf_str(&buf), priority);
+}
+
+static uint32_t index_modalias_size(const struct index_patterns *patterns)
+{
+	uint32_t size = sizeof(uint32_t);
+
+	for (size_t bus = 1; bus < ARRAY_SIZE(patterns->modaliases); bus++) {
+		const struct array *modaliases = &patterns->modaliases[bus];
+		uint32_t n_fields = modalias_field_count(bus);
+
+		if (modaliases->count == 0)
+			continue;
+
+		/* bus table, entry and field count, lo and hi, entries */
+		size += 4 * sizeof(uint32_t);
+		size += (2 * n_fields + 2) * sizeof(uint32_t) * modaliases->count;
+
+		for (size_t i = 0; i < modaliases->count; i++) {
+			const struct index_modalias *m = modaliases->array[i];
+
+			size += m->len;
+		}
+	}
+
+	return size;
+}
+
+static void index_write_modalias(uint8_t **p, uint32_t offset,
+				 const struct index_patterns *patterns)
+{
+	uint32_t n_buses = 0, block_off, str_off;
+
+	for (size_t bus = 1; bus < ARRAY_SIZE(patterns->modaliases); bus++) {
+		if (patterns->modaliases[bus].count > 0)
+			n_buses++;
+	}
+
+	index_put_u32(p, n_buses);
+
+	/* bus table */
+	block_off = offset + (1 + 2 * n_buses) * sizeof(uint32_t);
+	for (size_t bus = 1; bus < ARRAY_SIZE(patterns->modaliases); bus++) {
+		const struct array *modaliases = &patterns->modaliases[bus];
+		uint32_t n_fields = modalias_field_count(bus);
+
+		if (modaliases->count == 0)
+			continue;
+
+		index_put_u32(p, bus);
+		index_put_u32(p, block_off);
+
+		block_off += 2 * sizeof(uint32_t);
+		block_off += (2 * n_fields + 2) * sizeof(uint32_t) * modaliases->count;
+	}
+
+	/* one block per bus, strings of all of them follow the last one */
+	str_off = block_off;
+	for (size_t bus = 1; bus < ARRAY_SIZE(patterns->modaliases); bus++) {
+		const struct array *modaliases = &patterns->modaliases[bus];
+		uint32_t n_fields = modalias_field_count(bus);
+		size_t i, f;
+
+		if (modaliases->count == 0)
+			continue;
+
+		index_put_u32(p, modaliases->count);
+		index_put_u32(p, n_fields);
+
+		for (f = 0; f < n_fields; f++) {
+			for (i = 0; i < modaliases->count; i++) {
+				const struct index_modalias *m = modaliases->array[i];
+
+				index_put_u32(p, m->lo[f]);
+			}
+		}
+
+		for (f = 0; f < n_fields; f++) {
+			for (i = 0; i < modaliases->count; i++) {
+				const struct index_modalias *m = modaliases->array[i];
+
+				index_put_u32(p, m->hi[f]);
+			}
+		}
+
+		for (i = 0; i < modaliases->count; i++) {
+			const struct index_modalias *m = modaliases->array[i];
+
+			index_put_u32(p, m->priority);
+			index_put_u32(p, str_off);
+			str_off += m->len;
+		}
+	}
+
+	for (size_t bus = 1; bus < ARRAY_SIZE(patterns->modaliases); bus++) {
+		const struct array *modaliases = &patterns->modaliases[bus];
+
+		for (size_t i = 0; i < modaliases->count; i++) {
+			const struct index_modalias *m = modaliases->array[i];
+
+			index_put_mem(p, m->strings, m->len);
+		}
+	}
+}
+
+/*
+ * Map the first @size bytes of the file behind @out, to serialize the index
+ * directly into it. The blocks are allocated first so running out of space is
+ * reported here, rather than with a SIGBUS when writing to the mapping.
+ */
+static uint8_t *index_map_output(FILE *out, size_t size)
+{
+	int fd = fileno(out);
+	void *p;
+
+	if (fd < 0 || fflush(out) != 0 || ftello(out) != 0)
+		return NULL;
+
+	if (posix_fallocate(fd, 0, size) != 0)
+		return NULL;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	return p;
+}
+
+/*
+ * Write the index to @out. If @hash is true, a hash section for exact lookups
+ * is appended: only use it for indexes whose keys are never wildcards.
+ * If @patterns is not NULL, the wildcard and modalias sections are written,
+ * see index_patterns_insert().
+ */
+static void index_write(struct index_trie *trie, struct index_patterns *patterns,
+			FILE *out, bool hash)
+{
+	DECLARE_STRBUF_WITH_STACK(key, 128);
+	const uint32_t n_sections = !!hash + 2 * !!patterns;
+	/* magic, version, offset of node, section count and section table */
+	const uint32_t first_off = (4 + 2 * n_sections) * sizeof(uint32_t);
+	uint32_t wild_off, wild_total = 0, modalias_off, modalias_total = 0;
+	uint32_t hash_off, hash_total = 0;
+	struct index_node *node = trie->root;
+	struct array order, wild_order, entries;
+	uint8_t *map, *buf, *p;
+	uint32_t total, size;
+
+	total = index_calculate_size(node);
+	wild_off = first_off + total;
+	if (patterns != NULL)
+		wild_total = sizeof(uint32_t) + index_calculate_size(patterns->wildcards->root);
+
+	/* the modalias section is read as an array of uint32_t, align it */
+	modalias_off = (wild_off + wild_total + 3) & ~3U;
+	if (patterns != NULL)
+		modalias_total = modalias_off - (wild_off + wild_total) +
+				 index_modalias_size(patterns);
+
+	/* the hash entries point to the values, lay out the trie first */
+	array_init(&order, 1024);
+	index_layout(node, first_off, &order);
+
+	array_init(&wild_order, 1024);
+	if (patterns != NULL)
+		index_layout(patterns->wildcards->root, wild_off + sizeof(uint32_t),
+			     &wild_order);
+
+	array_init(&entries, 1024);
+	hash_off = wild_off + wild_total + modalias_total;
+	if (hash) {
+		index_hash_collect(node, &entries, &key);
+		hash_total = index_hash_size(&entries);
+	}
+
+	/* fall back to writing from memory, e.g. to a pipe */
+	size = hash_off + hash_total;
+	map = index_map_output(out, size);
+	buf = map != NULL ? map : malloc(size);
+	if (buf == NULL)
+		fatal_oom();
+	p = buf;
+
+	index_put_u32(&p, INDEX_MAGIC);
+	index_put_u32(&p, INDEX_VERSION);
+
+	/* Write offset of first node */
+	index_put_u32(&p, first_off | index_get_mask(node));
+
+	index_put_u32(&p, n_sections);
+	if (patterns != NULL) {
+		index_put_u32(&p, INDEX_SECTION_WILDCARD);
+		index_put_u32(&p, wild_off);
+		index_put_u32(&p, INDEX_SECTION_MODALIAS);
+		index_put_u32(&p, modalias_off);
+	}
+	if (hash) {
+		index_put_u32(&p, INDEX_SECTION_HASH);
+		index_put_u32(&p, hash_off);
+	}
+
+	/* Dump trie */
+	index_write__trie(&order, &p);
+
+	if (patterns != NULL) {
+		/* the section starts with the offset of its root node */
+		index_put_u32(&p, (wild_off + sizeof(uint32_t)) |
+					  index_get_mask(patterns->wildcards->root));
+		index_write__trie(&wild_order, &p);
+
+		while (p < buf + modalias_off)
+			index_put_u8(&p, '\0');
+		index_write_modalias(&p, modalias_off, patterns);
+	}
+
+	if (hash)
+		index_write_hash(&p, hash_off, &entries);
+
+	assert(p == buf + size);
+	if (map != NULL) {
+		munmap(map, size);
+	} else {
+		fwrite(buf, 1, size, out);
+		free(buf);
+	}
+
+	for (size_t i = 0; i < entries.count; i++)
+		free(entries.array[i]);
+	array_free_array(&entries);
+	array_free_array(&wild_order);
+	array_free_array(&order);
+}
+
+/* configuration parsing **********************************************/
+struct cfg_override {
+	struct cfg_override *next;
+	size_t len;
+	char path[];
+};
+
+enum search_type {
+	SEARCH_PATH,
+	SEARCH_BUILTIN,
+	SEARCH_EXTERNAL,
+};
+
+struct cfg_search {
+	struct cfg_search *next;
+	enum search_type type;
+	size_t len;
+	char path[];
+};
+
+struct cfg_external {
+	struct cfg_external *next;
+	size_t len;
+	char path[];
+};
+
+struct cfg_exclude {
+	struct cfg_exclude *next;
+	char exclude_dir[];
+};
+
+struct cfg {
+	const char *kversion;
+	char dirname[PATH_MAX];
+	size_t dirnamelen;
+	char outdirname[PATH_MAX];
+	size_t outdirnamelen;
+	char sym_prefix;
+	uint8_t check_symvers;
+	uint8_t print_unknown;
+	uint8_t warn_dups;
+	unsigned int jobs;
+	struct cfg_override *overrides;
+	struct cfg_search *searches;
+	struct cfg_external *externals;
+	struct cfg_exclude *excludes;
+};
+
+static enum search_type cfg_define_search_type(const char *path)
+{
+	if (streq(path, CFG_BUILTIN_KEY))
+		return SEARCH_BUILTIN;
+	if (streq(path, CFG_EXTERNAL_KEY))
+		return SEARCH_EXTERNAL;
+	return SEARCH_PATH;
+}
+
+static int cfg_search_add(struct cfg *cfg, const char *path)
+{
+	struct cfg_search *s;
+	size_t len;
+	enum search_type type;
+
+	type = cfg_define_search_type(path);
+
+	if (type != SEARCH_PATH)
+		len = 0;
+	else
+		len = strlen(path) + 1;
+
+	s = malloc(sizeof(struct cfg_search) + len);
+	if (s == NULL) {
+		ERR("search add: out of memory\n");
+		return -ENOMEM;
+	}
+	s->type = type;
+	if (type != SEARCH_PATH)
+		s->len = 0;
+	else {
+		s->len = len - 1;
+		memcpy(s->path, path, len);
+	}
+
+	DBG("search add: %s, search type=%hhu\n", path, (uint8_t)type);
+
+	s->next = cfg->searches;
+	cfg->searches = s;
+	return 0;
+}
+
+static void cfg_search_free(struct cfg_search *s)
+{
+	free(s);
+}
+
+static int cfg_override_add(struct cfg *cfg, const char *modname, const char *subdir)
+{
+	struct cfg_override *o;
+	size_t modnamelen = strlen(modname);
+	size_t subdirlen = strlen(subdir);
 	size_t i;
 
 	o = malloc(sizeof(struct cfg_override) + subdirlen + 1 + modnamelen + 1);
@@ -946,26 +1602,26 @@ static void cfg_free(struct cfg *cfg)
 }
 
 /* depmod calculations ***********************************************/
-struct vertex;
 struct mod {
 	struct kmod_module *kmod;
 	char *path;
 	const char *relpath; /* path relative to '$ROOT$MODULE_DIRECTORY/$VER/' */
 	char *uncrelpath; /* same as relpath but ending in .ko */
-	struct kmod_list *info_list;
-	struct kmod_list *dep_sym_list;
+	const struct cache_entry *cache_entry; /* what was read from the module */
+	struct cache_entry *cache_buf; /* cache_entry, if not from the cache file */
+	const char *sym_names; /* first exported symbol in cache_entry */
+	const char *dep_sym_names; /* first dependency symbol in cache_entry */
+	int sym_err; /* of kmod_module_get_symbols() */
+	int info_err;
+	bool loaded; /* by depmod_load_module() */
+	bool cacheable; /* cache_entry can be written to the cache file */
 	struct array alias_values;
 	struct array softdep_values;
 	struct array weakdep_values;
-	struct array deps; /* struct symbol */
 	size_t baselen; /* points to start of basename/filename */
 	size_t modnamesz;
 	int sort_idx; /* sort index using modules.order */
-	int dep_sort_idx; /* topological sort index */
-	uint16_t idx; /* index in depmod->modules.array */
-	uint16_t users; /* how many modules depend on this one */
-	bool visited; /* helper field to report cycles */
-	struct vertex *vertex; /* helper field to report cycles */
+	uint32_t idx; /* index in depmod->modules.array and depmod->graph */
 	char modname[];
 };
 
@@ -975,31 +1631,136 @@ struct symbol {
 	char name[];
 };
 
+/*
+ * Symbols are never removed, so they are allocated from chunks like the index
+ * nodes and found through an open addressing table that keeps the hash of each
+ * name: growing the table doesn't need to hash the names again, and most
+ * mismatches are skipped without comparing them.
+ */
+#define SYMBOLS_PER_MODULE 8 /* to size the table before loading the modules */
+
+struct symbol_slot {
+	uint32_t hash;
+	uint32_t n; /* index in list plus one, 0 if the slot is empty */
+};
+
+struct symbol_table {
+	struct symbol **list; /* in the order they were added, n_slots * 3 / 4 long */
+	uint32_t count;
+	struct symbol_slot *slots;
+	uint32_t n_slots; /* power of 2, kept at most 3/4 full */
+	struct chunk *chunks;
+};
+
+/*
+ * Dependency graph of the modules, indexed by mod->idx. It's kept apart from
+ * struct mod so the passes over the whole graph only go through these arrays
+ * and not through the module names, paths and aliases.
+ */
+struct mod_graph {
+	uint32_t *deps_start; /* deps of module i: deps[deps_start[i]..deps_start[i + 1]] */
+	uint32_t *deps; /* mod->idx of each dependency */
+	size_t n_deps;
+	size_t deps_size;
+	uint32_t *dep_sort_idx; /* topological sort index */
+	uint32_t *by_dep_sort; /* mod->idx, indexed by dep_sort_idx */
+	uint64_t **all_deps; /* bitmap of dep_sort_idx of the transitive deps */
+	uint32_t *all_deps_start; /* first word of all_deps */
+};
+
 struct depmod {
 	const struct cfg *cfg;
 	struct kmod_ctx *ctx;
 	struct array modules;
 	struct hash *modules_by_uncrelpath;
 	struct hash *modules_by_name;
-	struct hash *symbols;
+	struct symbol_table symbols;
+	struct mod_graph graph;
+	struct hash *cache; /* path -> struct cache_entry in cache_map */
+	void *cache_map;
+	size_t cache_size;
+	struct strbuf tree; /* snapshot for TREE_FILENAME */
 };
 
 static void mod_free(struct mod *mod)
 {
 	DBG("free %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
-	array_free_array(&mod->deps);
 	array_free_array(&mod->weakdep_values);
 	array_free_array(&mod->softdep_values);
 	array_free_array(&mod->alias_values);
 	kmod_module_unref(mod->kmod);
-	kmod_module_info_free_list(mod->info_list);
-	kmod_module_dependency_symbols_free_list(mod->dep_sym_list);
+	free(mod->cache_buf);
 	free(mod->uncrelpath);
 	free(mod->path);
 	free(mod);
 }
 
-static int mod_add_dependency(struct mod *mod, struct symbol *sym)
+static inline size_t mod_graph_n_deps(const struct mod_graph *graph, uint32_t i)
+{
+	return graph->deps_start[i + 1] - graph->deps_start[i];
+}
+
+static inline const uint32_t *mod_graph_deps(const struct mod_graph *graph, uint32_t i)
+{
+	return graph->deps + graph->deps_start[i];
+}
+
+static bool mod_graph_depends_on(const struct mod_graph *graph, uint32_t i, uint32_t dep)
+{
+	const uint32_t *deps = mod_graph_deps(graph, i);
+
+	for (size_t j = 0; j < mod_graph_n_deps(graph, i); j++) {
+		if (deps[j] == dep)
+			return true;
+	}
+
+	return false;
+}
+
+/* Dependencies are added to the last module, the one being loaded */
+static int mod_graph_add_dep(struct mod_graph *graph, uint32_t i, uint32_t dep)
+{
+	for (size_t j = graph->deps_start[i]; j < graph->n_deps; j++) {
+		if (graph->deps[j] == dep)
+			return -EEXIST;
+	}
+
+	if (graph->n_deps == graph->deps_size) {
+		size_t size = graph->deps_size == 0 ? 1024 : graph->deps_size * 2;
+		uint32_t *deps;
+
+		if (size > UINT32_MAX)
+			return -ERANGE;
+
+		deps = realloc(graph->deps, size * sizeof(*deps));
+		if (deps == NULL)
+			return -ENOMEM;
+
+		graph->deps = deps;
+		graph->deps_size = size;
+	}
+
+	graph->deps[graph->n_deps++] = dep;
+
+	return 0;
+}
+
+static void mod_graph_free(struct mod_graph *graph, size_t n_mods)
+{
+	if (graph->all_deps != NULL) {
+		for (size_t i = 0; i < n_mods; i++)
+			free(graph->all_deps[i]);
+	}
+
+	free(graph->all_deps);
+	free(graph->all_deps_start);
+	free(graph->by_dep_sort);
+	free(graph->dep_sort_idx);
+	free(graph->deps);
+	free(graph->deps_start);
+}
+
+static int mod_add_dependency(struct depmod *depmod, struct mod *mod, struct symbol *sym)
 {
 	int err;
 
@@ -1009,7 +1770,7 @@ static int mod_add_dependency(struct mod *mod, struct symbol *sym)
 	if (sym->owner == NULL)
 		return 0;
 
-	err = array_append_unique(&mod->deps, sym->owner);
+	err = mod_graph_add_dep(&depmod->graph, mod->idx, sym->owner->idx);
 	if (err == -EEXIST)
 		return 0;
 	if (err < 0) {
@@ -1018,46 +1779,108 @@ static int mod_add_dependency(struct mod *mod, struct symbol *sym)
 		return err;
 	}
 
-	sym->owner->users++;
 	SHOW("%s needs \"%s\": %s\n", mod->path, sym->name, sym->owner->path);
 	return 0;
 }
 
-static void symbol_free(void *data)
+static struct symbol_slot *symbol_table_slot(const struct symbol_table *table,
+					      const char *name, uint32_t hash)
 {
-	struct symbol *sym = data;
+	uint32_t mask = table->n_slots - 1;
+
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+		struct symbol_slot *slot = &table->slots[i];
+		const struct symbol *sym;
+
+		if (slot->n == 0)
+			return slot;
 
-	DBG("free %p sym=%s, owner=%p %s\n", sym, sym->name, sym->owner,
-	    sym->owner != NULL ? sym->owner->path : "");
-	free(sym);
+		if (slot->hash != hash)
+			continue;
+
+		sym = table->list[slot->n - 1];
+		if (streq(sym->name, name))
+			return slot;
+	}
 }
 
-static int depmod_init(struct depmod *depmod, struct cfg *cfg, struct kmod_ctx *ctx)
+/* Make room for @count symbols in total */
+static int symbol_table_reserve(struct symbol_table *table, size_t count)
 {
-	depmod->cfg = cfg;
-	depmod->ctx = ctx;
+	struct symbol_slot *slots;
+	struct symbol **list;
+	uint32_t n_slots, mask;
 
-	array_init(&depmod->modules, 128);
+	if (count <= table->n_slots / 4 * 3)
+		return 0;
 
-	depmod->modules_by_uncrelpath = hash_new(512, NULL);
-	if (depmod->modules_by_uncrelpath == NULL)
-		goto modules_by_uncrelpath_failed;
+	if (count > UINT32_MAX / 4)
+		return -ERANGE;
 
-	depmod->modules_by_name = hash_new(512, NULL);
-	if (depmod->modules_by_name == NULL)
-		goto modules_by_name_failed;
+	n_slots = align_power2(count / 3 * 4 + 4);
 
-	depmod->symbols = hash_new(2048, symbol_free);
-	if (depmod->symbols == NULL)
-		goto symbols_failed;
+	list = realloc(table->list, n_slots / 4 * 3 * sizeof(*list));
+	if (list == NULL)
+		return -ENOMEM;
+	table->list = list;
 
-	return 0;
+	slots = calloc(n_slots, sizeof(*slots));
+	if (slots == NULL)
+		return -ENOMEM;
 
-symbols_failed:
-	hash_free(depmod->modules_by_name);
-modules_by_name_failed:
-	hash_free(depmod->modules_by_uncrelpath);
-modules_by_uncrelpath_failed:
+	mask = n_slots - 1;
+	for (uint32_t i = 0; i < table->n_slots; i++) {
+		const struct symbol_slot *slot = &table->slots[i];
+		uint32_t j;
+
+		if (slot->n == 0)
+			continue;
+
+		for (j = slot->hash & mask; slots[j].n != 0; j = (j + 1) & mask)
+			;
+		slots[j] = *slot;
+	}
+
+	free(table->slots);
+	table->slots = slots;
+	table->n_slots = n_slots;
+
+	return 0;
+}
+
+static void symbol_table_free(struct symbol_table *table)
+{
+	chunks_free(&table->chunks);
+	free(table->list);
+	free(table->slots);
+}
+
+static int depmod_init(struct depmod *depmod, struct cfg *cfg, struct kmod_ctx *ctx)
+{
+	depmod->cfg = cfg;
+	depmod->ctx = ctx;
+
+	array_init(&depmod->modules, 128);
+	strbuf_init(&depmod->tree);
+
+	depmod->modules_by_uncrelpath = hash_new(512, NULL);
+	if (depmod->modules_by_uncrelpath == NULL)
+		goto modules_by_uncrelpath_failed;
+
+	depmod->modules_by_name = hash_new(512, NULL);
+	if (depmod->modules_by_name == NULL)
+		goto modules_by_name_failed;
+
+	if (symbol_table_reserve(&depmod->symbols, 2048) < 0)
+		goto symbols_failed;
+
+	return 0;
+
+symbols_failed:
+	hash_free(depmod->modules_by_name);
+modules_by_name_failed:
+	hash_free(depmod->modules_by_uncrelpath);
+modules_by_uncrelpath_failed:
 	return -ENOMEM;
 }
 
@@ -1065,7 +1888,7 @@ static void depmod_shutdown(struct depmod *depmod)
 {
 	size_t i;
 
-	hash_free(depmod->symbols);
+	symbol_table_free(&depmod->symbols);
 
 	hash_free(depmod->modules_by_uncrelpath);
 
@@ -1073,11 +1896,25 @@ static void depmod_shutdown(struct depmod *depmod)
 
 	for (i = 0; i < depmod->modules.count; i++)
 		mod_free(depmod->modules.array[i]);
+	mod_graph_free(&depmod->graph, depmod->modules.count);
 	array_free_array(&depmod->modules);
 
+	hash_free(depmod->cache);
+	if (depmod->cache_map != NULL)
+		munmap(depmod->cache_map, depmod->cache_size);
+
+	strbuf_release(&depmod->tree);
+
 	kmod_unref(depmod->ctx);
 }
 
+/* Whether @path is in the module directory, so it has a path relative to it */
+static bool path_is_under(const struct cfg *cfg, const char *path)
+{
+	return strncmp(path, cfg->dirname, cfg->dirnamelen) == 0 &&
+	       path[cfg->dirnamelen] == '/';
+}
+
 static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 {
 	const struct cfg *cfg = depmod->cfg;
@@ -1094,7 +1931,6 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 		return -ENOMEM;
 	mod->kmod = kmod;
 	mod->sort_idx = depmod->modules.count + 1;
-	mod->dep_sort_idx = INT32_MAX;
 	memcpy(mod->modname, modname, modnamesz);
 	mod->modnamesz = modnamesz;
 
@@ -1102,8 +1938,6 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	array_init(&mod->softdep_values, 8); // fits ~95%, the rest are sub 16
 	array_init(&mod->weakdep_values, 4); // fits 100%
 
-	array_init(&mod->deps, 4);
-
 	mod->path = strdup(kmod_module_get_path(kmod));
 	if (mod->path == NULL) {
 		free(mod);
@@ -1111,8 +1945,7 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	}
 	lastslash = strrchr(mod->path, '/');
 	mod->baselen = lastslash - mod->path;
-	if (strncmp(mod->path, cfg->dirname, cfg->dirnamelen) == 0 &&
-	    mod->path[cfg->dirnamelen] == '/')
+	if (path_is_under(cfg, mod->path))
 		mod->relpath = mod->path + cfg->dirnamelen + 1;
 	else
 		mod->relpath = NULL;
@@ -1282,7 +2115,10 @@ static int depmod_modules_search_file(struct depmod *depmod, size_t baselen,
 		return -EINVAL;
 	}
 
-	relpath = path + depmod->cfg->dirnamelen + 1;
+	if (path_is_under(depmod->cfg, path))
+		relpath = path + depmod->cfg->dirnamelen + 1;
+	else
+		relpath = path;
 	DBG("try %s (%s)\n", relpath, modname);
 
 	mod = hash_find(depmod->modules_by_name, modname);
@@ -1335,102 +2171,314 @@ static bool should_exclude_dir(const struct cfg *cfg, const char *name)
 	return false;
 }
 
-static void depmod_modules_search_dir(struct depmod *depmod, DIR *d, struct strbuf *path)
+/*
+ * Directories are read by a pool of threads, since on a cold cache or a network
+ * file system most of the search is spent waiting on readdir() and stat(). The
+ * entries are kept in readdir() order and only looked at by
+ * depmod_modules_search_dir() once the whole tree is read, so modules are added
+ * and their priorities resolved in the same order as in a serial walk.
+ */
+struct search_entry {
+	struct search_dir *dir; /* NULL for module files */
+	char name[];
+};
+
+struct search_dir {
+	struct array entries;
+	char path[];
+};
+
+struct search_walk {
+	const struct cfg *cfg;
+	int dfd; /* of the search path */
+	size_t rootlen;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct array queue; /* of directories to read */
+	size_t pending; /* queued or being read */
+};
+
+static struct search_dir *search_dir_new(const char *base, size_t baselen,
+					 const char *name, size_t namelen)
+{
+	struct search_dir *dir;
+	size_t len = baselen + (name != NULL ? namelen + 1 : 0);
+
+	dir = malloc(sizeof(*dir) + len + 1);
+	if (dir == NULL)
+		return NULL;
+
+	array_init(&dir->entries, 16);
+	memcpy(dir->path, base, baselen);
+	if (name != NULL) {
+		dir->path[baselen] = '/';
+		memcpy(dir->path + baselen + 1, name, namelen);
+	}
+	dir->path[len] = '\0';
+
+	return dir;
+}
+
+static void search_dir_free(struct search_dir *dir)
+{
+	for (size_t i = 0; i < dir->entries.count; i++) {
+		struct search_entry *entry = dir->entries.array[i];
+
+		if (entry->dir != NULL)
+			search_dir_free(entry->dir);
+		free(entry);
+	}
+	array_free_array(&dir->entries);
+	free(dir);
+}
+
+static int search_dir_add(struct search_dir *dir, const char *name, size_t namelen,
+			  bool is_dir)
+{
+	struct search_entry *entry;
+
+	entry = malloc(sizeof(*entry) + namelen + 1);
+	if (entry == NULL)
+		return -ENOMEM;
+
+	entry->dir = NULL;
+	memcpy(entry->name, name, namelen + 1);
+
+	if (is_dir) {
+		entry->dir = search_dir_new(dir->path, strlen(dir->path), name, namelen);
+		if (entry->dir == NULL) {
+			free(entry);
+			return -ENOMEM;
+		}
+	}
+
+	if (array_append(&dir->entries, entry) < 0) {
+		if (entry->dir != NULL)
+			search_dir_free(entry->dir);
+		free(entry);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void search_dir_read(struct search_walk *walk, struct search_dir *dir)
 {
+	const char *relpath = dir->path + walk->rootlen;
 	struct dirent *de;
-	int dfd = dirfd(d);
-	size_t baselen;
+	DIR *d;
+	int dfd;
 
-	if (!strbuf_pushchar(path, '/')) {
-		ERR("No memory\n");
+	relpath = *relpath == '\0' ? "." : relpath + 1;
+	dfd = openat(walk->dfd, relpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
+		ERR("openat(%d, %s, O_RDONLY): %m\n", walk->dfd, relpath);
+		return;
+	}
+	d = fdopendir(dfd);
+	if (d == NULL) {
+		ERR("fdopendir(%d): %m\n", dfd);
+		close(dfd);
 		return;
 	}
-	baselen = strbuf_used(path);
 
 	while ((de = readdir(d)) != NULL) {
 		const char *name = de->d_name;
 		size_t namelen;
-		uint8_t is_dir;
+		bool is_dir;
 
-		if (should_exclude_dir(depmod->cfg, name))
+		if (should_exclude_dir(walk->cfg, name))
 			continue;
 
-		strbuf_shrink_to(path, baselen);
-
 		namelen = strlen(name);
 
-		if (!strbuf_pushchars(path, name)) {
-			ERR("No memory\n");
-			continue;
-		}
-
 		if (de->d_type == DT_REG)
-			is_dir = 0;
+			is_dir = false;
 		else if (de->d_type == DT_DIR)
-			is_dir = 1;
+			is_dir = true;
 		else {
 			struct stat st;
 			if (fstatat(dfd, name, &st, 0) < 0) {
 				ERR("fstatat(%d, %s): %m\n", dfd, name);
 				continue;
 			} else if (S_ISREG(st.st_mode))
-				is_dir = 0;
+				is_dir = false;
 			else if (S_ISDIR(st.st_mode))
-				is_dir = 1;
+				is_dir = true;
 			else {
-				ERR("unsupported file type %s: %o\n", strbuf_str(path),
+				ERR("unsupported file type %s/%s: %o\n", dir->path, name,
 				    st.st_mode & S_IFMT);
 				continue;
 			}
 		}
 
-		if (is_dir) {
-			int fd;
-			DIR *subdir;
-			fd = openat(dfd, name, O_RDONLY);
-			if (fd < 0) {
-				ERR("openat(%d, %s, O_RDONLY): %m\n", dfd, name);
+		if (!is_dir && !path_ends_with_kmod_ext(name, namelen))
+			continue;
+
+		if (search_dir_add(dir, name, namelen, is_dir) < 0)
+			ERR("No memory\n");
+	}
+
+	closedir(d);
+}
+
+static void *search_walk_worker(void *data)
+{
+	struct search_walk *walk = data;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		struct search_dir *dir;
+		size_t i;
+
+		while (walk->queue.count == 0 && walk->pending > 0)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+
+		if (walk->queue.count == 0)
+			break;
+
+		dir = walk->queue.array[walk->queue.count - 1];
+		array_pop(&walk->queue);
+		pthread_mutex_unlock(&walk->lock);
+
+		search_dir_read(walk, dir);
+
+		pthread_mutex_lock(&walk->lock);
+		/* in reverse, so the first subdirectory is the next one popped */
+		for (i = dir->entries.count; i > 0; i--) {
+			struct search_entry *entry = dir->entries.array[i - 1];
+
+			if (entry->dir == NULL)
 				continue;
-			}
-			subdir = fdopendir(fd);
-			if (subdir == NULL) {
-				ERR("fdopendir(%d): %m\n", fd);
-				close(fd);
+
+			if (array_append(&walk->queue, entry->dir) < 0) {
+				ERR("No memory\n");
 				continue;
 			}
+			walk->pending++;
+		}
+		walk->pending--;
+		pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
 
-			depmod_modules_search_dir(depmod, subdir, path);
-			closedir(subdir);
-		} else {
-			int err = depmod_modules_search_file(depmod, baselen, namelen,
-							     strbuf_str(path));
-			if (err < 0)
-				ERR("failed %s: %s\n", strbuf_str(path), strerror(-err));
+	return NULL;
+}
+
+/* Read the tree under @root, using @jobs threads including the calling one */
+static int search_walk(struct search_walk *walk, struct search_dir *root,
+		       unsigned int jobs)
+{
+	_cleanup_free_ pthread_t *threads = NULL;
+	unsigned int n_threads = 0;
+
+	if (array_append(&walk->queue, root) < 0)
+		return -ENOMEM;
+	walk->pending = 1;
+
+	if (jobs > 1) {
+		threads = malloc((jobs - 1) * sizeof(*threads));
+		if (threads == NULL)
+			jobs = 1;
+	}
+
+	for (; n_threads + 1 < jobs; n_threads++) {
+		int err = pthread_create(&threads[n_threads], NULL, search_walk_worker,
+					 walk);
+		if (err != 0) {
+			WRN("could not create thread, using %u: %s\n", n_threads + 1,
+			    strerror(err));
+			break;
+		}
+	}
+
+	search_walk_worker(walk);
+
+	for (unsigned int t = 0; t < n_threads; t++)
+		pthread_join(threads[t], NULL);
+
+	return 0;
+}
+
+static void depmod_modules_search_dir(struct depmod *depmod, const struct search_dir *dir,
+				      struct strbuf *path)
+{
+	size_t baselen;
+
+	if (!strbuf_pushchar(path, '/')) {
+		ERR("No memory\n");
+		return;
+	}
+	baselen = strbuf_used(path);
+
+	for (size_t i = 0; i < dir->entries.count; i++) {
+		const struct search_entry *entry = dir->entries.array[i];
+		size_t namelen = strlen(entry->name);
+		int err;
+
+		strbuf_shrink_to(path, baselen);
+
+		if (!strbuf_pushchars(path, entry->name)) {
+			ERR("No memory\n");
+			continue;
+		}
+
+		if (entry->dir != NULL) {
+			depmod_modules_search_dir(depmod, entry->dir, path);
+			continue;
 		}
+
+		err = depmod_modules_search_file(depmod, baselen, namelen,
+						 strbuf_str(path));
+		if (err < 0)
+			ERR("failed %s: %s\n", strbuf_str(path), strerror(-err));
 	}
 }
 
 static int depmod_modules_search_path(struct depmod *depmod, const char *path)
 {
 	DECLARE_STRBUF_WITH_STACK(s_path_buf, 256);
-	DIR *d;
+	struct search_walk walk = {
+		.cfg = depmod->cfg,
+		.rootlen = strlen(path),
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct search_dir *root;
 	int err = 0;
 
-	d = opendir(path);
-	if (d == NULL) {
+	walk.dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (walk.dfd < 0) {
 		err = -errno;
 		ERR("could not open directory %s: %m\n", path);
 		return err;
 	}
 
+	array_init(&walk.queue, 64);
+
+	root = search_dir_new(path, walk.rootlen, NULL, 0);
+	if (root == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = search_walk(&walk, root, depmod->cfg->jobs);
+	if (err < 0)
+		goto out;
+
 	if (!strbuf_pushchars(&s_path_buf, path)) {
 		err = -ENOMEM;
 		goto out;
 	}
 
-	depmod_modules_search_dir(depmod, d, &s_path_buf);
+	depmod_modules_search_dir(depmod, root, &s_path_buf);
 out:
-	closedir(d);
+	if (root != NULL)
+		search_dir_free(root);
+	array_free_array(&walk.queue);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+	close(walk.dfd);
 	return err;
 }
 
@@ -1474,7 +2522,7 @@ static int depmod_modules_build_array(struct depmod *depmod)
 		if (err < 0)
 			return err;
 	}
-	if (depmod->modules.count >= UINT16_MAX)
+	if (depmod->modules.count > INT32_MAX)
 		return -ERANGE;
 
 	return 0;
@@ -1506,6 +2554,127 @@ static FILE *dfdopen(const char *dname, const char *filename, int flags, const c
 	return ret;
 }
 
+/*
+ * Add the modules found by the previous run, as listed in its modules.dep,
+ * instead of searching for them again. Returns -ENOENT, before adding any, if
+ * the list is missing or any of its modules doesn't exist anymore.
+ */
+static int depmod_modules_from_dep(struct depmod *depmod)
+{
+	const struct cfg *cfg = depmod->cfg;
+	_cleanup_free_ char *line = NULL;
+	struct array paths;
+	size_t linesz = 0;
+	FILE *fp;
+	int err = 0;
+
+	fp = dfdopen(cfg->outdirname, "modules.dep", O_RDONLY, "r");
+	if (fp == NULL)
+		return -ENOENT;
+
+	array_init(&paths, 1024);
+
+	while (getline(&line, &linesz, fp) > 0) {
+		char *colon = strchr(line, ':');
+		char *path;
+
+		if (colon == NULL)
+			continue;
+		*colon = '\0';
+
+		if (line[0] == '/')
+			path = strdup(line);
+		else if (asprintf(&path, "%s/%s", cfg->dirname, line) < 0)
+			path = NULL;
+
+		if (path == NULL || array_append(&paths, path) < 0) {
+			free(path);
+			err = -ENOMEM;
+			goto out;
+		}
+
+		if (access(path, F_OK) < 0) {
+			DBG("%s doesn't exist anymore\n", path);
+			err = -ENOENT;
+			goto out;
+		}
+	}
+
+	for (size_t i = 0; i < paths.count; i++) {
+		const char *path = paths.array[i];
+		const char *name = strrchr(path, '/') + 1;
+
+		err = depmod_modules_search_file(depmod, name - path, strlen(name), path);
+		if (err < 0)
+			goto out;
+	}
+
+out:
+	for (size_t i = 0; i < paths.count; i++)
+		free(paths.array[i]);
+	array_free_array(&paths);
+	fclose(fp);
+	return err;
+}
+
+/*
+ * Add the modules of the previous run plus the new or changed modules in
+ * @paths, so only these need to be read: the others come from the cache.
+ * Modules that were removed may have hidden another module with the same
+ * name, so then all modules are searched again.
+ */
+static int depmod_modules_update(struct depmod *depmod, char *const paths[],
+				 int n_paths)
+{
+	int err;
+
+	for (int i = 0; i < n_paths; i++) {
+		if (!path_is_under(depmod->cfg, paths[i])) {
+			ERR("%s: not in %s\n", paths[i], depmod->cfg->dirname);
+			return -EINVAL;
+		}
+	}
+
+	for (int i = 0; i < n_paths; i++) {
+		if (access(paths[i], F_OK) == 0)
+			continue;
+
+		if (errno != ENOENT) {
+			err = -errno;
+			ERR("could not access %s: %m\n", paths[i]);
+			return err;
+		}
+
+		WRN("%s doesn't exist, searching all modules\n", paths[i]);
+		return depmod_modules_search(depmod);
+	}
+
+	err = depmod_modules_from_dep(depmod);
+	if (err == -ENOENT) {
+		DBG("modules.dep is out of date, searching all modules\n");
+		return depmod_modules_search(depmod);
+	} else if (err < 0) {
+		return err;
+	}
+
+	for (int i = 0; i < n_paths; i++) {
+		const char *path = paths[i];
+		const char *name = strrchr(path, '/') + 1;
+		size_t namelen = strlen(name);
+
+		if (!path_ends_with_kmod_ext(name, namelen)) {
+			ERR("%s: not a module\n", path);
+			return -EINVAL;
+		}
+
+		err = depmod_modules_search_file(depmod, name - path, namelen, path);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
 static void depmod_modules_sort(struct depmod *depmod)
 {
 	char line[PATH_MAX];
@@ -1552,27 +2721,45 @@ corrupted:
 static int depmod_symbol_add(struct depmod *depmod, const char *name, bool prefix_skipped,
 			     uint64_t crc, const struct mod *owner)
 {
+	struct symbol_table *table = &depmod->symbols;
+	struct symbol_slot *slot;
+	struct symbol *sym;
 	size_t namelen;
+	uint32_t hash;
 	int err;
-	struct symbol *sym;
 
 	if (!prefix_skipped && (name[0] == depmod->cfg->sym_prefix))
 		name++;
 
 	namelen = strlen(name) + 1;
-	sym = malloc(sizeof(struct symbol) + namelen);
+	hash = hash_fnv1a(name, namelen - 1);
+
+	slot = symbol_table_slot(table, name, hash);
+	if (slot->n != 0) {
+		/* the last one to export it wins */
+		sym = table->list[slot->n - 1];
+		goto set;
+	}
+
+	if (table->count == table->n_slots / 4 * 3) {
+		err = symbol_table_reserve(table, (size_t)table->count * 2);
+		if (err < 0)
+			return err;
+		slot = symbol_table_slot(table, name, hash);
+	}
+
+	sym = chunk_alloc(&table->chunks, sizeof(struct symbol) + namelen);
 	if (sym == NULL)
 		return -ENOMEM;
+	memcpy(sym->name, name, namelen);
 
+	table->list[table->count++] = sym;
+	slot->hash = hash;
+	slot->n = table->count;
+
+set:
 	sym->owner = (struct mod *)owner;
 	sym->crc = crc;
-	memcpy(sym->name, name, namelen);
-
-	err = hash_add(depmod->symbols, sym->name, sym);
-	if (err < 0) {
-		free(sym);
-		return err;
-	}
 
 	DBG("add %p sym=%s, owner=%p %s\n", sym, sym->name, owner,
 	    owner != NULL ? owner->path : "");
@@ -1582,527 +2769,1160 @@ static int depmod_symbol_add(struct depmod *depmod, const char *name, bool prefi
 
 static struct symbol *depmod_symbol_find(const struct depmod *depmod, const char *name)
 {
+	const struct symbol_slot *slot;
+
 	if (name[0] == '.') /* PPC64 needs this: .foo == foo */
 		name++;
 	if (name[0] == depmod->cfg->sym_prefix)
 		name++;
-	return hash_find(depmod->symbols, name);
-}
-
-static int depmod_load_modules(struct depmod *depmod)
-{
-	struct mod **itr, **itr_end;
 
-	DBG("load symbols (%zu modules)\n", depmod->modules.count);
+	slot = symbol_table_slot(&depmod->symbols, name, hash_fnv1a(name, strlen(name)));
+	if (slot->n == 0)
+		return NULL;
 
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *mod = *itr;
-		struct kmod_list *l, *list = NULL;
-		int err = kmod_module_get_symbols(mod->kmod, &list);
-		if (err < 0) {
-			if (err == -ENODATA)
-				DBG("ignoring %s: no symbols\n", mod->path);
-			else
-				ERR("failed to load symbols from %s: %s\n", mod->path,
-				    strerror(-err));
-			goto load_info;
-		}
-		kmod_list_foreach(l, list) {
-			const char *name = kmod_module_symbol_get_symbol(l);
-			uint64_t crc = kmod_module_symbol_get_crc(l);
-			depmod_symbol_add(depmod, name, false, crc, mod);
-		}
-		kmod_module_symbols_free_list(list);
-
-load_info:
-		kmod_module_get_info(mod->kmod, &mod->info_list);
-		kmod_list_foreach(l, mod->info_list) {
-			const char *key = kmod_module_info_get_key(l);
-
-			if (streq(key, "alias")) {
-				const char *value = kmod_module_info_get_value(l);
-
-				if (array_append(&mod->alias_values, value) < 0)
-					return 0;
-				continue;
-			}
-			if (streq(key, "softdep")) {
-				const char *value = kmod_module_info_get_value(l);
+	return depmod->symbols.list[slot->n - 1];
+}
 
-				if (array_append(&mod->softdep_values, value) < 0)
-					return 0;
-				continue;
-			}
-			if (streq(key, "weakdep")) {
-				const char *value = kmod_module_info_get_value(l);
+/*
+ * What's read from each module file is kept in modules.depmod-cache.bin, so
+ * modules that didn't change since the last run don't need to be decompressed
+ * and parsed again. The file is a struct cache_header followed by one entry
+ * per module, in host byte order:
+ *
+ *   struct cache_entry
+ *   uint64_t symbol_crcs[n_symbols]
+ *   uint64_t dep_symbol_crcs[n_dep_symbols]
+ *   uint8_t dep_symbol_binds[n_dep_symbols]
+ *   path, symbols, dependency symbols, aliases, softdeps and weakdeps, as
+ *   NUL-terminated strings
+ *   padding to 8 bytes
+ *
+ * An entry is only used if the inode, size and mtime of the module file still
+ * match. Modules read from their files are put in the same format, so after
+ * depmod_load_module() it doesn't matter where they came from.
+ */
+#define CACHE_FILENAME "modules.depmod-cache.bin"
+#define CACHE_MAGIC 0x4b4d4443 /* "KMDC" */
+#define CACHE_VERSION 1
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+};
 
-				if (array_append(&mod->weakdep_values, value) < 0)
-					return 0;
-				continue;
-			}
-		}
-		kmod_module_get_dependency_symbols(mod->kmod, &mod->dep_sym_list);
-		kmod_module_unref(mod->kmod);
-		mod->kmod = NULL;
-	}
+struct cache_entry {
+	uint32_t len;
+	uint32_t n_symbols;
+	uint32_t n_dep_symbols;
+	uint32_t n_info[3]; /* per cache_info_keys */
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
 
-	DBG("loaded symbols (%zu modules, %u symbols)\n", depmod->modules.count,
-	    hash_get_count(depmod->symbols));
+static const char *const cache_info_keys[] = { "alias", "softdep", "weakdep" };
 
-	return 0;
+static inline const uint64_t *cache_entry_symbol_crcs(const struct cache_entry *e)
+{
+	return (const uint64_t *)(e + 1);
 }
 
-static int depmod_load_module_dependencies(struct depmod *depmod, struct mod *mod)
+static inline const uint64_t *cache_entry_dep_symbol_crcs(const struct cache_entry *e)
 {
-	const struct cfg *cfg = depmod->cfg;
-	struct kmod_list *l;
-	int ret = 0;
+	return cache_entry_symbol_crcs(e) + e->n_symbols;
+}
 
-	DBG("do dependencies of %s\n", mod->path);
-	kmod_list_foreach(l, mod->dep_sym_list) {
-		const char *name = kmod_module_dependency_symbol_get_symbol(l);
-		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
-		int bindtype = kmod_module_dependency_symbol_get_bind(l);
-		struct symbol *sym = depmod_symbol_find(depmod, name);
-		uint8_t is_weak = bindtype == KMOD_SYMBOL_WEAK;
-		int err;
+static inline const uint8_t *cache_entry_dep_symbol_binds(const struct cache_entry *e)
+{
+	return (const uint8_t *)(cache_entry_dep_symbol_crcs(e) + e->n_dep_symbols);
+}
 
-		if (sym == NULL) {
-			DBG("%s needs (%c) unknown symbol %s\n", mod->path, bindtype,
-			    name);
-			if (cfg->print_unknown && !is_weak)
-				WRN("%s needs unknown symbol %s\n", mod->path, name);
-			continue;
-		}
+static inline const char *cache_entry_path(const struct cache_entry *e)
+{
+	return (const char *)(cache_entry_dep_symbol_binds(e) + e->n_dep_symbols);
+}
 
-		if (cfg->check_symvers && sym->crc != crc && !is_weak) {
-			DBG("symbol %s (%#" PRIx64 ") module %s (%#" PRIx64 ")\n",
-			    sym->name, sym->crc, mod->path, crc);
-			if (cfg->print_unknown)
-				WRN("%s disagrees about version of symbol %s\n",
-				    mod->path, name);
-		}
+static inline const char *cache_next_str(const char *s)
+{
+	return s + strlen(s) + 1;
+}
 
-		err = mod_add_dependency(mod, sym);
-		if (err < 0)
-			ret = err;
+static int cache_info_kind(const char *key)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(cache_info_keys); i++) {
+		if (streq(key, cache_info_keys[i]))
+			return i;
 	}
 
-	return ret;
+	return -1;
 }
 
-static int depmod_load_dependencies(struct depmod *depmod)
+/* Whether @e is well formed and fits in @len bytes */
+static bool cache_entry_is_valid(const struct cache_entry *e, size_t len)
 {
-	struct mod **itr, **itr_end;
-	int ret = 0;
+	const char *s, *end;
+	uint64_t n_strings;
 
-	DBG("load dependencies (%zu modules, %u symbols)\n", depmod->modules.count,
-	    hash_get_count(depmod->symbols));
+	if (len < sizeof(*e) || e->len < sizeof(*e) || e->len > len || e->len % 8 != 0)
+		return false;
 
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *mod = *itr;
-		int err;
+	if (sizeof(*e) + (uint64_t)e->n_symbols * sizeof(uint64_t) +
+		    (uint64_t)e->n_dep_symbols * (sizeof(uint64_t) + 1) >=
+	    e->len)
+		return false;
 
-		if (mod->dep_sym_list == NULL) {
-			DBG("ignoring %s: no dependency symbols\n", mod->path);
-			continue;
-		}
+	n_strings = 1 + (uint64_t)e->n_symbols + e->n_dep_symbols;
+	for (size_t i = 0; i < ARRAY_SIZE(e->n_info); i++)
+		n_strings += e->n_info[i];
 
-		err = depmod_load_module_dependencies(depmod, mod);
-		if (err < 0)
-			ret = err;
-	}
+	s = cache_entry_path(e);
+	end = (const char *)e + e->len;
+	for (; n_strings > 0; n_strings--) {
+		const char *nul = memchr(s, '\0', end - s);
 
-	DBG("loaded dependencies (%zu modules, %u symbols)\n", depmod->modules.count,
-	    hash_get_count(depmod->symbols));
+		if (nul == NULL)
+			return false;
+		s = nul + 1;
+	}
 
-	return ret;
+	return true;
 }
 
-static int dep_cmp(const void *pa, const void *pb)
+static bool cache_entry_matches(const struct cache_entry *e, const struct stat *st)
 {
-	const struct mod *a = *(const struct mod **)pa;
-	const struct mod *b = *(const struct mod **)pb;
-	return a->dep_sort_idx - b->dep_sort_idx;
+	return e->ino == (uint64_t)st->st_ino && e->size == (uint64_t)st->st_size &&
+	       e->mtime_sec == st->st_mtim.tv_sec && e->mtime_nsec == st->st_mtim.tv_nsec;
 }
 
-static void depmod_sort_dependencies(struct depmod *depmod)
+static struct cache_entry *cache_entry_new(const char *path, const struct stat *st,
+					   struct kmod_list *symbols,
+					   struct kmod_list *dep_symbols,
+					   struct kmod_list *info)
 {
-	struct mod **itr, **itr_end;
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *m = *itr;
-		if (m->deps.count > 1)
-			array_sort(&m->deps, dep_cmp);
+	uint32_t n_symbols = 0, n_dep_symbols = 0, n_info[3] = {};
+	size_t len = sizeof(struct cache_entry) + strlen(path) + 1;
+	struct cache_entry *e;
+	struct kmod_list *l;
+	uint64_t *crc;
+	uint8_t *bind;
+	char *s;
+
+	kmod_list_foreach(l, symbols) {
+		len += sizeof(uint64_t) + strlen(kmod_module_symbol_get_symbol(l)) + 1;
+		n_symbols++;
 	}
-}
+	kmod_list_foreach(l, dep_symbols) {
+		len += sizeof(uint64_t) + 1 +
+		       strlen(kmod_module_dependency_symbol_get_symbol(l)) + 1;
+		n_dep_symbols++;
+	}
+	kmod_list_foreach(l, info) {
+		int kind = cache_info_kind(kmod_module_info_get_key(l));
 
-struct vertex {
-	struct vertex *parent;
-	struct mod *mod;
-};
+		if (kind < 0)
+			continue;
+		len += strlen(kmod_module_info_get_value(l)) + 1;
+		n_info[kind]++;
+	}
 
-static struct vertex *vertex_new(struct mod *mod, struct vertex *parent)
-{
-	struct vertex *v;
+	len = (len + 7) & ~(size_t)7;
+	if (len > UINT32_MAX)
+		return NULL;
 
-	v = malloc(sizeof(*v));
-	if (v == NULL)
+	e = calloc(1, len);
+	if (e == NULL)
 		return NULL;
 
-	v->parent = parent;
-	v->mod = mod;
-	return v;
+	e->len = len;
+	e->n_symbols = n_symbols;
+	e->n_dep_symbols = n_dep_symbols;
+	memcpy(e->n_info, n_info, sizeof(n_info));
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime_sec = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+
+	crc = (uint64_t *)(e + 1);
+	bind = (uint8_t *)(crc + n_symbols + n_dep_symbols);
+	s = (char *)(bind + n_dep_symbols);
+
+	s = stpcpy(s, path) + 1;
+	kmod_list_foreach(l, symbols) {
+		*crc++ = kmod_module_symbol_get_crc(l);
+		s = stpcpy(s, kmod_module_symbol_get_symbol(l)) + 1;
+	}
+	kmod_list_foreach(l, dep_symbols) {
+		*crc++ = kmod_module_dependency_symbol_get_crc(l);
+		*bind++ = kmod_module_dependency_symbol_get_bind(l);
+		s = stpcpy(s, kmod_module_dependency_symbol_get_symbol(l)) + 1;
+	}
+	for (size_t kind = 0; kind < ARRAY_SIZE(cache_info_keys); kind++) {
+		kmod_list_foreach(l, info) {
+			if (streq(kmod_module_info_get_key(l), cache_info_keys[kind]))
+				s = stpcpy(s, kmod_module_info_get_value(l)) + 1;
+		}
+	}
+
+	return e;
 }
 
-static void depmod_list_remove_data(struct kmod_list **list, void *data)
+/* Point the symbols and values of @mod into @e */
+static int mod_set_cache_entry(struct mod *mod, const struct cache_entry *e)
 {
-	struct kmod_list *l;
+	struct array *values[] = {
+		&mod->alias_values,
+		&mod->softdep_values,
+		&mod->weakdep_values,
+	};
+	const char *s;
 
-	l = kmod_list_remove_data(*list, data);
-	*list = l;
-}
+	mod->cache_entry = e;
 
-static int depmod_report_one_cycle(struct vertex *vertex, struct kmod_list **roots,
-				   struct hash *loop_set)
-{
-	const char sep[] = " -> ";
-	size_t sz;
-	char *buf;
-	struct array reverse;
-	int i;
-	int n;
-	struct vertex *v;
-	int rc = 0;
-
-	array_init(&reverse, 3);
-
-	sz = 0;
-	for (v = vertex->parent, n = 0; v != NULL; v = v->parent, n++) {
-		sz += v->mod->modnamesz - 1;
-		rc = array_append(&reverse, v);
-		if (rc < 0)
-			return rc;
-		rc = hash_add(loop_set, v->mod->modname, NULL);
-		if (rc != 0)
-			return rc;
-		/* the hash will be freed where created */
-	}
-	sz += vertex->mod->modnamesz - 1;
-
-	buf = malloc(sz + n * strlen(sep) + 1);
-	if (buf == NULL) {
-		rc = -ENOMEM;
-		goto out;
+	s = cache_next_str(cache_entry_path(e));
+	mod->sym_names = s;
+	for (uint32_t i = 0; i < e->n_symbols; i++)
+		s = cache_next_str(s);
+
+	mod->dep_sym_names = s;
+	for (uint32_t i = 0; i < e->n_dep_symbols; i++)
+		s = cache_next_str(s);
+
+	for (size_t kind = 0; kind < ARRAY_SIZE(values); kind++) {
+		for (uint32_t i = 0; i < e->n_info[kind]; i++) {
+			if (array_append(values[kind], s) < 0)
+				return -ENOMEM;
+			s = cache_next_str(s);
+		}
 	}
 
-	sz = 0;
-	for (i = reverse.count - 1; i >= 0; i--) {
-		size_t len;
+	return 0;
+}
 
-		v = reverse.array[i];
+static void depmod_load_cache(struct depmod *depmod)
+{
+	const struct cfg *cfg = depmod->cfg;
+	const struct cache_header *hdr;
+	char path[PATH_MAX];
+	struct stat st;
+	const uint8_t *p, *end;
+	void *map;
+	int fd;
 
-		len = v->mod->modnamesz - 1;
-		memcpy(buf + sz, v->mod->modname, len);
-		sz += len;
-		strcpy(buf + sz, sep);
-		sz += strlen(sep);
+	if (snprintf(path, sizeof(path), "%s/" CACHE_FILENAME, cfg->outdirname) >=
+	    (int)sizeof(path))
+		return;
 
-		depmod_list_remove_data(roots, v->mod);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		DBG("no cache %s: %m\n", path);
+		return;
 	}
-	strcpy(buf + sz, vertex->mod->modname);
-	ERR("Cycle detected: %s\n", buf);
 
-	free(buf);
-out:
-	array_free_array(&reverse);
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
 
-	return rc;
-}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		DBG("mmap %s: %m\n", path);
+		return;
+	}
 
-static int depmod_report_cycles_from_root(struct mod *root_mod, struct kmod_list **roots,
-					  void **stack, size_t stack_size,
-					  struct hash *loop_set)
-{
-	struct kmod_list *free_list = NULL; /* struct vertex */
-	struct kmod_list *l;
-	struct vertex *root;
-	struct vertex *vertex;
-	struct vertex *v;
-	struct mod *m;
-	struct mod **itr, **itr_end;
-	size_t is;
-	int ret = -ENOMEM;
-
-	root = vertex_new(root_mod, NULL);
-	if (root == NULL) {
-		ERR("No memory to report cycles\n");
-		goto out;
+	hdr = map;
+	if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION) {
+		DBG("ignoring cache %s: unknown format\n", path);
+		goto fail;
 	}
 
-	l = kmod_list_append(free_list, root);
-	if (l == NULL) {
-		ERR("No memory to report cycles\n");
-		free(root);
-		goto out;
+	/*
+	 * Size the hash by the count only if the entries can fit: each one has at
+	 * least its header and a path, padded to 8 bytes
+	 */
+	if (hdr->count > (st.st_size - sizeof(*hdr)) / (sizeof(struct cache_entry) + 8)) {
+		WRN("ignoring corrupted cache %s\n", path);
+		goto fail;
 	}
-	free_list = l;
-
-	is = 0;
-	stack[is++] = (void *)root;
-
-	while (is > 0) {
-		vertex = stack[--is];
-		m = vertex->mod;
-		/*
-		 * because of the topological sort we can start only
-		 * from part of a loop or from a branch after a loop
-		 */
-		if (m->visited && m == root->mod) {
-			int rc;
-			rc = depmod_report_one_cycle(vertex, roots, loop_set);
-			if (rc != 0) {
-				ret = rc;
-				goto out;
-			}
-			continue;
-		}
 
-		m->visited = true;
-		if (m->deps.count == 0) {
-			/*
-			 * boundary condition: if there is more than one
-			 * single node branch (not a loop), it is
-			 * recognized as a loop by the code above:
-			 * m->visited because more then one,
-			 * m == root->mod since it is a single node.
-			 * So, prevent deeping into the branch second
-			 * time.
-			 */
-			depmod_list_remove_data(roots, m);
+	depmod->cache = hash_new(hdr->count, NULL);
+	if (depmod->cache == NULL)
+		goto fail;
 
-			continue;
-		}
+	p = (const uint8_t *)(hdr + 1);
+	end = (const uint8_t *)map + st.st_size;
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		const struct cache_entry *e = (const struct cache_entry *)p;
 
-		itr = (struct mod **)m->deps.array;
-		itr_end = itr + m->deps.count;
-		for (; itr < itr_end; itr++) {
-			struct mod *dep = *itr;
-			v = vertex_new(dep, vertex);
-			if (v == NULL) {
-				ERR("No memory to report cycles\n");
-				goto out;
-			}
-			assert(is < stack_size);
-			stack[is++] = v;
-
-			l = kmod_list_append(free_list, v);
-			if (l == NULL) {
-				ERR("No memory to report cycles\n");
-				free(v);
-				goto out;
-			}
-			free_list = l;
+		if (!cache_entry_is_valid(e, end - p)) {
+			WRN("ignoring corrupted cache %s\n", path);
+			goto fail;
 		}
+
+		if (hash_add(depmod->cache, cache_entry_path(e), e) < 0)
+			goto fail;
+
+		p += e->len;
 	}
-	ret = 0;
 
-out:
-	kmod_list_release(free_list, free);
+	depmod->cache_map = map;
+	depmod->cache_size = st.st_size;
 
-	return ret;
+	DBG("loaded cache %s (%u modules)\n", path, hdr->count);
+	return;
+
+fail:
+	hash_free(depmod->cache);
+	depmod->cache = NULL;
+	munmap(map, st.st_size);
 }
 
-static void depmod_report_cycles(struct depmod *depmod, uint16_t n_mods, uint16_t *users)
+/*
+ * Read the symbols and information of a module, from the cache if it didn't
+ * change or from its file otherwise. This only touches @mod, so it can run in
+ * parallel for different modules, while the results are added to depmod by
+ * depmod_merge_module().
+ */
+static void depmod_load_module(const struct depmod *depmod, struct mod *mod)
 {
-	int num_cyclic = 0;
-	struct kmod_list *roots = NULL; /* struct mod */
-	struct kmod_list *l;
-	size_t n_r; /* local n_roots */
-	int i;
-	int err;
-	_cleanup_free_ void **stack = NULL;
-	struct mod *m;
-	struct mod *root;
-	struct hash *loop_set;
+	struct kmod_list *symbols = NULL, *dep_symbols = NULL, *info = NULL;
+	struct stat st = {};
 
-	for (i = 0, n_r = 0; i < n_mods; i++) {
-		if (users[i] <= 0)
-			continue;
-		m = depmod->modules.array[i];
-		l = kmod_list_append(roots, m);
-		if (l == NULL) {
-			ERR("No memory to report cycles\n");
-			goto out_list;
+	if (stat(mod->path, &st) == 0) {
+		const struct cache_entry *e = NULL;
+
+		if (depmod->cache != NULL)
+			e = hash_find(depmod->cache, mod->path);
+
+		mod->cacheable = true;
+		if (e != NULL && cache_entry_matches(e, &st)) {
+			mod->sym_err = e->n_symbols > 0 ? 0 : -ENODATA;
+			mod->info_err = mod_set_cache_entry(mod, e);
+			return;
 		}
-		roots = l;
-		n_r++;
 	}
 
-	_clang_suppress_alloc_ stack = malloc(n_r * sizeof(void *));
-	if (stack == NULL) {
-		ERR("No memory to report cycles\n");
-		goto out_list;
-	}
+	mod->sym_err = kmod_module_get_symbols(mod->kmod, &symbols);
+	if (mod->sym_err < 0 && mod->sym_err != -ENODATA)
+		mod->cacheable = false;
 
-	loop_set = hash_new(16, NULL);
-	if (loop_set == NULL) {
-		ERR("No memory to report cycles\n");
-		goto out_list;
-	}
+	kmod_module_get_info(mod->kmod, &info);
+	kmod_module_get_dependency_symbols(mod->kmod, &dep_symbols);
 
-	while (roots != NULL) {
-		root = roots->data;
-		l = kmod_list_remove(roots);
-		roots = l;
-		err = depmod_report_cycles_from_root(root, &roots, stack, n_r, loop_set);
-		if (err < 0)
-			goto out_hash;
+	mod->cache_buf = cache_entry_new(mod->path, &st, symbols, dep_symbols, info);
+
+	kmod_module_symbols_free_list(symbols);
+	kmod_module_dependency_symbols_free_list(dep_symbols);
+	kmod_module_info_free_list(info);
+
+	if (mod->cache_buf == NULL) {
+		mod->info_err = -ENOMEM;
+		return;
 	}
 
-	num_cyclic = hash_get_count(loop_set);
-	ERR("Found %d modules in dependency cycles!\n", num_cyclic);
+	mod->info_err = mod_set_cache_entry(mod, mod->cache_buf);
+}
+
+static int depmod_merge_module(struct depmod *depmod, struct mod *mod)
+{
+	const struct cache_entry *e = mod->cache_entry;
+
+	if (mod->sym_err == -ENODATA)
+		DBG("ignoring %s: no symbols\n", mod->path);
+	else if (mod->sym_err < 0)
+		ERR("failed to load symbols from %s: %s\n", mod->path,
+		    strerror(-mod->sym_err));
 
-out_hash:
-	hash_free(loop_set);
-out_list:
-	while (roots != NULL) {
-		/* no need to free data, come from outside */
-		roots = kmod_list_remove(roots);
+	if (e != NULL) {
+		const uint64_t *crcs = cache_entry_symbol_crcs(e);
+		const char *name = mod->sym_names;
+
+		for (uint32_t i = 0; i < e->n_symbols; i++, name = cache_next_str(name))
+			depmod_symbol_add(depmod, name, false, crcs[i], mod);
 	}
+
+	/* releases the module file too, from a single thread: ctx is not thread-safe */
+	kmod_module_unref(mod->kmod);
+	mod->kmod = NULL;
+
+	return mod->info_err;
 }
 
-static int depmod_calculate_dependencies(struct depmod *depmod)
+/*
+ * Modules are handed out to the workers in order, and added to depmod in that
+ * same order by the main thread as soon as they are loaded, so the output
+ * doesn't depend on the number of jobs. Workers can't get too far ahead, so
+ * only a few module files are open at a time.
+ */
+struct depmod_load_pool {
+	struct depmod *depmod;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t next; /* next module to load */
+	size_t merged; /* modules already added to depmod */
+	size_t window; /* modules that can be loaded but not merged */
+};
+
+static void *depmod_load_worker(void *data)
 {
-	const struct mod **itrm;
-	uint16_t *users, *roots, *sorted;
-	uint16_t i, n_roots = 0, n_sorted = 0, n_mods = depmod->modules.count;
-	int ret = 0;
+	struct depmod_load_pool *pool = data;
+	struct mod **mods = (struct mod **)pool->depmod->modules.array;
+	size_t count = pool->depmod->modules.count;
 
-	users = malloc(sizeof(uint16_t) * n_mods * 3);
-	if (users == NULL)
-		return -ENOMEM;
-	roots = users + n_mods;
-	sorted = roots + n_mods;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		struct mod *mod;
+
+		while (pool->next < count && pool->next >= pool->merged + pool->window)
+			pthread_cond_wait(&pool->cond, &pool->lock);
 
-	DBG("calculate dependencies and ordering (%hu modules)\n", n_mods);
+		if (pool->next >= count)
+			break;
 
-	assert(depmod->modules.count < UINT16_MAX);
+		mod = mods[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
 
-	/* populate modules users (how many modules uses it) */
-	itrm = (const struct mod **)depmod->modules.array;
-	for (i = 0; i < n_mods; i++, itrm++) {
-		const struct mod *m = *itrm;
-		users[i] = m->users;
-		if (users[i] == 0) {
-			roots[n_roots] = i;
-			n_roots++;
-		}
+		depmod_load_module(pool->depmod, mod);
+
+		pthread_mutex_lock(&pool->lock);
+		mod->loaded = true;
+		pthread_cond_broadcast(&pool->cond);
 	}
+	pthread_mutex_unlock(&pool->lock);
 
-	/* topological sort (outputs modules without users first) */
-	while (n_roots > 0) {
-		const struct mod **itr_dst, **itr_dst_end;
-		struct mod *src;
-		uint16_t src_idx = roots[--n_roots];
+	return NULL;
+}
 
-		src = depmod->modules.array[src_idx];
-		src->dep_sort_idx = n_sorted;
-		sorted[n_sorted] = src_idx;
-		n_sorted++;
+static int depmod_load_modules_parallel(struct depmod *depmod, unsigned int jobs)
+{
+	struct mod **mods = (struct mod **)depmod->modules.array;
+	size_t count = depmod->modules.count;
+	struct depmod_load_pool pool = {
+		.depmod = depmod,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.window = 4 * jobs,
+	};
+	_cleanup_free_ pthread_t *threads = NULL;
+	unsigned int n_threads = 0;
+	int err = 0;
+	size_t i;
 
-		if (src->deps.count == 0)
-			continue;
+	threads = malloc(jobs * sizeof(*threads));
+	if (threads == NULL)
+		return -ENOMEM;
 
-		itr_dst = (const struct mod **)src->deps.array;
-		itr_dst_end = itr_dst + src->deps.count;
-		for (; itr_dst < itr_dst_end; itr_dst++) {
-			const struct mod *dst = *itr_dst;
-			uint16_t dst_idx = dst->idx;
-			assert(users[dst_idx] > 0);
-			users[dst_idx]--;
-			if (users[dst_idx] == 0) {
-				roots[n_roots] = dst_idx;
-				n_roots++;
-			}
+	for (; n_threads < jobs; n_threads++) {
+		err = pthread_create(&threads[n_threads], NULL, depmod_load_worker, &pool);
+		if (err != 0) {
+			WRN("could not create thread, using %u: %s\n", n_threads,
+			    strerror(err));
+			err = 0;
+			break;
 		}
 	}
 
-	if (n_sorted < n_mods) {
-		depmod_report_cycles(depmod, n_mods, users);
-		ret = -EINVAL;
-		goto exit;
+	/* load what's left here, if no thread could be created */
+	if (n_threads == 0)
+		pool.window = count;
+
+	for (i = 0; i < count && err == 0; i++) {
+		struct mod *mod = mods[i];
+
+		pthread_mutex_lock(&pool.lock);
+		if (n_threads == 0 && pool.next == i) {
+			pool.next++;
+			pthread_mutex_unlock(&pool.lock);
+			depmod_load_module(depmod, mod);
+			pthread_mutex_lock(&pool.lock);
+			mod->loaded = true;
+		}
+		while (!mod->loaded)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		err = depmod_merge_module(depmod, mod);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.merged = i + 1;
+		/* stop handing out modules on error */
+		if (err < 0)
+			pool.next = count;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
 	}
 
-	depmod_sort_dependencies(depmod);
+	for (unsigned int t = 0; t < n_threads; t++)
+		pthread_join(threads[t], NULL);
 
-	DBG("calculated dependencies and ordering (%hu modules)\n", n_mods);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
 
-exit:
-	free(users);
-	return ret;
+	return err;
 }
 
-static int depmod_load(struct depmod *depmod)
+static int depmod_load_modules(struct depmod *depmod)
 {
-	int err;
+	unsigned int jobs = depmod->cfg->jobs;
+	int err = 0;
 
-	err = depmod_load_modules(depmod);
-	if (err < 0)
-		return err;
+	if (jobs > depmod->modules.count)
+		jobs = depmod->modules.count;
 
-	err = depmod_load_dependencies(depmod);
+	DBG("load symbols (%zu modules, %u jobs)\n", depmod->modules.count, jobs);
+
+	err = symbol_table_reserve(&depmod->symbols,
+				   depmod->symbols.count +
+					   depmod->modules.count * SYMBOLS_PER_MODULE);
 	if (err < 0)
 		return err;
 
-	err = depmod_calculate_dependencies(depmod);
+	if (jobs > 1) {
+		err = depmod_load_modules_parallel(depmod, jobs);
+	} else {
+		for (size_t i = 0; i < depmod->modules.count && err == 0; i++) {
+			struct mod *mod = depmod->modules.array[i];
+
+			depmod_load_module(depmod, mod);
+			err = depmod_merge_module(depmod, mod);
+		}
+	}
+
 	if (err < 0)
 		return err;
 
+	DBG("loaded symbols (%zu modules, %u symbols)\n", depmod->modules.count,
+	    depmod->symbols.count);
+
 	return 0;
 }
 
-static int mod_fill_all_unique_dependencies(const struct mod *mod, struct array *deps)
+static int depmod_load_module_dependencies(struct depmod *depmod, struct mod *mod)
 {
-	size_t i;
-	int err = 0;
+	const struct cfg *cfg = depmod->cfg;
+	const struct cache_entry *e = mod->cache_entry;
+	const uint64_t *crcs = cache_entry_dep_symbol_crcs(e);
+	const uint8_t *binds = cache_entry_dep_symbol_binds(e);
+	const char *name = mod->dep_sym_names;
+	int ret = 0;
+
+	DBG("do dependencies of %s\n", mod->path);
+	for (uint32_t i = 0; i < e->n_dep_symbols; i++, name = cache_next_str(name)) {
+		uint64_t crc = crcs[i];
+		int bindtype = binds[i];
+		struct symbol *sym = depmod_symbol_find(depmod, name);
+		uint8_t is_weak = bindtype == KMOD_SYMBOL_WEAK;
+		int err;
 
-	for (i = 0; i < mod->deps.count; i++) {
-		const struct mod *d = mod->deps.array[i];
+		if (sym == NULL) {
+			DBG("%s needs (%c) unknown symbol %s\n", mod->path, bindtype,
+			    name);
+			if (cfg->print_unknown && !is_weak)
+				WRN("%s needs unknown symbol %s\n", mod->path, name);
+			continue;
+		}
 
-		err = array_append_unique(deps, d);
-		if (err < 0) {
-			if (err == -EEXIST) {
-				err = 0;
-				continue;
-			}
-			return err;
+		if (cfg->check_symvers && sym->crc != crc && !is_weak) {
+			DBG("symbol %s (%#" PRIx64 ") module %s (%#" PRIx64 ")\n",
+			    sym->name, sym->crc, mod->path, crc);
+			if (cfg->print_unknown)
+				WRN("%s disagrees about version of symbol %s\n",
+				    mod->path, name);
 		}
 
-		err = mod_fill_all_unique_dependencies(d, deps);
+		err = mod_add_dependency(depmod, mod, sym);
 		if (err < 0)
-			break;
+			ret = err;
 	}
-	return err;
+
+	return ret;
 }
 
-static bool mod_get_all_sorted_dependencies(const struct mod *mod, struct array *deps)
+static int depmod_load_dependencies(struct depmod *depmod)
 {
-	deps->count = 0;
-	if (mod_fill_all_unique_dependencies(mod, deps) < 0)
-		return false;
+	struct mod_graph *graph = &depmod->graph;
+	size_t n_mods = depmod->modules.count;
+	int ret = 0;
 
-	if (deps->count > 1)
-		array_sort(deps, dep_cmp);
-	return true;
-}
+	DBG("load dependencies (%zu modules, %u symbols)\n", depmod->modules.count,
+	    depmod->symbols.count);
 
-static inline const char *mod_get_compressed_path(const struct mod *mod)
+	graph->deps_start = malloc((n_mods + 1) * sizeof(*graph->deps_start));
+	if (graph->deps_start == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < n_mods; i++) {
+		struct mod *mod = depmod->modules.array[i];
+		int err;
+
+		graph->deps_start[i] = graph->n_deps;
+
+		if (mod->cache_entry == NULL || mod->cache_entry->n_dep_symbols == 0) {
+			DBG("ignoring %s: no dependency symbols\n", mod->path);
+			continue;
+		}
+
+		err = depmod_load_module_dependencies(depmod, mod);
+		if (err < 0)
+			ret = err;
+	}
+	graph->deps_start[n_mods] = graph->n_deps;
+
+	DBG("loaded dependencies (%zu modules, %u symbols)\n", depmod->modules.count,
+	    depmod->symbols.count);
+
+	return ret;
+}
+
+struct scc_vertex {
+	uint32_t index; /* in visit order, 0 if not visited */
+	uint32_t lowlink;
+	uint32_t next_dep; /* to visit */
+	bool on_stack;
+};
+
+static int u32_cmp(const void *pa, const void *pb)
+{
+	uint32_t a = *(const uint32_t *)pa, b = *(const uint32_t *)pb;
+	return a < b ? -1 : a > b;
+}
+
+/*
+ * Strongly connected components of the dependency graph, in the order Tarjan's
+ * algorithm finds them: a component only after all of its dependencies. The
+ * members of component c are members[scc_start[c]..scc_start[c + 1]].
+ */
+struct mod_sccs {
+	uint32_t *scc; /* component of each module */
+	uint32_t *members;
+	uint32_t *scc_start;
+};
+
+static bool mod_sccs_is_cycle(const struct mod_sccs *sccs, const struct mod_graph *graph,
+			      uint32_t v)
+{
+	uint32_t c = sccs->scc[v];
+
+	return sccs->scc_start[c + 1] - sccs->scc_start[c] > 1 ||
+	       mod_graph_depends_on(graph, v, v);
+}
+
+/*
+ * Modules left to report cycles for, in a circular list in the order of the
+ * modules. Cycles have always been reported starting from its head, which
+ * moves to the next module on each removal.
+ */
+struct cycle_list {
+	uint32_t *next; /* UINT32_MAX if not in the list */
+	uint32_t *prev;
+	uint32_t head; /* UINT32_MAX if empty */
+};
+
+static void cycle_list_remove(struct cycle_list *list, uint32_t v)
+{
+	uint32_t next = list->next[v];
+
+	if (next == UINT32_MAX)
+		return;
+
+	if (next == v) {
+		list->head = UINT32_MAX;
+	} else {
+		list->next[list->prev[v]] = next;
+		list->prev[next] = list->prev[v];
+		list->head = next;
+	}
+	list->next[v] = UINT32_MAX;
+}
+
+/* State of the search for the cycles of one component, indexed by mod->idx */
+struct cycle_search {
+	uint32_t *rank; /* order of the members of the component, UINT32_MAX if not */
+	bool *blocked;
+	struct array *blocking; /* struct mod, to unblock with each module */
+	uint32_t *path;
+	size_t *next_dep; /* of each module in path, to visit backwards */
+	bool *found;
+	uint32_t *unblock;
+	uint32_t *order;
+};
+
+static void cycle_search_unblock(struct cycle_search *s, uint32_t v)
+{
+	size_t n = 0;
+
+	s->blocked[v] = false;
+	s->unblock[n++] = v;
+	while (n > 0) {
+		struct array *b = &s->blocking[s->unblock[--n]];
+
+		for (size_t i = 0; i < b->count; i++) {
+			uint32_t w = ((struct mod *)b->array[i])->idx;
+
+			if (s->blocked[w]) {
+				s->blocked[w] = false;
+				s->unblock[n++] = w;
+			}
+		}
+		b->count = 0;
+	}
+}
+
+static void depmod_report_one_cycle(struct depmod *depmod, struct cycle_list *list,
+				    const uint32_t *path, size_t n_path)
+{
+	struct mod **mods = (struct mod **)depmod->modules.array;
+	DECLARE_STRBUF_WITH_STACK(buf, 256);
+
+	for (size_t i = 0; i < n_path; i++) {
+		strbuf_pushchars(&buf, mods[path[i]]->modname);
+		strbuf_pushchars(&buf, " -> ");
+		cycle_list_remove(list, path[i]);
+	}
+	strbuf_pushchars(&buf, mods[path[0]]->modname);
+	ERR("Cycle detected: %s\n", strbuf_str(&buf));
+}
+
+/*
+ * Report every elementary cycle of the component of @root once, with Johnson's
+ * algorithm: each member in turn, starting from @root and in the order of the
+ * modules, is the first one of the cycles through it and the members after it.
+ * Dependencies are visited backwards, as cycles have always been reported.
+ */
+static void depmod_report_scc_cycles(struct depmod *depmod, const struct mod_sccs *sccs,
+				     struct cycle_list *list, struct cycle_search *s,
+				     uint32_t root)
+{
+	const struct mod_graph *graph = &depmod->graph;
+	struct mod **mods = (struct mod **)depmod->modules.array;
+	size_t n_mods = depmod->modules.count;
+	uint32_t c = sccs->scc[root];
+	const uint32_t *members = sccs->members + sccs->scc_start[c];
+	size_t n_members = sccs->scc_start[c + 1] - sccs->scc_start[c];
+
+	/* the order of the modules, going around from root */
+	for (size_t i = 0; i < n_members; i++) {
+		uint32_t v = members[i];
+
+		s->rank[v] = v >= root ? v - root : v + n_mods - root;
+		s->order[i] = s->rank[v];
+	}
+	qsort(s->order, n_members, sizeof(*s->order), u32_cmp);
+
+	for (size_t k = 0; k < n_members; k++) {
+		uint32_t start = s->order[k];
+		uint32_t first = (root + start) % n_mods;
+		size_t n_path = 0;
+
+		for (size_t i = 0; i < n_members; i++) {
+			s->blocked[members[i]] = false;
+			s->blocking[members[i]].count = 0;
+		}
+		s->path[n_path] = first;
+		s->next_dep[n_path] = mod_graph_n_deps(graph, first);
+		s->found[n_path] = false;
+		s->blocked[first] = true;
+		n_path++;
+
+		while (n_path > 0) {
+			uint32_t v = s->path[n_path - 1];
+			const uint32_t *deps = mod_graph_deps(graph, v);
+			bool found;
+
+			if (s->next_dep[n_path - 1] > 0) {
+				uint32_t w = deps[--s->next_dep[n_path - 1]];
+
+				if (s->rank[w] == UINT32_MAX || s->rank[w] < start)
+					continue;
+
+				if (w == first) {
+					depmod_report_one_cycle(depmod, list, s->path,
+								n_path);
+					s->found[n_path - 1] = true;
+				} else if (!s->blocked[w]) {
+					s->path[n_path] = w;
+					s->next_dep[n_path] = mod_graph_n_deps(graph, w);
+					s->found[n_path] = false;
+					s->blocked[w] = true;
+					n_path++;
+				}
+				continue;
+			}
+
+			found = s->found[--n_path];
+			if (found) {
+				cycle_search_unblock(s, v);
+				if (n_path > 0)
+					s->found[n_path - 1] = true;
+				continue;
+			}
+
+			for (size_t i = 0; i < mod_graph_n_deps(graph, v); i++) {
+				uint32_t w = deps[i];
+
+				if (s->rank[w] != UINT32_MAX && s->rank[w] >= start)
+					array_append_unique(&s->blocking[w], mods[v]);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < n_members; i++)
+		s->rank[members[i]] = UINT32_MAX;
+}
+
+/*
+ * Report the cycles found among the modules. Like it has always been done, the
+ * modules in a cycle or depending on one are gone through in order, leaving
+ * out the ones already reported, and the cycles of each one's component are
+ * reported.
+ */
+static void depmod_report_cycles(struct depmod *depmod, const struct mod_sccs *sccs)
+{
+	const struct mod_graph *graph = &depmod->graph;
+	size_t n_mods = depmod->modules.count;
+	_cleanup_free_ uint32_t *next = NULL;
+	_cleanup_free_ uint32_t *prev = NULL;
+	_cleanup_free_ bool *left = NULL;
+	_cleanup_free_ uint32_t *rank = NULL;
+	_cleanup_free_ bool *blocked = NULL;
+	_cleanup_free_ struct array *blocking = NULL;
+	_cleanup_free_ uint32_t *path = NULL;
+	_cleanup_free_ size_t *next_dep = NULL;
+	_cleanup_free_ bool *found = NULL;
+	_cleanup_free_ uint32_t *unblock = NULL;
+	_cleanup_free_ uint32_t *order = NULL;
+	struct cycle_list list = { .head = UINT32_MAX };
+	struct cycle_search s;
+	uint32_t last = UINT32_MAX;
+	size_t n_cyclic = 0;
+
+	next = malloc(n_mods * sizeof(*next));
+	prev = malloc(n_mods * sizeof(*prev));
+	left = calloc(n_mods, sizeof(*left));
+	rank = malloc(n_mods * sizeof(*rank));
+	blocked = malloc(n_mods * sizeof(*blocked));
+	blocking = malloc(n_mods * sizeof(*blocking));
+	path = malloc(n_mods * sizeof(*path));
+	next_dep = malloc(n_mods * sizeof(*next_dep));
+	found = malloc(n_mods * sizeof(*found));
+	unblock = malloc(n_mods * sizeof(*unblock));
+	order = malloc(n_mods * sizeof(*order));
+	if (next == NULL || prev == NULL || left == NULL || rank == NULL ||
+	    blocked == NULL || blocking == NULL || path == NULL || next_dep == NULL ||
+	    found == NULL || unblock == NULL || order == NULL) {
+		ERR("No memory to report cycles\n");
+		return;
+	}
+
+	/* components are found after their dependencies: go from the users */
+	for (size_t i = n_mods; i-- > 0;) {
+		uint32_t v = sccs->members[i];
+		const uint32_t *deps = mod_graph_deps(graph, v);
+
+		if (mod_sccs_is_cycle(sccs, graph, v)) {
+			left[v] = true;
+			n_cyclic++;
+		}
+		if (!left[v])
+			continue;
+
+		for (size_t j = 0; j < mod_graph_n_deps(graph, v); j++)
+			left[deps[j]] = true;
+	}
+
+	for (uint32_t v = 0; v < n_mods; v++) {
+		next[v] = UINT32_MAX;
+		rank[v] = UINT32_MAX;
+		array_init(&blocking[v], 4);
+		if (!left[v])
+			continue;
+
+		if (list.head == UINT32_MAX) {
+			list.head = v;
+		} else {
+			next[last] = v;
+			prev[v] = last;
+		}
+		last = v;
+	}
+	if (last != UINT32_MAX) {
+		next[last] = list.head;
+		prev[list.head] = last;
+	}
+	list.next = next;
+	list.prev = prev;
+
+	s = (struct cycle_search){
+		.rank = rank,
+		.blocked = blocked,
+		.blocking = blocking,
+		.path = path,
+		.next_dep = next_dep,
+		.found = found,
+		.unblock = unblock,
+		.order = order,
+	};
+
+	/* left is now whether a module was gone through */
+	memset(left, 0, n_mods * sizeof(*left));
+
+	while (list.head != UINT32_MAX) {
+		uint32_t root = list.head;
+		size_t n = 0;
+
+		cycle_list_remove(&list, root);
+
+		/* modules without dependencies are left out as they are found */
+		path[n++] = root;
+		while (n > 0) {
+			uint32_t v = path[--n];
+			const uint32_t *deps = mod_graph_deps(graph, v);
+
+			if (left[v])
+				continue;
+			left[v] = true;
+
+			if (mod_graph_n_deps(graph, v) == 0)
+				cycle_list_remove(&list, v);
+
+			for (size_t j = 0; j < mod_graph_n_deps(graph, v); j++) {
+				if (!left[deps[j]])
+					path[n++] = deps[j];
+			}
+		}
+
+		if (mod_sccs_is_cycle(sccs, graph, root))
+			depmod_report_scc_cycles(depmod, sccs, &list, &s, root);
+	}
+
+	for (size_t i = 0; i < n_mods; i++)
+		array_free_array(&blocking[i]);
+
+	ERR("Found %zu modules in dependency cycles!\n", n_cyclic);
+}
+
+/*
+ * Sort the modules topologically, users before their dependencies, with an
+ * iterative version of Tarjan's algorithm: the strongly connected components
+ * are found after all of their dependencies, so they are sorted from the last
+ * one. A component with more than one module, or one depending on itself, is a
+ * cycle.
+ */
+static int depmod_calculate_dependencies(struct depmod *depmod)
+{
+	struct mod_graph *graph = &depmod->graph;
+	size_t n_mods = depmod->modules.count;
+	_cleanup_free_ struct scc_vertex *vertices = NULL;
+	_cleanup_free_ uint32_t *calls = NULL;
+	_cleanup_free_ uint32_t *stack = NULL;
+	_cleanup_free_ uint32_t *scc = NULL;
+	_cleanup_free_ uint32_t *members = NULL;
+	_cleanup_free_ uint32_t *scc_start = NULL;
+	struct mod_sccs sccs;
+	size_t n_calls = 0, n_stack = 0, n_members = 0, n_sccs = 0;
+	uint32_t counter = 0;
+	bool cycles = false;
+
+	DBG("calculate dependencies and ordering (%zu modules)\n", n_mods);
+
+	graph->dep_sort_idx = malloc(n_mods * sizeof(*graph->dep_sort_idx));
+	vertices = calloc(n_mods, sizeof(*vertices));
+	calls = malloc(n_mods * sizeof(*calls));
+	stack = malloc(n_mods * sizeof(*stack));
+	scc = malloc(n_mods * sizeof(*scc));
+	members = malloc(n_mods * sizeof(*members));
+	scc_start = malloc((n_mods + 1) * sizeof(*scc_start));
+	if (graph->dep_sort_idx == NULL || vertices == NULL || calls == NULL ||
+	    stack == NULL || scc == NULL || members == NULL || scc_start == NULL)
+		return -ENOMEM;
+
+	scc_start[0] = 0;
+
+	for (size_t i = 0; i < n_mods; i++) {
+		if (vertices[i].index != 0)
+			continue;
+
+		calls[n_calls++] = i;
+		while (n_calls > 0) {
+			uint32_t v = calls[n_calls - 1];
+			struct scc_vertex *sv = &vertices[v];
+			uint32_t w;
+
+			if (sv->index == 0) {
+				sv->index = sv->lowlink = ++counter;
+				sv->on_stack = true;
+				stack[n_stack++] = v;
+			}
+
+			if (sv->next_dep < mod_graph_n_deps(graph, v)) {
+				w = mod_graph_deps(graph, v)[sv->next_dep++];
+				if (vertices[w].index == 0)
+					calls[n_calls++] = w;
+				else if (vertices[w].on_stack && vertices[w].index < sv->lowlink)
+					sv->lowlink = vertices[w].index;
+				continue;
+			}
+
+			n_calls--;
+			if (n_calls > 0) {
+				struct scc_vertex *parent = &vertices[calls[n_calls - 1]];
+
+				if (sv->lowlink < parent->lowlink)
+					parent->lowlink = sv->lowlink;
+			}
+
+			if (sv->lowlink != sv->index)
+				continue;
+
+			/* v is the first visited module of a component */
+			do {
+				w = stack[--n_stack];
+				vertices[w].on_stack = false;
+				scc[w] = n_sccs;
+				members[n_members++] = w;
+				graph->dep_sort_idx[w] = n_mods - n_members;
+			} while (w != v);
+			scc_start[++n_sccs] = n_members;
+
+			if (scc_start[n_sccs] - scc_start[n_sccs - 1] > 1 ||
+			    mod_graph_depends_on(graph, v, v))
+				cycles = true;
+		}
+	}
+
+	if (cycles) {
+		sccs = (struct mod_sccs){
+			.scc = scc,
+			.members = members,
+			.scc_start = scc_start,
+		};
+		depmod_report_cycles(depmod, &sccs);
+		return -EINVAL;
+	}
+
+	DBG("calculated dependencies and ordering (%zu modules)\n", n_mods);
+
+	return 0;
+}
+
+/*
+ * Compute the transitive dependencies of all modules at once. Dependencies
+ * sort after their users, so going from the last module to the first one, the
+ * dependencies of each module are already done and it only needs to merge
+ * their bitmaps. For the same reason, the bitmap of a module only needs to
+ * start at its first dependency.
+ */
+static int depmod_calculate_all_dependencies(struct depmod *depmod)
+{
+	struct mod_graph *graph = &depmod->graph;
+	size_t n_mods = depmod->modules.count;
+	size_t n_words = (n_mods + 63) / 64;
+
+	graph->by_dep_sort = malloc(n_mods * sizeof(*graph->by_dep_sort));
+	graph->all_deps = calloc(n_mods, sizeof(*graph->all_deps));
+	graph->all_deps_start = calloc(n_mods, sizeof(*graph->all_deps_start));
+	if (graph->by_dep_sort == NULL || graph->all_deps == NULL ||
+	    graph->all_deps_start == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < n_mods; i++)
+		graph->by_dep_sort[graph->dep_sort_idx[i]] = i;
+
+	for (size_t i = n_mods; i-- > 0;) {
+		uint32_t v = graph->by_dep_sort[i];
+		const uint32_t *deps = mod_graph_deps(graph, v);
+		size_t n_deps = mod_graph_n_deps(graph, v);
+		uint32_t first = UINT32_MAX;
+		uint64_t *bits;
+		size_t start;
+
+		if (n_deps == 0)
+			continue;
+
+		for (size_t j = 0; j < n_deps; j++) {
+			if (graph->dep_sort_idx[deps[j]] < first)
+				first = graph->dep_sort_idx[deps[j]];
+		}
+		start = first / 64;
+
+		bits = calloc(n_words - start, sizeof(uint64_t));
+		if (bits == NULL)
+			return -ENOMEM;
+		graph->all_deps[v] = bits;
+		graph->all_deps_start[v] = start;
+
+		for (size_t j = 0; j < n_deps; j++) {
+			uint32_t d = deps[j];
+			size_t idx = graph->dep_sort_idx[d];
+			const uint64_t *d_bits = graph->all_deps[d];
+
+			bits[idx / 64 - start] |= 1ULL << (idx % 64);
+
+			if (d_bits == NULL)
+				continue;
+
+			for (size_t w = graph->all_deps_start[d]; w < n_words; w++)
+				bits[w - start] |= d_bits[w - graph->all_deps_start[d]];
+		}
+	}
+
+	return 0;
+}
+
+static int depmod_load(struct depmod *depmod)
+{
+	int err;
+
+	err = depmod_load_modules(depmod);
+	if (err < 0)
+		return err;
+
+	err = depmod_load_dependencies(depmod);
+	if (err < 0)
+		return err;
+
+	err = depmod_calculate_dependencies(depmod);
+	if (err < 0)
+		return err;
+
+	err = depmod_calculate_all_dependencies(depmod);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+static bool mod_get_all_sorted_dependencies(const struct depmod *depmod,
+					    const struct mod *mod, struct array *deps)
+{
+	const struct mod_graph *graph = &depmod->graph;
+	size_t n_words = (depmod->modules.count + 63) / 64;
+	const uint64_t *all_deps = graph->all_deps[mod->idx];
+	size_t start = graph->all_deps_start[mod->idx];
+
+	deps->count = 0;
+	if (all_deps == NULL)
+		return true;
+
+	for (size_t w = start; w < n_words; w++) {
+		uint64_t bits = all_deps[w - start];
+
+		for (; bits != 0; bits &= bits - 1) {
+			size_t idx = w * 64 + __builtin_ctzll(bits);
+			uint32_t d = graph->by_dep_sort[idx];
+
+			if (array_append(deps, depmod->modules.array[d]) < 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static inline const char *mod_get_compressed_path(const struct mod *mod)
 {
 	if (mod->relpath != NULL)
 		return mod->relpath;
@@ -2123,10 +3943,10 @@ static int output_deps(struct depmod *depmod, FILE *out)
 
 		fprintf(out, "%s:", p);
 
-		if (mod->deps.count == 0)
+		if (mod_graph_n_deps(&depmod->graph, mod->idx) == 0)
 			goto end;
 
-		if (!mod_get_all_sorted_dependencies(mod, &deps)) {
+		if (!mod_get_all_sorted_dependencies(depmod, mod, &deps)) {
 			ERR("could not get all sorted dependencies of %s\n", p);
 			goto end;
 		}
@@ -2146,7 +3966,7 @@ end:
 static int output_deps_bin(struct depmod *depmod, FILE *out)
 {
 	DECLARE_STRBUF_WITH_STACK(sbuf, 2048);
-	struct index_node *idx;
+	struct index_trie *idx;
 	size_t i;
 	struct array array;
 
@@ -2166,7 +3986,7 @@ static int output_deps_bin(struct depmod *depmod, FILE *out)
 		size_t j;
 		int duplicate;
 
-		if (!mod_get_all_sorted_dependencies(mod, &array)) {
+		if (!mod_get_all_sorted_dependencies(depmod, mod, &array)) {
 			ERR("could not get all sorted dependencies of %s\n", p);
 			continue;
 		}
@@ -2194,7 +4014,7 @@ static int output_deps_bin(struct depmod *depmod, FILE *out)
 	}
 
 	array_free_array(&array);
-	index_write(idx, out);
+	index_write(idx, NULL, out, true);
 	index_destroy(idx);
 
 	return 0;
@@ -2221,7 +4041,8 @@ static int output_aliases(struct depmod *depmod, FILE *out)
 
 static int output_aliases_bin(struct depmod *depmod, FILE *out)
 {
-	struct index_node *idx;
+	struct index_trie *idx;
+	struct index_patterns *patterns;
 	size_t i;
 
 	if (out == stdout)
@@ -2231,6 +4052,12 @@ static int output_aliases_bin(struct depmod *depmod, FILE *out)
 	if (idx == NULL)
 		return -ENOMEM;
 
+	patterns = index_patterns_new();
+	if (patterns == NULL) {
+		index_destroy(idx);
+		return -ENOMEM;
+	}
+
 	for (i = 0; i < depmod->modules.count; i++) {
 		const struct mod *mod = depmod->modules.array[i];
 		const struct array *values = &mod->alias_values;
@@ -2251,10 +4078,13 @@ static int output_aliases_bin(struct depmod *depmod, FILE *out)
 			if (duplicate && depmod->cfg->warn_dups)
 				WRN("duplicate module alias:\n%s %s\n", alias,
 				    mod->modname);
+
+			index_patterns_insert(patterns, alias, mod->modname, mod->idx);
 		}
 	}
 
-	index_write(idx, out);
+	index_write(idx, patterns, out, false);
+	index_patterns_free(patterns);
 	index_destroy(idx);
 
 	return 0;
@@ -2300,15 +4130,10 @@ static int output_weakdeps(struct depmod *depmod, FILE *out)
 
 static int output_symbols(struct depmod *depmod, FILE *out)
 {
-	struct hash_iter iter;
-	const void *v;
-
 	fputs("# Aliases for symbols, used by symbol_request().\n", out);
 
-	hash_iter_init(depmod->symbols, &iter);
-
-	while (hash_iter_next(&iter, NULL, &v)) {
-		const struct symbol *sym = v;
+	for (uint32_t i = 0; i < depmod->symbols.count; i++) {
+		const struct symbol *sym = depmod->symbols.list[i];
 		if (sym->owner == NULL)
 			continue;
 
@@ -2321,11 +4146,9 @@ static int output_symbols(struct depmod *depmod, FILE *out)
 static int output_symbols_bin(struct depmod *depmod, FILE *out)
 {
 	DECLARE_STRBUF_WITH_STACK(salias, 1024);
-	struct index_node *idx;
+	struct index_trie *idx;
 	const char *base = "symbol:";
 	const size_t baselen = strlen(base);
-	struct hash_iter iter;
-	const void *v;
 	int ret = 0;
 
 	if (out == stdout)
@@ -2335,13 +4158,11 @@ static int output_symbols_bin(struct depmod *depmod, FILE *out)
 	if (idx == NULL)
 		return -ENOMEM;
 
-	hash_iter_init(depmod->symbols, &iter);
-
 	strbuf_pushchars(&salias, base);
 
-	while (hash_iter_next(&iter, NULL, &v)) {
+	for (uint32_t i = 0; i < depmod->symbols.count; i++) {
 		int duplicate;
-		const struct symbol *sym = v;
+		const struct symbol *sym = depmod->symbols.list[i];
 
 		if (sym->owner == NULL)
 			continue;
@@ -2361,7 +4182,7 @@ static int output_symbols_bin(struct depmod *depmod, FILE *out)
 			    sym->owner->modname);
 	}
 
-	index_write(idx, out);
+	index_write(idx, NULL, out, false);
 
 err_alloc:
 	index_destroy(idx);
@@ -2375,7 +4196,7 @@ err_alloc:
 static int output_builtin_bin(struct depmod *depmod, FILE *out)
 {
 	FILE *in;
-	struct index_node *idx;
+	struct index_trie *idx;
 	char line[PATH_MAX], modname[PATH_MAX];
 
 	if (out == stdout)
@@ -2401,7 +4222,7 @@ static int output_builtin_bin(struct depmod *depmod, FILE *out)
 		index_insert(idx, modname, "", 0);
 	}
 
-	index_write(idx, out);
+	index_write(idx, NULL, out, true);
 	index_destroy(idx);
 	fclose(in);
 
@@ -2440,7 +4261,8 @@ static int flush_stream_to(FILE *in, int endchar, char *dst, size_t dst_sz)
 static int output_builtin_alias_bin(struct depmod *depmod, FILE *out)
 {
 	FILE *in;
-	struct index_node *idx;
+	struct index_trie *idx;
+	struct index_patterns *patterns;
 	int ret;
 
 	if (out == stdout)
@@ -2456,6 +4278,13 @@ static int output_builtin_alias_bin(struct depmod *depmod, FILE *out)
 		return -ENOMEM;
 	}
 
+	patterns = index_patterns_new();
+	if (patterns == NULL) {
+		index_destroy(idx);
+		fclose(in);
+		return -ENOMEM;
+	}
+
 	/* format: modname.key=value\0 */
 	while (!feof(in) && !ferror(in)) {
 		char alias[PATH_MAX];
@@ -2487,15 +4316,17 @@ static int output_builtin_alias_bin(struct depmod *depmod, FILE *out)
 		}
 
 		index_insert(idx, alias, modname, 0);
+		index_patterns_insert(patterns, alias, modname, 0);
 	}
 
 	if (ferror(in)) {
 		ret = -EINVAL;
 	} else {
-		index_write(idx, out);
+		index_write(idx, patterns, out, false);
 		ret = 0;
 	}
 
+	index_patterns_free(patterns);
 	index_destroy(idx);
 	fclose(in);
 
@@ -2554,90 +4385,367 @@ static int output_devname(struct depmod *depmod, FILE *out)
 	return 0;
 }
 
-static int depmod_output(struct depmod *depmod, FILE *out)
+/*
+ * Whether the temporary file @tmpname is the same as the file @name it would
+ * replace. Keeping the existing file in that case doesn't change its inode and
+ * mtime, so programs using the indexes don't reload them.
+ */
+static bool depmod_file_is_unchanged(int dfd, const char *name, const char *tmpname)
 {
-	static const struct depfile {
-		const char *name;
-		int (*cb)(struct depmod *depmod, FILE *out);
-	} *itr, depfiles[] = {
-		{ "modules.dep", output_deps },
-		{ "modules.dep.bin", output_deps_bin },
-		{ "modules.alias", output_aliases },
-		{ "modules.alias.bin", output_aliases_bin },
-		{ "modules.softdep", output_softdeps },
-		{ "modules.weakdep", output_weakdeps },
-		{ "modules.symbols", output_symbols },
-		{ "modules.symbols.bin", output_symbols_bin },
-		{ "modules.builtin.bin", output_builtin_bin },
-		{ "modules.builtin.alias.bin", output_builtin_alias_bin },
-		{ "modules.devname", output_devname },
-		{},
-	};
-	const char *dname = depmod->cfg->outdirname;
-	int dfd, err = 0;
+	void *old = MAP_FAILED, *new = MAP_FAILED;
+	struct stat st_old, st_new;
+	int fd_old, fd_new = -1;
+	bool same = false;
 
-	if (out != NULL)
-		dfd = -1;
-	else {
-		err = mkdir_p(dname, strlen(dname), 0755);
-		if (err < 0) {
-			CRIT("could not create directory %s: %s\n", dname, strerror(-err));
-			return err;
-		}
-		dfd = open(dname, O_RDONLY);
-		if (dfd < 0) {
-			err = -errno;
-			CRIT("could not open directory %s: %m\n", dname);
-			return err;
-		}
-	}
+	fd_old = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd_old < 0)
+		return false;
 
-	for (itr = depfiles; itr->name != NULL; itr++) {
-		FILE *fp = out;
-		struct tmpfile file;
-		int r, ferr;
+	fd_new = openat(dfd, tmpname, O_RDONLY | O_CLOEXEC);
+	if (fd_new < 0)
+		goto out;
 
-		if (fp == NULL) {
-			mode_t mode = 0644;
+	if (fstat(fd_old, &st_old) < 0 || fstat(fd_new, &st_new) < 0)
+		goto out;
 
-			fp = tmpfile_openat(dfd, mode, &file);
-			if (fp == NULL) {
-				ERR("Could not create temporary file at '%s'\n", dname);
-				continue;
-			}
-		}
+	/* replacing it would also change its mode or owner */
+	if (!S_ISREG(st_old.st_mode) || st_old.st_size != st_new.st_size ||
+	    (st_old.st_mode & 07777) != (st_new.st_mode & 07777) ||
+	    st_old.st_uid != st_new.st_uid || st_old.st_gid != st_new.st_gid)
+		goto out;
 
-		r = itr->cb(depmod, fp);
-		if (fp == out)
-			continue;
+	if (st_new.st_size == 0) {
+		same = true;
+		goto out;
+	}
 
-		ferr = ferror(fp) | fclose(fp);
+	old = mmap(NULL, st_old.st_size, PROT_READ, MAP_PRIVATE, fd_old, 0);
+	new = mmap(NULL, st_new.st_size, PROT_READ, MAP_PRIVATE, fd_new, 0);
+	if (old == MAP_FAILED || new == MAP_FAILED)
+		goto out;
 
-		if (r < 0) {
-			tmpfile_release(&file);
+	same = memcmp(old, new, st_new.st_size) == 0;
 
-			ERR("Could not write index '%s': %s\n", itr->name, strerror(-r));
-			err = r;
-			break;
-		}
+out:
+	if (new != MAP_FAILED)
+		munmap(new, st_new.st_size);
+	if (old != MAP_FAILED)
+		munmap(old, st_old.st_size);
+	if (fd_new >= 0)
+		close(fd_new);
+	close(fd_old);
+
+	return same;
+}
+
+struct depfile {
+	const char *name;
+	int (*cb)(struct depmod *depmod, FILE *out);
+};
+
+/* Output file, written to a temporary file and published in order */
+struct depmod_output_file {
+	const struct depfile *depfile;
+	struct tmpfile file;
+	int r; /* of depfile->cb() */
+	int publish_err;
+	bool opened;
+	bool ferr;
+	bool unchanged; /* same as the file it would replace */
+	bool done;
+};
+
+struct depmod_output_pool {
+	struct depmod *depmod;
+	struct depmod_output_file *files;
+	size_t count;
+	int dfd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t next; /* next file to write */
+};
+
+static void depmod_output_write(struct depmod *depmod, int dfd,
+				struct depmod_output_file *f)
+{
+	FILE *fp;
+
+	fp = tmpfile_openat(dfd, 0644, &f->file);
+	if (fp == NULL)
+		return;
+	f->opened = true;
+
+	f->r = f->depfile->cb(depmod, fp);
+	f->ferr = ferror(fp) | fclose(fp);
+
+	if (f->r >= 0 && !f->ferr)
+		f->unchanged = depmod_file_is_unchanged(dfd, f->depfile->name,
+							f->file.tmpname);
+}
+
+static void *depmod_output_worker(void *data)
+{
+	struct depmod_output_pool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->count) {
+		struct depmod_output_file *f = &pool->files[pool->next++];
+
+		pthread_mutex_unlock(&pool->lock);
+		depmod_output_write(pool->depmod, pool->dfd, f);
+		pthread_mutex_lock(&pool->lock);
+
+		f->done = true;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* Returns negative errno if no more files should be published */
+static int depmod_output_publish(struct depmod *depmod, struct depmod_output_file *f)
+{
+	const char *name = f->depfile->name;
+	int err;
+
+	if (!f->opened) {
+		ERR("Could not create temporary file at '%s'\n", depmod->cfg->outdirname);
+		return 0;
+	}
+
+	if (f->r < 0) {
+		tmpfile_release(&f->file);
+
+		ERR("Could not write index '%s': %s\n", name, strerror(-f->r));
+		return f->r;
+	}
+
+	if (f->unchanged) {
+		DBG("%s is unchanged\n", name);
+		tmpfile_release(&f->file);
+		return 0;
+	}
+
+	err = tmpfile_publish(&f->file, name);
+	if (err != 0) {
+		/* fatal, reported once the other files are dropped */
+		f->publish_err = err;
+		return err;
+	}
+
+	if (f->ferr) {
+		err = -ENOSPC;
+		ERR("Could not create index '%s'. Output is truncated: %s\n", name,
+		    strerror(-err));
+		return err;
+	}
+
+	SHOW("Updated %s\n", name);
+
+	return 0;
+}
+
+/*
+ * The output files only read the loaded modules, so they are written by a pool
+ * of threads, with the biggest indexes at the same time. The main thread writes
+ * them too, and publishes them in order as soon as each one is ready: what
+ * ends up in the output directory is the same as if they were written one
+ * after the other, up to the first error.
+ */
+static int depmod_output_files(struct depmod *depmod, int dfd,
+			       struct depmod_output_file *files, size_t count)
+{
+	unsigned int jobs = depmod->cfg->jobs;
+	struct depmod_output_pool pool = {
+		.depmod = depmod,
+		.files = files,
+		.count = count,
+		.dfd = dfd,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	_cleanup_free_ pthread_t *threads = NULL;
+	unsigned int n_threads = 0;
+	int err = 0;
+	size_t i;
+
+	if (jobs > count)
+		jobs = count;
+
+	if (jobs > 1) {
+		threads = malloc((jobs - 1) * sizeof(*threads));
+		if (threads == NULL)
+			return -ENOMEM;
+	}
 
-		err = tmpfile_publish(&file, itr->name);
+	for (; n_threads + 1 < jobs; n_threads++) {
+		err = pthread_create(&threads[n_threads], NULL, depmod_output_worker,
+				     &pool);
 		if (err != 0) {
-			CRIT("publish temporary from %s to %s\n", file.tmpname, itr->name);
+			WRN("could not create thread, using %u: %s\n", n_threads,
+			    strerror(err));
+			err = 0;
 			break;
 		}
+	}
 
-		if (ferr) {
-			err = -ENOSPC;
-			ERR("Could not create index '%s'. Output is truncated: %s\n",
-			    itr->name, strerror(-err));
-			break;
+	for (i = 0; i < count && err == 0; i++) {
+		struct depmod_output_file *f = &files[i];
+
+		pthread_mutex_lock(&pool.lock);
+		/* write the next one here while waiting */
+		while (!f->done && pool.next < count) {
+			struct depmod_output_file *next = &files[pool.next++];
+
+			pthread_mutex_unlock(&pool.lock);
+			depmod_output_write(depmod, dfd, next);
+			pthread_mutex_lock(&pool.lock);
+			next->done = true;
+		}
+		while (!f->done)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		err = depmod_output_publish(depmod, f);
+		if (err < 0) {
+			pthread_mutex_lock(&pool.lock);
+			pool.next = count;
+			pthread_mutex_unlock(&pool.lock);
 		}
 	}
 
-	if (dfd >= 0)
+	for (unsigned int t = 0; t < n_threads; t++)
+		pthread_join(threads[t], NULL);
+
+	/* drop what was written after the error */
+	for (size_t j = i; j < count; j++) {
+		if (files[j].opened)
+			tmpfile_release(&files[j].file);
+	}
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+
+	if (err < 0 && files[i - 1].publish_err != 0)
+		CRIT("publish temporary from %s to %s\n", files[i - 1].file.tmpname,
+		     files[i - 1].depfile->name);
+
+	return err;
+}
+
+static int depmod_output(struct depmod *depmod, FILE *out)
+{
+	static const struct depfile depfiles[] = {
+		{ "modules.dep", output_deps },
+		{ "modules.dep.bin", output_deps_bin },
+		{ "modules.alias", output_aliases },
+		{ "modules.alias.bin", output_aliases_bin },
+		{ "modules.softdep", output_softdeps },
+		{ "modules.weakdep", output_weakdeps },
+		{ "modules.symbols", output_symbols },
+		{ "modules.symbols.bin", output_symbols_bin },
+		{ "modules.builtin.bin", output_builtin_bin },
+		{ "modules.builtin.alias.bin", output_builtin_alias_bin },
+		{ "modules.devname", output_devname },
+	};
+	_cleanup_free_ struct depmod_output_file *files = NULL;
+	const char *dname = depmod->cfg->outdirname;
+	int dfd, err;
+
+	if (out != NULL) {
+		for (size_t i = 0; i < ARRAY_SIZE(depfiles); i++)
+			depfiles[i].cb(depmod, out);
+		return 0;
+	}
+
+	err = mkdir_p(dname, strlen(dname), 0755);
+	if (err < 0) {
+		CRIT("could not create directory %s: %s\n", dname, strerror(-err));
+		return err;
+	}
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		err = -errno;
+		CRIT("could not open directory %s: %m\n", dname);
+		return err;
+	}
+
+	files = calloc(ARRAY_SIZE(depfiles), sizeof(*files));
+	if (files == NULL) {
 		close(dfd);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(depfiles); i++)
+		files[i].depfile = &depfiles[i];
+
+	err = depmod_output_files(depmod, dfd, files, ARRAY_SIZE(depfiles));
+
+	close(dfd);
+
+	return err;
+}
+
+static int depmod_output_cache(struct depmod *depmod)
+{
+	const char *dname = depmod->cfg->outdirname;
+	struct cache_header hdr = {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+	};
+	struct tmpfile file;
+	FILE *fp;
+	int dfd, err = 0;
+
+	for (size_t i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
 
+		if (mod->cacheable)
+			hdr.count++;
+	}
+
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		err = -errno;
+		ERR("could not open directory %s: %m\n", dname);
+		return err;
+	}
+
+	fp = tmpfile_openat(dfd, 0644, &file);
+	if (fp == NULL) {
+		err = -errno;
+		ERR("Could not create temporary file at '%s'\n", dname);
+		goto out;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (size_t i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+
+		if (mod->cacheable)
+			fwrite(mod->cache_entry, mod->cache_entry->len, 1, fp);
+	}
+
+	if (ferror(fp) | fclose(fp)) {
+		err = -ENOSPC;
+		ERR("Could not write %s: %s\n", CACHE_FILENAME, strerror(-err));
+		tmpfile_release(&file);
+		goto out;
+	}
+
+	if (depmod_file_is_unchanged(dfd, CACHE_FILENAME, file.tmpname)) {
+		DBG("%s is unchanged\n", CACHE_FILENAME);
+		tmpfile_release(&file);
+		goto out;
+	}
+
+	err = tmpfile_publish(&file, CACHE_FILENAME);
+	if (err != 0)
+		CRIT("publish temporary from %s to %s\n", file.tmpname, CACHE_FILENAME);
+
+out:
+	close(dfd);
 	return err;
 }
 
@@ -2680,193 +4788,766 @@ static int depmod_load_symvers(struct depmod *depmod, const char *filename)
 		if (!ver || !sym || !where)
 			continue;
 
-		if (!streq(where, "vmlinux"))
-			continue;
+		if (!streq(where, "vmlinux"))
+			continue;
+
+		errno = 0;
+		crc = strtoull(ver, &verend, 16);
+		if (verend[0] != '\0' || errno == ERANGE) {
+			ERR("%s:%u Invalid symbol version %s: %m\n", filename, linenum,
+			    ver);
+			continue;
+		}
+
+		depmod_symbol_add(depmod, sym, false, crc, NULL);
+	}
+	depmod_add_fake_syms(depmod);
+
+	DBG("loaded symvers: %s\n", filename);
+
+	fclose(fp);
+	return 0;
+}
+
+static int depmod_load_system_map(struct depmod *depmod, const char *filename)
+{
+	const char ksymstr[] = "__ksymtab_";
+	const size_t ksymstr_len = sizeof(ksymstr) - 1;
+	char line[10240];
+	FILE *fp;
+	unsigned int linenum = 0;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		int err = -errno;
+		DBG("load System.map: %s: %m\n", filename);
+		return err;
+	}
+	DBG("load System.map: %s\n", filename);
+
+	/* eg. c0294200 R __ksymtab_devfs_alloc_devnum */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *p, *end;
+
+		linenum++;
+
+		p = strchr(line, ' ');
+		if (p == NULL)
+			goto invalid_syntax;
+		p++;
+		p = strchr(p, ' ');
+		if (p == NULL)
+			goto invalid_syntax;
+		p++;
+
+		/* skip prefix */
+		if (p[0] == depmod->cfg->sym_prefix)
+			p++;
+
+		/* Covers gpl-only and normal symbols. */
+		if (!strstartswith(p, ksymstr))
+			continue;
+
+		end = strchr(p, '\n');
+		if (end != NULL)
+			*end = '\0';
+
+		depmod_symbol_add(depmod, p + ksymstr_len, true, 0, NULL);
+		continue;
+
+invalid_syntax:
+		ERR("%s:%u: invalid line: %s\n", filename, linenum, line);
+	}
+	depmod_add_fake_syms(depmod);
+
+	DBG("loaded System.map: %s\n", filename);
+
+	fclose(fp);
+	return 0;
+}
+
+static int depfile_up_to_date_dir(DIR *d, const struct timespec *ts, size_t baselen,
+				  char *path)
+{
+	struct dirent *de;
+	int err = 1, dfd = dirfd(d);
+
+	while ((de = readdir(d)) != NULL) {
+		const char *name = de->d_name;
+		size_t namelen;
+		struct stat st;
+
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (streq(name, "build") || streq(name, "source"))
+			continue;
+		namelen = strlen(name);
+		if (baselen + namelen + 2 >= PATH_MAX) {
+			path[baselen] = '\0';
+			ERR("path is too long %s%s\n", path, name);
+			continue;
+		}
+
+		if (fstatat(dfd, name, &st, 0) < 0) {
+			ERR("fstatat(%d, %s): %m\n", dfd, name);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			int fd;
+			DIR *subdir;
+			memcpy(path + baselen, name, namelen + 1);
+			if (baselen + namelen + 2 + NAME_MAX >= PATH_MAX) {
+				ERR("directory path is too long %s\n", path);
+				continue;
+			}
+			fd = openat(dfd, name, O_RDONLY);
+			if (fd < 0) {
+				ERR("openat(%d, %s, O_RDONLY): %m\n", dfd, name);
+				continue;
+			}
+			subdir = fdopendir(fd);
+			if (subdir == NULL) {
+				ERR("fdopendir(%d): %m\n", fd);
+				close(fd);
+				continue;
+			}
+			path[baselen + namelen] = '/';
+			path[baselen + namelen + 1] = '\0';
+			err = depfile_up_to_date_dir(subdir, ts, baselen + namelen + 1,
+						     path);
+			closedir(subdir);
+		} else if (S_ISREG(st.st_mode)) {
+			if (!path_ends_with_kmod_ext(name, namelen))
+				continue;
+
+			memcpy(path + baselen, name, namelen + 1);
+			err = ts_usec(&st.st_mtim) <= ts_usec(ts);
+			if (err == 0) {
+				DBG("%s %" PRIu64 " is newer than %" PRIu64 "\n", path,
+				    (uint64_t)ts_usec(&st.st_mtim),
+				    (uint64_t)ts_usec(ts));
+			}
+		} else {
+			ERR("unsupported file type %s: %o\n", path, st.st_mode & S_IFMT);
+			continue;
+		}
+
+		if (err == 0)
+			break; /* outdated! */
+		else if (err < 0) {
+			path[baselen + namelen] = '\0';
+			ERR("failed %s: %s\n", path, strerror(-err));
+			err = 1; /* ignore errors */
+		}
+	}
+
+	return err;
+}
+
+/* up-to-date: 1, outdated: 0, errors < 0 */
+static int depfile_up_to_date(const char *dirname)
+{
+	char path[PATH_MAX + 1];
+	DIR *d = opendir(dirname);
+	struct stat st;
+	size_t baselen;
+	int err;
+	if (d == NULL) {
+		err = -errno;
+		ERR("could not open directory %s: %m\n", dirname);
+		return err;
+	}
+
+	if (fstatat(dirfd(d), "modules.dep", &st, 0) != 0) {
+		err = -errno;
+		ERR("could not fstatat(%s, modules.dep): %m\n", dirname);
+		closedir(d);
+		return err;
+	}
+
+	baselen = strlen(dirname);
+	memcpy(path, dirname, baselen);
+	path[baselen] = '/';
+	baselen++;
+	path[baselen] = '\0';
+
+	err = depfile_up_to_date_dir(d, &st.st_mtim, baselen, path);
+	closedir(d);
+	return err;
+}
+
+/*
+ * With -A, depmod only runs if something changed since modules.dep was
+ * written. Finding out means reading every directory and stat-ing every module,
+ * so when all the modules are examined a snapshot of the module directory and of
+ * the configuration, taken before reading them, is also kept in
+ * modules.depmod-tree.bin:
+ *
+ *   struct tree_header
+ *   struct tree_entry, path as a NUL-terminated string, padding to 8 bytes
+ *   ...
+ *
+ * The snapshot is only used if modules.dep is still the file it was written
+ * with. Then each module and configuration file only needs a stat, and only the
+ * directories whose stamp changed need to be read again, to look for new
+ * entries.
+ */
+#define TREE_FILENAME "modules.depmod-tree.bin"
+#define TREE_MAGIC 0x4b4d4454 /* "KMDT" */
+#define TREE_VERSION 1
+
+enum tree_entry_type {
+	TREE_DIR = 1, /* relative to the module directory */
+	TREE_MODULE, /* relative to the module directory */
+	TREE_CONFIG, /* absolute, all zeros if it didn't exist */
+};
+
+struct tree_stamp {
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+};
+
+struct tree_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+	struct tree_stamp depfile; /* modules.dep */
+};
+
+struct tree_entry {
+	uint32_t len;
+	uint32_t type;
+	struct tree_stamp stamp;
+};
+
+static void tree_stamp_set(struct tree_stamp *ts, const struct stat *st)
+{
+	ts->ino = st->st_ino;
+	ts->size = st->st_size;
+	ts->mtime_sec = st->st_mtim.tv_sec;
+	ts->mtime_nsec = st->st_mtim.tv_nsec;
+	ts->ctime_sec = st->st_ctim.tv_sec;
+	ts->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static bool tree_stamp_matches(const struct tree_stamp *ts, const struct stat *st)
+{
+	struct tree_stamp cur = {};
+
+	if (st != NULL)
+		tree_stamp_set(&cur, st);
+
+	return memcmp(ts, &cur, sizeof(cur)) == 0;
+}
+
+static inline const char *tree_entry_path(const struct tree_entry *e)
+{
+	return (const char *)(e + 1);
+}
+
+static bool tree_entry_is_valid(const struct tree_entry *e, size_t len)
+{
+	if (len < sizeof(*e) || e->len <= sizeof(*e) || e->len > len || e->len % 8 != 0)
+		return false;
+
+	if (e->type < TREE_DIR || e->type > TREE_CONFIG)
+		return false;
+
+	return memchr(tree_entry_path(e), '\0', e->len - sizeof(*e)) != NULL;
+}
+
+static bool tree_add(struct strbuf *tree, enum tree_entry_type type, const char *path,
+		     const struct stat *st)
+{
+	static const char zeros[8];
+	size_t pathlen = strlen(path) + 1;
+	struct tree_entry e = {
+		.len = (sizeof(e) + pathlen + 7) & ~(size_t)7,
+		.type = type,
+	};
+
+	if (st != NULL)
+		tree_stamp_set(&e.stamp, st);
+
+	return strbuf_pushmem(tree, (const char *)&e, sizeof(e)) == sizeof(e) &&
+	       strbuf_pushmem(tree, path, pathlen) == pathlen &&
+	       strbuf_pushmem(tree, zeros, e.len - sizeof(e) - pathlen) ==
+		       e.len - sizeof(e) - pathlen;
+}
+
+static bool tree_skip_name(const char *name)
+{
+	if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+		return true;
+
+	return streq(name, "build") || streq(name, "source");
+}
+
+/*
+ * What's kept of the entry @de of @d: TREE_DIR or TREE_MODULE, filling @st, or
+ * 0 if nothing. Like in depfile_up_to_date_dir(), only directories and modules
+ * are looked at, and what can't be stat'ed is ignored.
+ */
+static int tree_dirent_type(DIR *d, const struct dirent *de, struct stat *st)
+{
+	const char *name = de->d_name;
+	bool is_module;
+
+	if (tree_skip_name(name))
+		return 0;
+
+	is_module = path_ends_with_kmod_ext(name, strlen(name));
+	if (de->d_type == DT_REG && !is_module)
+		return 0;
+
+	if (fstatat(dirfd(d), name, st, 0) < 0) {
+		DBG("fstatat(%d, %s): %m\n", dirfd(d), name);
+		return 0;
+	}
+
+	if (S_ISDIR(st->st_mode))
+		return TREE_DIR;
+	if (S_ISREG(st->st_mode) && is_module)
+		return TREE_MODULE;
+
+	return 0;
+}
+
+/* Append @name to the relative @path of length @len, empty for the top directory */
+static size_t tree_path_join(char *path, size_t len, const char *name)
+{
+	size_t namelen = strlen(name);
+
+	if (len > 0)
+		path[len++] = '/';
+
+	if (len + namelen >= PATH_MAX)
+		return 0;
+
+	memcpy(path + len, name, namelen + 1);
+	return len + namelen;
+}
+
+/*
+ * Add the modules in @dfd, which is closed, then its directories and what's in
+ * them, so the modules of a directory are next to each other.
+ */
+static int tree_add_dir(struct strbuf *tree, int dfd, char *path, size_t len)
+{
+	struct dirent *de;
+	DIR *d;
+	int err = 0;
+
+	d = fdopendir(dfd);
+	if (d == NULL) {
+		err = -errno;
+		close(dfd);
+		return err;
+	}
+
+	for (int dirs = 0; dirs <= 1 && err == 0; dirs++) {
+		if (dirs)
+			rewinddir(d);
+
+		while (err == 0 && (de = readdir(d)) != NULL) {
+			struct stat st;
+			size_t sublen;
+			int type, fd;
+
+			if (de->d_type == (dirs ? DT_REG : DT_DIR))
+				continue;
+
+			type = tree_dirent_type(d, de, &st);
+			if (type == 0 || (type == TREE_DIR) != dirs)
+				continue;
+
+			sublen = tree_path_join(path, len, de->d_name);
+			if (sublen == 0) {
+				err = -ENAMETOOLONG;
+				break;
+			}
+
+			if (!tree_add(tree, type, path, &st)) {
+				err = -ENOMEM;
+			} else if (type == TREE_DIR) {
+				fd = openat(dirfd(d), de->d_name,
+					    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (fd < 0)
+					err = -errno;
+				else
+					err = tree_add_dir(tree, fd, path, sublen);
+			}
+
+			path[len] = '\0';
+		}
+	}
+
+	path[len] = '\0';
+	closedir(d);
+	return err;
+}
+
+static int tree_add_config(struct strbuf *tree, const char *const *cfg_paths)
+{
+	struct cfg_file **files = NULL;
+	size_t n_files = 0;
+	struct stat st;
+	int err = 0;
+
+	if (cfg_paths == NULL)
+		cfg_paths = default_cfg_paths;
+
+	for (size_t i = 0; cfg_paths[i] != NULL; i++) {
+		const char *path = cfg_paths[i];
+		bool exists = stat(path, &st) == 0;
+
+		if (!tree_add(tree, TREE_CONFIG, path, exists ? &st : NULL))
+			err = -ENOMEM;
+		else if (exists)
+			cfg_files_list(&files, &n_files, path);
+	}
+
+	for (size_t i = 0; i < n_files; i++) {
+		struct cfg_file *f = files[i];
+		bool exists = stat(f->path, &st) == 0;
+
+		if (err == 0 && !tree_add(tree, TREE_CONFIG, f->path, exists ? &st : NULL))
+			err = -ENOMEM;
+		cfg_file_free(f);
+	}
+	free(files);
+
+	return err;
+}
+
+/*
+ * Take the snapshot written by depmod_output_tree(), before the configuration
+ * and the modules are read: whatever changes after that is seen by the next
+ * depfile_tree_up_to_date().
+ */
+static void depmod_tree_snapshot(struct depmod *depmod, const char *const *cfg_paths)
+{
+	const char *dname = depmod->cfg->dirname;
+	char path[PATH_MAX] = "";
+	struct stat st, outst;
+	bool is_outdir;
+	int dfd, err;
+
+	dfd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (fstat(dfd, &st) < 0) {
+		err = -errno;
+		close(dfd);
+		goto fail;
+	}
 
-		errno = 0;
-		crc = strtoull(ver, &verend, 16);
-		if (verend[0] != '\0' || errno == ERANGE) {
-			ERR("%s:%u Invalid symbol version %s: %m\n", filename, linenum,
-			    ver);
-			continue;
-		}
+	/*
+	 * Writing the outputs changes the directory they are in on each run: keep
+	 * no stamp for it, so it's always read again to look for new entries, and
+	 * the snapshot only changes with the modules and the configuration
+	 */
+	is_outdir = stat(depmod->cfg->outdirname, &outst) == 0 &&
+		    outst.st_dev == st.st_dev && outst.st_ino == st.st_ino;
 
-		depmod_symbol_add(depmod, sym, false, crc, NULL);
+	err = tree_add_config(&depmod->tree, cfg_paths);
+	if (err == 0 && !tree_add(&depmod->tree, TREE_DIR, ".", is_outdir ? NULL : &st))
+		err = -ENOMEM;
+	if (err < 0) {
+		close(dfd);
+		goto fail;
 	}
-	depmod_add_fake_syms(depmod);
 
-	DBG("loaded symvers: %s\n", filename);
+	err = tree_add_dir(&depmod->tree, dfd, path, 0);
+	if (err < 0)
+		goto fail;
 
-	fclose(fp);
-	return 0;
+	return;
+
+fail:
+	DBG("no snapshot of %s: %s\n", dname, strerror(-err));
+	strbuf_clear(&depmod->tree);
 }
 
-static int depmod_load_system_map(struct depmod *depmod, const char *filename)
+static int depmod_output_tree(struct depmod *depmod)
 {
-	const char ksymstr[] = "__ksymtab_";
-	const size_t ksymstr_len = sizeof(ksymstr) - 1;
-	char line[10240];
+	const char *dname = depmod->cfg->outdirname;
+	struct tree_header hdr = {
+		.magic = TREE_MAGIC,
+		.version = TREE_VERSION,
+	};
+	const char *p = depmod->tree.bytes;
+	const char *end = p + strbuf_used(&depmod->tree);
+	struct tmpfile file;
+	struct stat st;
 	FILE *fp;
-	unsigned int linenum = 0;
-
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		int err = -errno;
-		DBG("load System.map: %s: %m\n", filename);
-		return err;
-	}
-	DBG("load System.map: %s\n", filename);
+	int dfd, err = 0;
 
-	/* eg. c0294200 R __ksymtab_devfs_alloc_devnum */
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		char *p, *end;
+	if (p == end)
+		return 0;
 
-		linenum++;
+	for (; p < end; p += ((const struct tree_entry *)p)->len)
+		hdr.count++;
 
-		p = strchr(line, ' ');
-		if (p == NULL)
-			goto invalid_syntax;
-		p++;
-		p = strchr(p, ' ');
-		if (p == NULL)
-			goto invalid_syntax;
-		p++;
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		err = -errno;
+		ERR("could not open directory %s: %m\n", dname);
+		return err;
+	}
 
-		/* skip prefix */
-		if (p[0] == depmod->cfg->sym_prefix)
-			p++;
+	if (fstatat(dfd, "modules.dep", &st, 0) < 0) {
+		err = -errno;
+		ERR("could not fstatat(%s, modules.dep): %m\n", dname);
+		goto out;
+	}
+	tree_stamp_set(&hdr.depfile, &st);
 
-		/* Covers gpl-only and normal symbols. */
-		if (!strstartswith(p, ksymstr))
-			continue;
+	fp = tmpfile_openat(dfd, 0644, &file);
+	if (fp == NULL) {
+		err = -errno;
+		ERR("Could not create temporary file at '%s'\n", dname);
+		goto out;
+	}
 
-		end = strchr(p, '\n');
-		if (end != NULL)
-			*end = '\0';
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(depmod->tree.bytes, strbuf_used(&depmod->tree), 1, fp);
 
-		depmod_symbol_add(depmod, p + ksymstr_len, true, 0, NULL);
-		continue;
+	if (ferror(fp) | fclose(fp)) {
+		err = -ENOSPC;
+		ERR("Could not write %s: %s\n", TREE_FILENAME, strerror(-err));
+		tmpfile_release(&file);
+		goto out;
+	}
 
-invalid_syntax:
-		ERR("%s:%u: invalid line: %s\n", filename, linenum, line);
+	if (depmod_file_is_unchanged(dfd, TREE_FILENAME, file.tmpname)) {
+		DBG("%s is unchanged\n", TREE_FILENAME);
+		tmpfile_release(&file);
+		goto out;
 	}
-	depmod_add_fake_syms(depmod);
 
-	DBG("loaded System.map: %s\n", filename);
+	err = tmpfile_publish(&file, TREE_FILENAME);
+	if (err != 0)
+		CRIT("publish temporary from %s to %s\n", file.tmpname, TREE_FILENAME);
 
-	fclose(fp);
-	return 0;
+out:
+	close(dfd);
+	return err;
 }
 
-static int depfile_up_to_date_dir(DIR *d, const struct timespec *ts, size_t baselen,
-				  char *path)
+/*
+ * Whether the changed directory @path in @dfd has no module or directory that
+ * isn't in the snapshot, from @begin to @end. Removed ones are found by their
+ * own stamp.
+ */
+static bool tree_dir_has_no_new_entry(int dfd, const char *path, const uint8_t *begin,
+				      const uint8_t *end)
 {
+	size_t len = streq(path, ".") ? 0 : strlen(path);
+	struct hash *children;
 	struct dirent *de;
-	int err = 1, dfd = dirfd(d);
+	bool ret = true;
+	DIR *d;
+	int fd;
 
-	while ((de = readdir(d)) != NULL) {
-		const char *name = de->d_name;
-		size_t namelen;
-		struct stat st;
+	children = hash_new(64, NULL);
+	if (children == NULL)
+		return false;
 
-		if (name[0] == '.' &&
-		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
-			continue;
-		if (streq(name, "build") || streq(name, "source"))
-			continue;
-		namelen = strlen(name);
-		if (baselen + namelen + 2 >= PATH_MAX) {
-			path[baselen] = '\0';
-			ERR("path is too long %s%s\n", path, name);
-			continue;
-		}
+	for (const uint8_t *p = begin; p < end; p += ((const struct tree_entry *)p)->len) {
+		const struct tree_entry *e = (const struct tree_entry *)p;
+		const char *name = tree_entry_path(e);
 
-		if (fstatat(dfd, name, &st, 0) < 0) {
-			ERR("fstatat(%d, %s): %m\n", dfd, name);
+		if (e->type == TREE_CONFIG)
 			continue;
-		}
 
-		if (S_ISDIR(st.st_mode)) {
-			int fd;
-			DIR *subdir;
-			memcpy(path + baselen, name, namelen + 1);
-			if (baselen + namelen + 2 + NAME_MAX >= PATH_MAX) {
-				ERR("directory path is too long %s\n", path);
-				continue;
-			}
-			fd = openat(dfd, name, O_RDONLY);
-			if (fd < 0) {
-				ERR("openat(%d, %s, O_RDONLY): %m\n", dfd, name);
-				continue;
-			}
-			subdir = fdopendir(fd);
-			if (subdir == NULL) {
-				ERR("fdopendir(%d): %m\n", fd);
-				close(fd);
-				continue;
-			}
-			path[baselen + namelen] = '/';
-			path[baselen + namelen + 1] = '\0';
-			err = depfile_up_to_date_dir(subdir, ts, baselen + namelen + 1,
-						     path);
-			closedir(subdir);
-		} else if (S_ISREG(st.st_mode)) {
-			if (!path_ends_with_kmod_ext(name, namelen))
+		if (len > 0) {
+			if (strncmp(name, path, len) != 0 || name[len] != '/')
 				continue;
+			name += len + 1;
+		}
 
-			memcpy(path + baselen, name, namelen + 1);
-			err = ts_usec(&st.st_mtim) <= ts_usec(ts);
-			if (err == 0) {
-				DBG("%s %" PRIu64 " is newer than %" PRIu64 "\n", path,
-				    (uint64_t)ts_usec(&st.st_mtim),
-				    (uint64_t)ts_usec(ts));
-			}
-		} else {
-			ERR("unsupported file type %s: %o\n", path, st.st_mode & S_IFMT);
-			continue;
+		if (strchr(name, '/') == NULL && hash_add(children, name, e) < 0) {
+			hash_free(children);
+			return false;
 		}
+	}
 
-		if (err == 0)
-			break; /* outdated! */
-		else if (err < 0) {
-			path[baselen + namelen] = '\0';
-			ERR("failed %s: %s\n", path, strerror(-err));
-			err = 1; /* ignore errors */
+	fd = openat(dfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	d = fd < 0 ? NULL : fdopendir(fd);
+	if (d == NULL) {
+		if (fd >= 0)
+			close(fd);
+		hash_free(children);
+		return false;
+	}
+
+	while (ret && (de = readdir(d)) != NULL) {
+		struct stat st;
+		int type = tree_dirent_type(d, de, &st);
+
+		if (type > 0 && hash_find(children, de->d_name) == NULL) {
+			DBG("%s%s%s is new\n", len > 0 ? path : "", len > 0 ? "/" : "",
+			    de->d_name);
+			ret = false;
 		}
 	}
 
-	return err;
+	closedir(d);
+	hash_free(children);
+	return ret;
 }
 
-/* up-to-date: 1, outdated: 0, errors < 0 */
-static int depfile_up_to_date(const char *dirname)
+/*
+ * Check against the snapshot in TREE_FILENAME whether the module directory
+ * and the configuration didn't change since modules.dep was written. Returns 1
+ * if they didn't, 0 if they did and < 0 if there's no usable snapshot.
+ */
+static int depfile_tree_up_to_date(const struct cfg *cfg)
 {
-	char path[PATH_MAX + 1];
-	DIR *d = opendir(dirname);
+	const struct tree_header *hdr;
+	const uint8_t *begin, *p, *end;
+	char parent[PATH_MAX];
+	size_t parentlen = 0;
 	struct stat st;
-	size_t baselen;
-	int err;
-	if (d == NULL) {
+	size_t size;
+	void *map;
+	int odfd, dfd = -1, pfd = -1, fd, err;
+
+	odfd = open(cfg->outdirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (odfd < 0)
+		return -errno;
+
+	fd = openat(odfd, TREE_FILENAME, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		err = -errno;
-		ERR("could not open directory %s: %m\n", dirname);
+		DBG("no snapshot %s/%s: %m\n", cfg->outdirname, TREE_FILENAME);
+		close(odfd);
 		return err;
 	}
 
-	if (fstatat(dirfd(d), "modules.dep", &st, 0) != 0) {
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		close(odfd);
+		return -EINVAL;
+	}
+
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		close(odfd);
+		return -ENOMEM;
+	}
+
+	hdr = map;
+	begin = (const uint8_t *)(hdr + 1);
+	end = (const uint8_t *)map + size;
+	err = -EINVAL;
+
+	if (hdr->magic != TREE_MAGIC || hdr->version != TREE_VERSION) {
+		DBG("ignoring snapshot %s: unknown format\n", TREE_FILENAME);
+		goto out;
+	}
+
+	p = begin;
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		const struct tree_entry *e = (const struct tree_entry *)p;
+
+		if (!tree_entry_is_valid(e, end - p)) {
+			WRN("ignoring corrupted snapshot %s/%s\n", cfg->outdirname,
+			    TREE_FILENAME);
+			goto out;
+		}
+		p += e->len;
+	}
+	end = p;
+
+	if (fstatat(odfd, "modules.dep", &st, 0) < 0 ||
+	    !tree_stamp_matches(&hdr->depfile, &st)) {
+		DBG("ignoring snapshot %s: modules.dep changed\n", TREE_FILENAME);
+		err = -ESTALE;
+		goto out;
+	}
+
+	dfd = open(cfg->dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
 		err = -errno;
-		ERR("could not fstatat(%s, modules.dep): %m\n", dirname);
-		closedir(d);
-		return err;
+		goto out;
 	}
 
-	baselen = strlen(dirname);
-	memcpy(path, dirname, baselen);
-	path[baselen] = '/';
-	baselen++;
-	path[baselen] = '\0';
+	/*
+	 * Directories and configuration files go first: adding or removing
+	 * modules changes their directory, so that's usually enough to tell.
+	 * Modules are then looked up from their directory, which they share with
+	 * the entries next to them.
+	 */
+	err = 1;
+	for (int modules = 0; modules <= 1 && err == 1; modules++) {
+		for (p = begin; p < end && err == 1; p += ((const struct tree_entry *)p)->len) {
+			const struct tree_entry *e = (const struct tree_entry *)p;
+			const char *path = tree_entry_path(e);
+			const char *name;
+			bool exists;
+
+			if ((e->type == TREE_MODULE) != modules)
+				continue;
 
-	err = depfile_up_to_date_dir(d, &st.st_mtim, baselen, path);
-	closedir(d);
+			if (e->type == TREE_CONFIG) {
+				exists = stat(path, &st) == 0;
+			} else if (e->type == TREE_DIR) {
+				exists = fstatat(dfd, path, &st, 0) == 0;
+			} else {
+				name = strrchr(path, '/');
+				name = name != NULL ? name + 1 : path;
+
+				if ((size_t)(name - path) >= sizeof(parent)) {
+					err = -ENAMETOOLONG;
+					break;
+				}
+
+				if (pfd < 0 || (size_t)(name - path) != parentlen ||
+				    memcmp(parent, path, parentlen) != 0) {
+					if (pfd >= 0)
+						close(pfd);
+					parentlen = name - path;
+					memcpy(parent, path, parentlen);
+					parent[parentlen] = '\0';
+					pfd = openat(dfd, parentlen > 0 ? parent : ".",
+						     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				}
+
+				exists = pfd >= 0 && fstatat(pfd, name, &st, 0) == 0;
+			}
+
+			if (tree_stamp_matches(&e->stamp, exists ? &st : NULL))
+				continue;
+
+			if (e->type != TREE_DIR || !exists || !S_ISDIR(st.st_mode) ||
+			    !tree_dir_has_no_new_entry(dfd, path, begin, end)) {
+				DBG("%s changed\n", path);
+				err = 0;
+			}
+		}
+	}
+
+out:
+	if (pfd >= 0)
+		close(pfd);
+	if (dfd >= 0)
+		close(dfd);
+	close(odfd);
+	munmap(map, size);
 	return err;
 }
 
@@ -2879,7 +5560,7 @@ static int is_version_number(const char *version)
 static int do_depmod(int argc, char *argv[])
 {
 	FILE *out = NULL;
-	int err = 0, all = 0, maybe_all = 0, n_config_paths = 0;
+	int err = 0, all = 0, maybe_all = 0, update = 0, n_config_paths = 0;
 	_cleanup_free_ char *root_arg = NULL;
 	_cleanup_free_ char *out_root = NULL;
 	_cleanup_free_ const char **config_paths = NULL;
@@ -2908,6 +5589,9 @@ static int do_depmod(int argc, char *argv[])
 		case 'A':
 			maybe_all = 1;
 			break;
+		case 1:
+			update = 1;
+			break;
 		case 'b':
 			free(root_arg);
 			root_arg = path_make_absolute_cwd(optarg);
@@ -2952,6 +5636,20 @@ static int do_depmod(int argc, char *argv[])
 		case 'e':
 			cfg.print_unknown = 1;
 			break;
+		case 'j': {
+			char *end;
+			unsigned long jobs;
+
+			errno = 0;
+			jobs = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || jobs == 0 ||
+			    jobs > UINT_MAX) {
+				ERR("invalid number of jobs: %s\n", optarg);
+				goto cmdline_failed;
+			}
+			cfg.jobs = jobs;
+			break;
+		}
 		case 'v':
 			verbose++;
 			break;
@@ -2982,6 +5680,12 @@ static int do_depmod(int argc, char *argv[])
 		}
 	}
 
+	if (cfg.jobs == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		cfg.jobs = n > 0 ? n : 1;
+	}
+
 	if (optind < argc) {
 		if (!is_version_number(argv[optind])) {
 			ERR("Bad version passed %s\n", argv[optind]);
@@ -3017,14 +5721,33 @@ static int do_depmod(int argc, char *argv[])
 		goto cmdline_failed;
 	}
 
+	if (update) {
+		if (all || maybe_all || optind == argc) {
+			ERR("--update needs modules and can't be used with -a or -A\n");
+			goto cmdline_failed;
+		}
+
+		for (int i = optind; i < argc; i++) {
+			if (argv[i][0] != '/') {
+				CRIT("%s: not absolute path.\n", argv[i]);
+				goto cmdline_failed;
+			}
+		}
+	}
+
 	if (optind == argc)
 		all = 1;
 
 	if (maybe_all) {
+		int up_to_date;
+
 		if (out == stdout)
 			goto done;
-		/* ignore up-to-date errors (< 0) */
-		if (depfile_up_to_date(cfg.dirname) == 1)
+		/* without a usable snapshot, look at the whole tree; ignore errors */
+		up_to_date = depfile_tree_up_to_date(&cfg);
+		if (up_to_date < 0)
+			up_to_date = depfile_up_to_date(cfg.dirname);
+		if (up_to_date == 1)
 			goto done;
 		all = 1;
 	}
@@ -3061,13 +5784,19 @@ static int do_depmod(int argc, char *argv[])
 		cfg.print_unknown = 0;
 	}
 
-	if (all) {
+	if (all && out == NULL)
+		depmod_tree_snapshot(&depmod, config_paths);
+
+	if (all || update) {
 		err = cfg_load(&cfg, config_paths);
 		if (err < 0) {
 			CRIT("could not load configuration files\n");
 			goto cmdline_modules_failed;
 		}
-		err = depmod_modules_search(&depmod);
+		if (update)
+			err = depmod_modules_update(&depmod, argv + optind, argc - optind);
+		else
+			err = depmod_modules_search(&depmod);
 		if (err < 0) {
 			CRIT("could not search modules: %s\n", strerror(-err));
 			goto cmdline_modules_failed;
@@ -3108,12 +5837,19 @@ static int do_depmod(int argc, char *argv[])
 	}
 
 	depmod_modules_sort(&depmod);
+	depmod_load_cache(&depmod);
 	err = depmod_load(&depmod);
 	if (err < 0)
 		goto cmdline_modules_failed;
 
 	err = depmod_output(&depmod, out);
 
+	/* only a search of all the modules has everything the next run needs */
+	if (err >= 0 && (all || update) && out == NULL)
+		depmod_output_cache(&depmod);
+	if (err >= 0 && all && out == NULL)
+		depmod_output_tree(&depmod);
+
 done:
 	depmod_shutdown(&depmod);
 	cfg_free(&cfg);